@@ -3,20 +3,56 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
 #pragma once
 
+#include <atomic>
+#include <exception>
+#include <thread>
 #include <boost/preprocessor/seq.hpp>
 #include <boost/preprocessor/variadic.hpp>
 #include <boost/bimap.hpp>
 #include <ROOT/RDataFrame.hxx>
+#include <TChain.h>
+#include <RVersion.h>
 #include "AnalysisTools/Core/include/SmartTree.h"
 #include "AnalysisTools/Core/include/AnalysisMath.h"
 #include "AnalysisTools/Core/include/NumericPrimitives.h"
 #include "AnalysisTools/Core/include/RootExt.h"
+#include "AnalysisTools/Run/include/EntryQueue.h"
 #include "h-tautau/Analysis/include/EventInfo.h"
 #include "EventAnalyzerDataId.h"
+#include "FitResultsCache.h"
+#include "PackedDataId.h"
 #include "h-tautau/Core/include/TauIdResults.h"
 
+// RNTuple output requires the RNTuple support of RDataFrame, which allows to read it transparently.
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,32,0)
+#define ANA_TUPLE_HAS_RNTUPLE
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleReader.hxx>
+#include <ROOT/RNTupleWriteOptions.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+#endif
+
 namespace analysis {
 
+#ifdef ANA_TUPLE_HAS_RNTUPLE
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,36,0)
+namespace rntuple = ::ROOT;
+#else
+namespace rntuple = ::ROOT::Experimental;
+#endif
+#endif
+
+enum class AnaTupleBackend { TTree = 0, RNTuple = 1 };
+ENUM_NAMES(AnaTupleBackend) = {
+    { AnaTupleBackend::TTree, "TTree" }, { AnaTupleBackend::RNTuple, "RNTuple" }
+};
+
+enum class AnaTupleCompression { ZLIB = 0, LZMA = 1, LZ4 = 2, ZSTD = 3 };
+ENUM_NAMES(AnaTupleCompression) = {
+    { AnaTupleCompression::ZLIB, "ZLIB" }, { AnaTupleCompression::LZMA, "LZMA" },
+    { AnaTupleCompression::LZ4, "LZ4" }, { AnaTupleCompression::ZSTD, "ZSTD" }
+};
+
 #define CREATE_VAR(r, type, name) VAR(type, name)
 #define VAR_LIST(type, ...) BOOST_PP_SEQ_FOR_EACH(CREATE_VAR, type, BOOST_PP_VARIADIC_TO_SEQ(__VA_ARGS__))
 
@@ -38,7 +74,9 @@ namespace analysis {
 
 #define ANA_EVENT_DATA() \
     VAR(std::vector<size_t>, dataIds) /* EventAnalyzerDataId */ \
+    VAR(std::vector<UShort_t>, dataId_codes) /* index of EventAnalyzerDataId in the aux dictionary */ \
     VAR(std::vector<double>, all_weights) /* all weight */ \
+    VAR(std::vector<float>, all_weights_f) /* all weight in single precision */ \
     VAR(std::vector<float>, all_mva_scores) /* all mva scores */ \
     VAR_LIST(bool, has_b_pair, has_VBF_pair) /* has 2 jets */ \
     VAR(bool, pass_VBF_trigger) \
@@ -75,6 +113,33 @@ struct AnaEvent : public root_ext::detail::BaseDataClass {
 };
 #undef VAR
 
+#ifdef ANA_TUPLE_HAS_RNTUPLE
+template<typename T> struct AnaNTupleFieldType { using type = T; };
+template<> struct AnaNTupleFieldType<unsigned long long> { using type = std::uint64_t; };
+
+// Fields of the RNTuple output, which have the same names and content as the branches of AnaTuple.
+struct AnaNTupleFields {
+#define VAR(type, name) std::shared_ptr<typename AnaNTupleFieldType<type>::type> name;
+    ANA_EVENT_DATA()
+#undef VAR
+
+    AnaNTupleFields(rntuple::RNTupleModel& model, const std::set<std::string>& disabled_fields)
+    {
+#define VAR(type, name) \
+    if(!disabled_fields.count(#name)) name = model.MakeField<typename AnaNTupleFieldType<type>::type>(#name);
+        ANA_EVENT_DATA()
+#undef VAR
+    }
+
+    void Assign(const AnaEvent& event)
+    {
+#define VAR(type, name) if(name) *name = static_cast<typename AnaNTupleFieldType<type>::type>(event.name);
+        ANA_EVENT_DATA()
+#undef VAR
+    }
+};
+#endif
+
 #define VAR(type, name) AddBranch(#name, _data->name);
 
 class AnaTuple : public root_ext::detail::BaseSmartTree<AnaEvent> {
@@ -155,20 +220,65 @@ public:
     using Range = ::analysis::Range<double>;
     using RangeMap = std::map<SelectionCut, Range>;
 
-    AnaTupleWriter(const std::string& file_name, Channel channel, bool _runKinFit, bool _runSVfit, bool _allow_calc_svFit);
+    struct Options {
+        AnaTupleBackend backend{AnaTupleBackend::TTree};
+        AnaTupleCompression compression{AnaTupleCompression::LZ4};
+        int compression_level{4};
+        // Approximate compressed size of a cluster in bytes. If 0, the default of the backend is used.
+        size_t cluster_size{0};
+        // Data ids are stored as 16-bit indices in the aux dictionary (dataId_codes) instead of 64-bit hashes.
+        // AddEvent throws if the number of data ids exceeds 65536.
+        bool index_data_ids{false};
+        // Weights are stored in single precision (all_weights_f) instead of double precision.
+        bool float_weights{false};
+        // Maximal number of events buffered for the writer thread. If 0, events are written synchronously by
+        // AddEvent, otherwise the filling and the compression of the output are done by a dedicated thread.
+        size_t write_buffer_size{0};
+
+        std::set<std::string> GetDisabledBranches() const;
+    };
+
+    AnaTupleWriter(const std::string& file_name, Channel channel, bool _runKinFit, bool _runSVfit,
+                   bool _allow_calc_svFit, const Options& _options = Options());
+    AnaTupleWriter(const AnaTupleWriter&) = delete;
+    AnaTupleWriter& operator=(const AnaTupleWriter&) = delete;
     ~AnaTupleWriter();
-    void AddEvent(EventInfo& event, const DataIdMap& dataIds, const bool pass_VBF_trigger);
+    // If fit_results is provided, SVfit and KinFit results are taken from it instead of the event.
+    void AddEvent(EventInfo& event, const DataIdMap& dataIds, const bool pass_VBF_trigger,
+                  EventFitResults* fit_results = nullptr);
+    // Writes all buffered events and the aux information into the output file. An error raised by the writer
+    // thread is rethrown. Called by the destructor, if not called explicitly.
+    void Close();
+
+private:
+    using EventQueue = run::EntryQueue<std::shared_ptr<AnaEvent>>;
+
+    void FillTuple();
+    void WriteThread();
 
 private:
+    Options options;
     std::shared_ptr<TFile> file;
     AnaTuple tuple;
     AnaAuxTuple aux_tuple;
+#ifdef ANA_TUPLE_HAS_RNTUPLE
+    std::unique_ptr<AnaNTupleFields> ntuple_fields;
+    std::unique_ptr<rntuple::RNTupleWriter> ntuple_writer;
+#endif
     bool runKinFit;
     bool runSVfit;
     bool allow_calc_svFit;
     DataIdBiMap known_data_ids;
+    std::vector<DataId> data_ids_by_code;
+    // Hash and code of the data ids which are already known, indexed by the packed id for the fast lookup.
+    std::unordered_map<PackedDataId, std::pair<size_t, size_t>> data_id_entries;
     SampleIdBiMap known_sample_ids;
     RangeMap mva_ranges;
+    bool closed{false};
+    std::unique_ptr<EventQueue> write_queue;
+    std::thread write_thread;
+    std::atomic<bool> write_failed{false};
+    std::exception_ptr write_error;
 };
 
 class AnaTupleReader {
@@ -184,28 +294,78 @@ public:
 
     static const NameSet BoolBranches, IntBranches;
 
-    AnaTupleReader(const std::string& file_name, Channel channel, NameSet& active_var_names);
+    // If file_name is a sharded output directory, the shards listed in its manifest are read as a single tuple.
+    // If column_cache is specified, the derived columns are materialised into friend trees stored in this
+    // directory by the first run and are read from them by the following runs.
+    AnaTupleReader(const std::string& file_name, Channel channel, NameSet& active_var_names,
+                   const std::string& column_cache = "");
     size_t GetNumberOfEntries() const;
     const DataId& GetDataIdByHash(Hash hash) const;
+    // Data ids are numbered densely in the order of the aux dictionaries. The indices of the data ids of each event
+    // are provided by the column dataId_indices.
+    size_t GetNumberOfDataIds() const;
+    const DataId& GetDataIdByIndex(size_t index) const;
     const RDF& GetDataFrame() const;
+    // Returns the data frame which provides the column: the main data frame, if the column is available for all
+    // events, or the first skimmed data frame which defines it.
+    const RDF& GetDataFrame(const std::string& column) const;
+    // Checks if the column is defined by the reader, rather than read from the tuple.
+    bool IsDefinedColumn(const std::string& column) const;
     const std::list<RDF>& GetSkimmedDataFrames() const;
     float GetNormalizedMvaScore(const DataId& dataId, float raw_score) const;
 
 private:
-    void DefineBranches(const NameSet& active_var_names, bool all);
+    enum class ColumnMode { Compute, Materialise, Cached };
+
+    struct ColumnInfo {
+        const RDF* df;
+        bool is_defined;
+    };
+
+    struct MaterialisedSkim {
+        std::string skim_name;
+        RDF df;
+        std::vector<std::string> columns;
+    };
+
+    static constexpr unsigned DerivedColumnsVersion = 1;
+    static const std::string CachedColumnPrefix;
+
+    void DefineBranches(RDF& main_df, std::list<RDF>& skims, const NameSet& active_var_names, bool all,
+                        ColumnMode mode, std::vector<MaterialisedSkim>* materialised = nullptr) const;
+    void SetupColumnCache(const std::string& cache_dir, const std::string& tree_name,
+                          const NameSet& active_var_names, bool all);
+    void MaterialiseColumns(const std::string& cache_path, const std::string& tree_name,
+                            const NameSet& active_var_names, bool all) const;
+    void AttachColumnCache(const std::string& cache_path, const std::string& tree_name);
+    void IndexColumns();
+    static std::string GetCacheTreeName(const std::string& skim_name);
     void ExtractDataIds(const AnaAux& aux);
     void ExtractMvaRanges(const AnaAux& aux);
+    void DefineDecodedBranches(const AnaAux& aux);
+    void DefineDataIdIndices();
+    static AnaTupleBackend DetectBackend(const std::vector<std::string>& file_names, const std::string& name);
+    static size_t CountEntries(const std::vector<std::string>& file_names, const std::string& name,
+                               AnaTupleBackend backend);
 
 private:
-    std::shared_ptr<TFile> file;
-    std::shared_ptr<TTree> tree;
-    ROOT::RDataFrame dataFrame;
+    std::vector<std::string> file_names;
+    AnaTupleBackend backend;
+    size_t n_entries;
+    // Chain of the input files with the friend trees of the column cache, if the cache is used.
+    std::vector<std::unique_ptr<TChain>> cache_chains;
+    std::unique_ptr<TChain> chain;
+    std::unique_ptr<ROOT::RDataFrame> dataFrame;
     RDF df;
     std::list<RDF> skimmed_df;
     DataIdBiMap known_data_ids;
+    std::vector<Hash> data_id_hashes;
     NameSet var_branch_names;
     RangeMap mva_ranges;
     Range mva_target_range{0., 0.99999};
+    // Columns of the column cache, indexed by the skim and by the name of the derived column.
+    std::map<std::string, std::map<std::string, std::string>> cached_columns;
+    std::unordered_map<std::string, ColumnInfo> column_index;
 };
 
 struct HyperPoint {
@@ -0,0 +1,59 @@
+/*! Definition of AnaTupleManifest class, the description of the sharded AnaTuple output.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace analysis {
+namespace bbtautau {
+
+// Manifest of the AnaTuple output which is split into one shard per sample. The output directory contains the
+// shards and the manifest, which records for each shard the fingerprints of the input files and the hash of the
+// configuration used to produce it. A shard is reused by the following runs as long as both are unchanged.
+class AnaTupleManifest {
+public:
+    struct Shard {
+        // Path of the shard relative to the output directory.
+        std::string file_name;
+        std::string config_hash;
+        // Fingerprint of each input file, indexed by the input file path.
+        std::map<std::string, std::string> inputs;
+
+        bool operator==(const Shard& other) const;
+        bool operator!=(const Shard& other) const { return !(*this == other); }
+    };
+
+    static const std::string& FileName();
+    static bool IsShardedOutput(const std::string& path);
+    // Returns the list of the AnaTuple files which correspond to the path: the shards listed in the manifest,
+    // if path is a sharded output directory, or the path itself otherwise.
+    static std::vector<std::string> GetInputFiles(const std::string& path);
+    static std::string GetShardFileName(const std::string& sample_name);
+    // Fingerprint of a file based on its size and on the time of its last modification.
+    static std::string GetFileFingerprint(const std::string& file_path);
+    static std::string GetContentHash(const std::string& content);
+
+    explicit AnaTupleManifest(const std::string& _directory);
+
+    const std::string& GetDirectory() const { return directory; }
+    std::string GetShardPath(const std::string& sample_name) const;
+    // Checks that the shard of the sample is described by the manifest with the same inputs and configuration
+    // and that its file exists.
+    bool IsValid(const std::string& sample_name, const Shard& shard) const;
+    void SetShard(const std::string& sample_name, const Shard& shard);
+    // Removes the shards of the samples which are not listed.
+    void KeepShards(const std::set<std::string>& sample_names);
+    // Writes the manifest into the output directory. The file is replaced atomically.
+    void Save() const;
+
+private:
+    std::string directory;
+    std::map<std::string, Shard> shards;
+};
+
+} // namespace bbtautau
+} // namespace analysis
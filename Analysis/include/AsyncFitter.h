@@ -0,0 +1,37 @@
+/*! Definition of AsyncFitter class, the pool of worker threads which compute SVfit and KinFit results.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <functional>
+#include <future>
+#include <thread>
+#include "AnalysisTools/Run/include/EntryQueue.h"
+#include "FitResultsCache.h"
+
+namespace analysis {
+
+// Computes the fit results on a dedicated pool of threads. Exceptions raised by a task are rethrown by the get()
+// of the corresponding future.
+class AsyncFitter {
+public:
+    using Record = FitResultsCache::Record;
+    using Task = std::packaged_task<Record()>;
+    using TaskQueue = run::EntryQueue<std::shared_ptr<Task>>;
+
+    AsyncFitter(size_t n_threads, size_t max_queue_size);
+    AsyncFitter(const AsyncFitter&) = delete;
+    AsyncFitter& operator=(const AsyncFitter&) = delete;
+    ~AsyncFitter();
+
+    std::future<Record> Submit(std::function<Record()> fit);
+
+private:
+    void WorkerThread();
+
+private:
+    TaskQueue queue;
+    std::vector<std::thread> workers;
+};
+
+} // namespace analysis
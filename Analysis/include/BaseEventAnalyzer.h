@@ -8,12 +8,19 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 #include "hh-bbtautau/McCorrections/include/EventWeights_HH.h"
 #include "h-tautau/Analysis/include/SignalObjectSelector.h"
 #include "h-tautau/McCorrections/include/GenEventWeight.h"
+#include "AnaTupleManifest.h"
+#include "AsyncFitter.h"
 #include "DYModel.h"
 #include "EventAnalyzerCore.h"
+#include "EventAnalyzerProfiler.h"
+#include "EventWeightBundle.h"
+#include "FitResultsCache.h"
 #include "MvaReader.h"
 #include "NonResModel.h"
+#include "ObjectPool.h"
+#include "SyncDataIdMatcher.h"
 #include "SyncTupleHTT.h"
-#include <boost/regex.hpp>
+#include <mutex>
 
 namespace analysis {
 
@@ -21,13 +28,31 @@ struct AnalyzerArguments : CoreAnalyzerArguments {
     REQ_ARG(std::string, input);
     REQ_ARG(std::string, output);
     OPT_ARG(std::string, output_sync,"sync.root");
+    OPT_ARG(unsigned, n_event_threads, 1);
+    OPT_ARG(size_t, event_chunk_size, 10000);
+    // Number of input files processed concurrently. If it is greater than 1, the order of the events in the output
+    // is not reproducible between the runs.
+    OPT_ARG(unsigned, n_sample_threads, 1);
+    OPT_ARG(std::string, sample_cost_file, "");
+    OPT_ARG(std::string, profile, "");
+    OPT_ARG(std::string, fit_cache, "");
+    OPT_ARG(unsigned, n_fit_threads, 0);
+    OPT_ARG(AnaTupleBackend, output_backend, AnaTupleBackend::TTree);
+    OPT_ARG(AnaTupleCompression, output_compression, AnaTupleCompression::LZ4);
+    OPT_ARG(int, output_compression_level, 4);
+    OPT_ARG(size_t, output_cluster_size, 0);
+    OPT_ARG(bool, output_index_data_ids, false);
+    OPT_ARG(bool, output_float_weights, false);
+    OPT_ARG(size_t, output_buffer_size, 0);
+    OPT_ARG(bool, output_shards, false);
 };
 
 struct SyncDescriptor {
     std::shared_ptr<htt_sync::SyncTuple> sync_tree;
-    std::shared_ptr<boost::regex> regex_pattern;
+    std::shared_ptr<SyncDataIdMatcher> matcher;
 
-    SyncDescriptor(const std::string& desc_str, std::shared_ptr<TFile> outputFile_sync);
+    SyncDescriptor(const std::string& desc_str, std::shared_ptr<TFile> outputFile_sync,
+                   const DataIdUniverse& universe);
 
 };
 
@@ -35,39 +60,126 @@ class BaseEventAnalyzer : public EventAnalyzerCore {
 public:
     using Event = ntuple::Event;
 
+    // Version of the output content. It should be increased whenever a change of the code affects the output, so
+    // that the output shards produced by the previous versions are not reused.
+    static constexpr unsigned OutputVersion = 1;
+
+    // Helpers used to create and weight EventInfo, which are not thread-safe. EventInfo refers to the selector and
+    // to the b tagger, therefore the instance should not be reused until all events created with it are released.
+    struct EventTools {
+        SignalObjectSelector signalObjectSelector;
+        std::unique_ptr<BTagger> bTagger;
+        std::unique_ptr<mc_corrections::EventWeights_HH> eventWeights_HH;
+
+        EventTools(SignalMode mode, Period period, BTaggerKind jet_ordering);
+    };
+
+    struct DataSourceContext {
+        const SampleDescriptor& sample;
+        const SampleDescriptor::Point& sample_wp;
+        // Summary shared by all workers. It is used only to read the sample properties.
+        std::shared_ptr<SummaryInfo> summary;
+        std::vector<std::pair<UncertaintySource, UncertaintyScale>> unc_variations;
+        std::shared_ptr<NonResModel> nonResModel;
+        EventWeightBundle::Settings weight_settings;
+        // Summaries passed to EventInfo, one per thread which creates events.
+        std::shared_ptr<ObjectPool<SummaryInfo>> event_summaries;
+    };
+
+    // Instances of the non thread-safe helpers owned by a single thread which processes events.
+    struct EventWorker {
+        std::shared_ptr<EventTools> tools;
+        std::shared_ptr<SummaryInfo> summary;
+    };
+
+    // Input file of a sample which is processed as an independent unit of work.
+    struct ProcessingUnit {
+        const SampleDescriptor* sample;
+        const SampleDescriptor::Point* sample_wp;
+        std::string file_path;
+        double cost{0};
+    };
+
+    struct SyncFillRequest {
+        size_t descriptor_index;
+        double mva_score, weight, lepton_id_iso_weight, trigger_weight, btag_weight, shape_weight, jet_pu_id_weight;
+    };
+
+    // Result of the processing of a single (event, uncertainty variation) which should be written into the outputs.
+    struct EventOutput {
+        // Keeps the helpers referenced by the event reserved until the output is written.
+        EventWorker worker;
+        std::unique_ptr<EventInfo> event;
+        std::unique_ptr<EventFitResults> fit_results;
+        bbtautau::AnaTupleWriter::DataIdMap dataIds;
+        bool pass_vbf_trigger{false};
+        std::vector<SyncFillRequest> sync_requests;
+    };
+    using EventOutputVector = std::vector<EventOutput>;
+
     BaseEventAnalyzer(const AnalyzerArguments& _args, Channel channel);
     void Run();
 
 protected:
-    EventCategorySet DetermineEventCategories(EventInfo& event, bool pass_vbf_trigger);
+    EventCategorySet DetermineEventCategories(EventInfo& event, const BTagger& event_bTagger,
+                                              bool pass_vbf_trigger);
     virtual EventRegion DetermineEventRegion(EventInfo& event, EventCategory eventCategory) = 0;
 
 
     void InitializeMvaReader();
-    virtual EventSubCategory DetermineEventSubCategory(EventInfo& event, const EventCategory& category,
+    // Scores already present in mva_scores are reused, which allows to share them between the categories of the
+    // same event.
+    virtual EventSubCategory DetermineEventSubCategory(EventInfo& event, EventFitResults& fit_results,
+                                                       const EventCategory& category,
                                                        std::map<SelectionCut, double>& mva_scores);
-    void ProcessSamples(const std::vector<std::string>& sample_names, const std::string& sample_set_name);
+    void CollectProcessingUnits(const std::vector<std::string>& sample_names,
+                                std::vector<ProcessingUnit>& units) const;
+    void EstimateProcessingCosts(std::vector<ProcessingUnit>& units) const;
+    void ProcessUnits(std::vector<ProcessingUnit>& units);
+    double ProcessUnit(const ProcessingUnit& unit);
+    void SaveProcessingCosts(const std::vector<ProcessingUnit>& units, const std::vector<double>& times) const;
 
     void ProcessDataSource(const SampleDescriptor& sample, const SampleDescriptor::Point& sample_wp,
-                           std::shared_ptr<ntuple::EventTuple> tuple, const ntuple::ProdSummary& prod_summary);
-
-    virtual void ProcessSpecialEvent(const SampleDescriptor& sample, const SampleDescriptor::Point& /*sample_wp*/,
-                                     const EventAnalyzerDataId& anaDataId, EventInfo& event, double weight,
-                                     double shape_weight, bbtautau::AnaTupleWriter::DataIdMap& dataIds,
-                                     double cross_section);
+                           std::shared_ptr<ntuple::EventTuple> tuple, const ntuple::ProdSummary& prod_summary,
+                           std::shared_ptr<NonResModel> nonResModel);
+    void ProcessEventChunk(const DataSourceContext& context, const std::vector<Event>& events, size_t n_workers);
+    EventWorker AcquireEventWorker(const DataSourceContext& context);
+    void ProcessEventEntry(const DataSourceContext& context, const EventWorker& worker, const Event& tupleEvent,
+                           EventOutputVector& outputs);
+    void WriteEventOutputs(const DataSourceContext& context, EventOutputVector& outputs);
+    // Creates the writers of the shards which should be produced and removes the units of the samples whose
+    // shards are still valid.
+    void PrepareOutputShards(std::vector<ProcessingUnit>& units);
+    // Hash of everything which defines the content of the output shards: the configuration, the arguments, the
+    // fingerprints of the files read by the analyzer (including the analyzer itself) and OutputVersion.
+    std::string GetOutputConfigHash() const;
+    bbtautau::AnaTupleWriter& GetAnaTupleWriter(const SampleDescriptor& sample);
+
+    virtual void ProcessSpecialEvent(const DataSourceContext& context, const EventAnalyzerDataId& anaDataId,
+                                     EventInfo& event, double weight, double shape_weight,
+                                     bbtautau::AnaTupleWriter::DataIdMap& dataIds, double cross_section);
 
     bool SetRegionIsoRange(const LepCandidate& cand, EventRegion& region) const;
+    DataIdUniverse CreateDataIdUniverse() const;
+    static bbtautau::AnaTupleWriter::Options CreateAnaTupleOptions(const AnalyzerArguments& args);
 
 protected:
     AnalyzerArguments args;
-    bbtautau::AnaTupleWriter anaTupleWriter;
+    std::unique_ptr<bbtautau::AnaTupleWriter> anaTupleWriter;
+    std::unique_ptr<bbtautau::AnaTupleManifest> anaTupleManifest;
+    std::map<std::string, std::unique_ptr<bbtautau::AnaTupleWriter>> shardWriters;
     mva_study::MvaReader mva_reader;
+    std::vector<mva_study::MvaReader::MvaKey> mva_keys;
+    std::map<SelectionCut, size_t> mva_key_indices;
     std::shared_ptr<TFile> outputFile_sync;
     std::vector<SyncDescriptor> sync_descriptors;
     std::map<std::string,std::shared_ptr<DYModelBase>> dymod;
-    std::shared_ptr<NonResModel> nonResModel;
     const std::vector<std::string> trigger_patterns;
-    std::shared_ptr<mc_corrections::EventWeights_HH> eventWeights_HH;
+    ObjectPool<EventTools> eventTools;
+    std::shared_ptr<FitResultsCache> fitResultsCache;
+    std::shared_ptr<AsyncFitter> asyncFitter;
+    std::mutex special_event_mutex, writer_mutex;
+    EventAnalyzerProfiler profiler;
 };
 
 } // namespace analysis
@@ -3,8 +3,9 @@ This file is part of https://github.com/hh-italian-group/h-tautau. */
 
 #pragma once
 
+#include <mutex>
 #include "AnalysisTools/Core/include/AnalyzerData.h"
-#include "SampleDescriptor.h"
+#include "HistDescResolver.h"
 
 namespace analysis {
 
@@ -15,20 +16,33 @@ public:
     using HistContainer = std::map<std::string, EntryPtr>;
     using HistDesc = PropertyConfigReader::Item;
     using HistDescCollection = PropertyConfigReader::ItemCollection;
+    using HistDescResolverPtr = std::shared_ptr<const HistDescResolver>;
     using SampleUnc = ModellingUncertainty::SampleUnc;
+    using Mutex = std::mutex;
 
+    // If create_on_request is true, the histogram entries are created by GetHistogram on the first request instead
+    // of being created for all histogram names by the constructor.
     EventAnalyzerData(std::shared_ptr<TFile> outputFile, const std::string& directoryName, Channel channel,
                       const EventAnalyzerDataId& dataId, const std::set<std::string>& histogram_names,
-                      const HistDescCollection& descriptors, const SampleUnc& sample_unc, bool readMode);
+                      HistDescResolverPtr descriptors, const SampleUnc& sample_unc, bool readMode,
+                      bool create_on_request = false);
 
-    Entry& GetHistogram(const std::string& hist_name) const;
+    // Thread-safe: the entries created on request are inserted under the lock. The returned entry itself is not
+    // guarded, so the same histogram should not be filled from several threads at once.
+    Entry& GetHistogram(const std::string& hist_name);
 
 private:
-    static const HistDesc& FindDescriptor(const std::string& h_name, Channel channel, const EventAnalyzerDataId& dataId,
-                                          const HistDescCollection& descriptors);
+    // Should be called with the mutex locked, unless the object is not yet shared.
+    Entry& CreateHistogram(const std::string& h_name);
 
 private:
+    Channel channel;
+    EventAnalyzerDataId dataId;
+    std::set<std::string> histogram_names;
+    HistDescResolverPtr descriptors;
+    SampleUnc sample_unc;
     HistContainer histograms;
+    Mutex mutex;
 };
 
 } // namespace analysis
@@ -4,27 +4,50 @@ This file is part of https://github.com/hh-italian-group/h-tautau. */
 #pragma once
 
 #include "EventAnalyzerData.h"
+#include "HistogramStore.h"
+#include "PackedDataId.h"
+#include "ShardedMap.h"
 
 namespace analysis {
 
+// Lookups of the existing data do not block each other and can be done concurrently with the creation of the new
+// data. The creation of the data is serialized, since it modifies the output file.
 class EventAnalyzerDataCollection {
 public:
-    using Mutex = std::recursive_mutex;
+    using Mutex = std::mutex;
     using Data = EventAnalyzerData;
     using DataPtr = std::shared_ptr<Data>;
     using DataId = EventAnalyzerDataId;
     using DataMap = std::map<DataId, DataPtr>;
     using NameSet = std::set<std::string>;
     using DescSet = PropertyConfigReader::ItemCollection;
+    using DescResolverPtr = Data::HistDescResolverPtr;
     using SampleUnc = ModellingUncertainty::SampleUnc;
     using MucPtr = std::shared_ptr<ModellingUncertaintyCollection>;
+    using StorePtr = std::shared_ptr<HistogramStore>;
 
     explicit EventAnalyzerDataCollection(std::shared_ptr<TFile> _file, Channel _channel,
             const NameSet& _histNames, const DescSet& _histDescs, bool _readMode, const NameSet& _backgrounds = {},
             MucPtr _unc_collection = MucPtr());
+    explicit EventAnalyzerDataCollection(std::shared_ptr<TFile> _file, Channel _channel,
+            const NameSet& _histNames, DescResolverPtr _histDescs, bool _readMode, const NameSet& _backgrounds = {},
+            MucPtr _unc_collection = MucPtr());
 
     Data& Get(const DataId& id);
+    Data& Get(const PackedDataId& id);
+    // Should not be called concurrently with the creation of the data.
     const DataMap& GetAll() const;
+    // Histograms of the data ids with the shifted uncertainty scale are created on request and only for the listed
+    // variables. By default, all histograms are created together with the data.
+    void SetUncertaintyScaleHistograms(UncertaintyScale scale, const NameSet& names);
+    // If the store is set, the histograms of a data id are extracted from it when the data is created.
+    void SetHistogramStore(StorePtr _store);
+    // Writes the stored histograms of the sub-categories that were not requested, one data id at a time, so that
+    // only the ROOT histograms of a single data id are created at once.
+    // Moves the stored histograms of the sub-categories into the collection without writing them, so that the store
+    // can be filled again.
+    void LoadStoredHistograms(const EventSubCategorySet& subCategories);
+    void WriteStoredHistograms(const EventSubCategorySet& subCategories);
     Channel ChannelId() const;
     bool ReadMode() const;
 
@@ -36,11 +59,14 @@ private:
     std::shared_ptr<TFile> file;
     Channel channel;
     NameSet histNames;
-    DescSet histDescs;
+    std::map<UncertaintyScale, NameSet> uncScaleHistNames;
+    DescResolverPtr histDescs;
     DataMap anaDataMap;
+    ShardedMap<PackedDataId, DataPtr> packedDataMap;
     bool readMode;
     NameSet backgrounds;
     MucPtr unc_collection;
+    StorePtr store;
     Mutex mutex;
 };
 
@@ -0,0 +1,84 @@
+/*! Definition of EventAnalyzerProfiler class, the per-stage timing and cut-flow profiler for event analyzers.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include "AnalysisTools/Core/include/EnumNameMap.h"
+
+namespace analysis {
+
+enum class AnalyzerStage { TupleRead = 0, EventInfoCreate = 1, Trigger = 2, Weights = 3, Categorisation = 4,
+                           Fits = 5, Mva = 6, AddEvent = 7 };
+ENUM_NAMES(AnalyzerStage) = {
+    { AnalyzerStage::TupleRead, "TupleRead" }, { AnalyzerStage::EventInfoCreate, "EventInfoCreate" },
+    { AnalyzerStage::Trigger, "Trigger" }, { AnalyzerStage::Weights, "Weights" },
+    { AnalyzerStage::Categorisation, "Categorisation" }, { AnalyzerStage::Fits, "Fits" },
+    { AnalyzerStage::Mva, "Mva" }, { AnalyzerStage::AddEvent, "AddEvent" }
+};
+
+enum class SelectionStep { MetFilters = 0, LeptonVeto = 1, EventInfo = 2, Trigger = 3, Category = 4, Region = 5,
+                           SubCategory = 6 };
+ENUM_NAMES(SelectionStep) = {
+    { SelectionStep::MetFilters, "MetFilters" }, { SelectionStep::LeptonVeto, "LeptonVeto" },
+    { SelectionStep::EventInfo, "EventInfo" }, { SelectionStep::Trigger, "Trigger" },
+    { SelectionStep::Category, "Category" }, { SelectionStep::Region, "Region" },
+    { SelectionStep::SubCategory, "SubCategory" }
+};
+
+// Collects the wall time and number of calls of each stage of the event processing and, for each selection step,
+// the number of processed and rejected events together with the time spent on the rejected events.
+// Stage times are exclusive: the time of a stage timed within another stage on the same thread (e.g. Fits and Mva
+// called from DetermineEventSubCategory during Categorisation) is subtracted from the enclosing stage, so that the
+// sum of the stage times is the total time spent in the timed stages.
+// All counters are atomic, so a single profiler can be shared by all the worker threads.
+class EventAnalyzerProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr size_t NumberOfStages = 8;
+    static constexpr size_t NumberOfSteps = 7;
+
+    // Timers of the same thread should be destroyed in the reverse order of their construction.
+    class StageTimer {
+    public:
+        StageTimer(EventAnalyzerProfiler& _profiler, AnalyzerStage _stage);
+        StageTimer(const StageTimer&) = delete;
+        StageTimer& operator=(const StageTimer&) = delete;
+        ~StageTimer();
+
+    private:
+        EventAnalyzerProfiler* profiler;
+        AnalyzerStage stage;
+        Clock::time_point start;
+        Clock::duration nested_time{0};
+        StageTimer* parent{nullptr};
+    };
+
+    explicit EventAnalyzerProfiler(bool _enabled = false) : enabled(_enabled) {}
+    bool IsEnabled() const { return enabled; }
+    // Current time if profiling is enabled, the epoch otherwise, so that the clock is not read needlessly.
+    Clock::time_point Now() const { return enabled ? Clock::now() : Clock::time_point(); }
+
+    void AddStageTime(AnalyzerStage stage, Clock::duration time);
+    // Records the outcome of a selection step. cost is the time spent on the event before the decision.
+    void AddSelection(SelectionStep step, bool passed, Clock::duration cost);
+
+    void Print(std::ostream& os) const;
+    void WriteJson(const std::string& file_name) const;
+
+private:
+    using Counter = std::atomic<unsigned long long>;
+
+    static unsigned long long ToNanoseconds(Clock::duration time);
+
+private:
+    bool enabled;
+    std::array<Counter, NumberOfStages> stage_time{}, stage_calls{};
+    std::array<Counter, NumberOfSteps> step_processed{}, step_rejected{}, step_rejected_cost{};
+};
+
+} // namespace analysis
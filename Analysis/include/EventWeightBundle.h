@@ -0,0 +1,64 @@
+/*! Definition of EventWeightBundle class, the cache of the event weight factors used by event analyzers.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <bitset>
+#include "h-tautau/Analysis/include/EventInfo.h"
+#include "h-tautau/Analysis/include/SignalObjectSelector.h"
+#include "hh-bbtautau/McCorrections/include/EventWeights_HH.h"
+
+namespace analysis {
+
+enum class WeightFactor { LeptonIdIso = 0, Trigger = 1, Prescale = 2, L1Prefiring = 3, JetPuId = 4, BTag = 5,
+                          Gen = 6 };
+ENUM_NAMES(WeightFactor) = {
+    { WeightFactor::LeptonIdIso, "LeptonIdIso" }, { WeightFactor::Trigger, "Trigger" },
+    { WeightFactor::Prescale, "Prescale" }, { WeightFactor::L1Prefiring, "L1Prefiring" },
+    { WeightFactor::JetPuId, "JetPuId" }, { WeightFactor::BTag, "BTag" }, { WeightFactor::Gen, "Gen" }
+};
+
+// Weight factors of a single (event, uncertainty variation). Each factor is evaluated at most once, on the first
+// request, and the products used by the category, region and sub-category loops are cached as well.
+class EventWeightBundle {
+public:
+    static constexpr size_t NumberOfFactors = 7;
+
+    struct Settings {
+        Channel channel;
+        Period period;
+        double cross_section{1}, total_shape_weight{1}, int_lumi{1};
+        bool is_data{false};
+    };
+
+    // Factors that do not depend on the uncertainty variation can be shared between the variations of the same
+    // event.
+    static bool DependsOnUncVariation(WeightFactor factor);
+
+    EventWeightBundle(EventInfo& _event, mc_corrections::EventWeights_HH& _weights,
+                      const SignalObjectSelector& _signalObjectSelector, const Settings& _settings,
+                      UncertaintySource _unc_source, UncertaintyScale _unc_scale);
+
+    void ReuseEventFactors(const EventWeightBundle& other);
+
+    double Get(WeightFactor factor);
+    double GetEventWeight(bool apply_btag);
+    double GetShapeWeight();
+    double GetCrossSection() const { return settings.cross_section; }
+
+private:
+    double Evaluate(WeightFactor factor);
+
+private:
+    EventInfo* event;
+    mc_corrections::EventWeights_HH* weights;
+    const SignalObjectSelector* signalObjectSelector;
+    Settings settings;
+    UncertaintySource unc_source;
+    UncertaintyScale unc_scale;
+    std::array<double, NumberOfFactors> factors;
+    std::bitset<NumberOfFactors> has_factor;
+    boost::optional<double> common_weight, shape_weight;
+};
+
+} // namespace analysis
@@ -0,0 +1,143 @@
+/*! Definition of FitResultsCache class, the persistent cache of SVfit and KinFit results.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <functional>
+#include <future>
+#include <mutex>
+#include <boost/optional.hpp>
+#include "h-tautau/Analysis/include/EventInfo.h"
+
+namespace analysis {
+
+// Persistent cache of the SVfit and KinFit results of (event, uncertainty variation).
+// The cache file contains a header followed by an array of fixed-size records sorted by key. It is memory-mapped
+// read-only at construction, so that the lookup of the stored results is a binary search which does not require
+// to load the file. Results computed during the run are kept in memory and merged with the stored ones by Save.
+// The input hash covers all inputs of the fits (the momenta of the legs, of the b jets and of MET, the decay modes
+// of the legs, the b jet energy resolutions and the MET covariance), so that a change of the object selection or
+// of the corrections invalidates the stored results of the affected events. The config hash covers the fitter
+// configuration and FitterVersion, so that the results obtained with different settings are never mixed.
+class FitResultsCache {
+public:
+    // Version of the fitters and of their configuration in the code. It should be increased whenever a change
+    // of the code affects the fit results.
+    static constexpr unsigned FitterVersion = 1;
+
+    struct Key {
+        uint64_t evt{0}, input_hash{0}, config_hash{0};
+        uint32_t run{0}, lumi{0};
+        int32_t unc_source{0}, unc_scale{0};
+
+        bool operator<(const Key& other) const;
+        bool operator==(const Key& other) const;
+    };
+
+    struct Record {
+        static constexpr uint32_t HasSVfit = 1, HasKinFit = 2;
+
+        Key key;
+        uint32_t flags{0};
+        int32_t kinFit_convergence{0};
+        double SVfit_pt{0}, SVfit_eta{0}, SVfit_phi{0}, SVfit_m{0};
+        double SVfit_pt_error{0}, SVfit_eta_error{0}, SVfit_phi_error{0}, SVfit_m_error{0};
+        double SVfit_mt{0}, SVfit_mt_error{0}, SVfit_valid{0};
+        double kinFit_m{0}, kinFit_chi2{0}, kinFit_probability{0};
+
+        void SetSVFitResults(const sv_fit_ana::FitResults& results);
+        void SetKinFitResults(const kin_fit::FitResults& results);
+        sv_fit_ana::FitResults GetSVFitResults() const;
+        kin_fit::FitResults GetKinFitResults() const;
+        // Adds the results present in the other record to this record.
+        void Merge(const Record& other);
+    };
+
+    Key MakeKey(EventInfo& event, UncertaintySource unc_source, UncertaintyScale unc_scale) const;
+
+    // fitter_config describes the run-time settings which affect the fit results (e.g. the period and the channel).
+    FitResultsCache(const std::string& _file_name, const std::string& fitter_config);
+    FitResultsCache(const FitResultsCache&) = delete;
+    FitResultsCache& operator=(const FitResultsCache&) = delete;
+    ~FitResultsCache();
+
+    boost::optional<Record> Find(const Key& key) const;
+    // Adds the results present in the record to the results already known for its key.
+    void Update(const Record& record);
+    // Writes the stored and the new results into the cache file. The file is replaced atomically.
+    void Save();
+
+    size_t GetNumberOfStoredRecords() const { return n_mapped_records; }
+    size_t GetNumberOfNewRecords() const;
+
+private:
+    void Map();
+    void Unmap();
+    const Record* FindMapped(const Key& key) const;
+
+private:
+    std::string file_name;
+    uint64_t config_hash;
+    int file_descriptor{-1};
+    void* mapped_data{nullptr};
+    size_t mapped_size{0}, n_mapped_records{0};
+    const Record* mapped_records{nullptr};
+    std::map<Key, Record> new_records;
+    mutable std::mutex mutex;
+};
+
+class AsyncFitter;
+
+// SVfit and KinFit results of a single (event, uncertainty variation). The results are taken from the cache if
+// available, otherwise they are obtained from the fitter pool, if prefetched, or from EventInfo, and added to the
+// cache. Without a cache and prefetching, or if the fits are not computed by the analysis, all requests are
+// forwarded to EventInfo.
+class EventFitResults {
+public:
+    // Event on which the fitter pool computes the fits, together with the resources it refers to (e.g. the
+    // selector and the b tagger of the fitter thread). The event is destroyed before its resources.
+    struct FitEvent {
+        std::shared_ptr<void> resources;
+        std::unique_ptr<EventInfo> event;
+    };
+    using EventFactory = std::function<FitEvent()>;
+
+    EventFitResults(EventInfo& _event, bool _allow_calc, FitResultsCache* _cache, UncertaintySource unc_source,
+                    UncertaintyScale unc_scale);
+    EventFitResults(const EventFitResults&) = delete;
+    EventFitResults& operator=(const EventFitResults&) = delete;
+    ~EventFitResults();
+
+    // Returns fit_results, if provided, otherwise creates in holder the results which forward all requests to
+    // the event. It allows the consumers of the fit results to accept an optional EventFitResults.
+    static EventFitResults& Resolve(EventFitResults* fit_results, EventInfo& event, bool allow_calc,
+                                    std::unique_ptr<EventFitResults>& holder);
+
+    // Submits the computation of the missing results to the fitter pool. The fits are computed on an EventInfo
+    // created by make_event on the fitter thread, which should be equivalent to the event of this object and
+    // should not share any object which is not thread-safe with it.
+    void Prefetch(AsyncFitter& fitter, EventFactory make_event, bool run_svFit, bool run_kinFit);
+
+    const sv_fit_ana::FitResults& GetSVFitResults();
+    const kin_fit::FitResults& GetKinFitResults();
+    // Momentum of the H->tautau candidate reconstructed by SVfit, if the fit is valid.
+    boost::optional<LorentzVectorM> GetHiggsTTMomentum();
+
+private:
+    bool UseCache() const { return cache && allow_calc; }
+    bool UseRecord() const { return allow_calc && (cache || prefetched); }
+    void ResolvePrefetched();
+    void Store(const FitResultsCache::Record& new_record);
+
+private:
+    EventInfo* event;
+    bool allow_calc, prefetched{false};
+    FitResultsCache* cache;
+    std::future<FitResultsCache::Record> prefetched_record;
+    boost::optional<FitResultsCache::Key> key;
+    boost::optional<FitResultsCache::Record> record;
+    boost::optional<sv_fit_ana::FitResults> svFit_results;
+    boost::optional<kin_fit::FitResults> kinFit_results;
+};
+
+} // namespace analysis
@@ -0,0 +1,55 @@
+/*! Definition of HistDescResolver, the lookup of histogram descriptors for the event analyzer data.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <shared_mutex>
+#include <unordered_map>
+#include "SampleDescriptor.h"
+#include "PackedDataId.h"
+
+namespace analysis {
+
+// Finds the descriptor of a histogram for the given channel, category and sub-category. Descriptor names have
+// the form 'name[/channel[/category[/sub_category]]]', where the channel and the category can be replaced by '*'.
+// The most specific descriptor is chosen, in the following order:
+//     name/channel/category/sub_category, name/channel/*/sub_category, name/*/*/sub_category,
+//     name/channel/category, name/*/category, name/channel, name.
+// Descriptor names are parsed once, when the resolver is created, and the resolved descriptors are cached.
+class HistDescResolver {
+public:
+    using HistDesc = PropertyConfigReader::Item;
+    using HistDescCollection = PropertyConfigReader::ItemCollection;
+    using Mutex = std::shared_mutex;
+
+    explicit HistDescResolver(const HistDescCollection& _descriptors);
+    HistDescResolver(const HistDescResolver&) = delete;
+    HistDescResolver& operator=(const HistDescResolver&) = delete;
+
+    const HistDesc& Find(const std::string& h_name, Channel channel, const EventAnalyzerDataId& dataId) const;
+
+private:
+    // Order of the patterns follows the order of the preference.
+    enum class PatternKind { ChannelCategorySubCategory = 0, ChannelSubCategory, SubCategory, ChannelCategory,
+                             Category, Channel, Default };
+
+    struct Pattern {
+        PatternKind kind;
+        std::string channel, category, sub_category;
+        const HistDesc* desc;
+    };
+
+    struct NameEntry {
+        std::vector<Pattern> patterns;
+        mutable std::unordered_map<PackedDataId::Code, const HistDesc*> resolved;
+    };
+
+    static const HistDesc* Match(const NameEntry& entry, Channel channel, const EventAnalyzerDataId& dataId);
+
+private:
+    HistDescCollection descriptors;
+    std::unordered_map<std::string, NameEntry> names;
+    mutable Mutex mutex;
+};
+
+} // namespace analysis
@@ -0,0 +1,177 @@
+/*! Definition of HistogramStore, the compact storage of the histograms filled by the event loop.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <deque>
+#include <unordered_map>
+#include <TMemFile.h>
+#include "EventAnalyzerData.h"
+#include "PackedDataId.h"
+
+namespace analysis {
+
+// Storage of the histograms filled in a pass over the events for the sub-categories of the pass. Only the sums of
+// the weights are kept for each histogram, while the binning is shared by all histograms with the same descriptor.
+// The contents of the histograms with the same binning and sub-category are allocated in a common arena. ROOT
+// histograms are created only when the content is extracted into EventAnalyzerData, which is done when the data
+// is requested from EventAnalyzerDataCollection or when it is written. Each thread of the event loop fills its own
+// Replica, which is periodically added to the store, therefore no locks are taken while filling.
+//
+// Memory cost: each histogram in the store takes a record of 2 * (n_bins + 2) + 1 doubles. Arenas grow in blocks of
+// up to the number of records already allocated, so the allocated memory is at most about twice the size of the
+// records (and at least MinBlockRecords records per arena). A replica allocates a record for each histogram filled
+// since its last merge, so the replicas of a single thread never exceed the size of the store, and the replicas of
+// all threads add at most n_threads times the store memory. The actual replica size is bounded by the number of
+// histograms filled between the merges, which is why the replicas should be merged every fixed number of entries.
+class HistogramStore {
+public:
+    using DataId = EventAnalyzerDataId;
+    using HistDesc = EventAnalyzerData::HistDesc;
+    using HistDescCollection = EventAnalyzerData::HistDescCollection;
+    using HistDescResolverPtr = EventAnalyzerData::HistDescResolverPtr;
+    using Mutex = std::mutex;
+
+    class Binning {
+    public:
+        explicit Binning(const TAxis& axis);
+
+        size_t GetNumberOfBins() const { return n_bins; }
+        // Returns the index of the bin which contains x, following the convention of TAxis::FindBin:
+        // 0 is the underflow bin and n_bins + 1 is the overflow bin.
+        size_t FindBin(double x) const;
+
+    private:
+        size_t n_bins;
+        double x_min, x_max;
+        // Bin edges, if the bins are not uniform.
+        std::vector<double> edges;
+    };
+
+    // Contiguous storage of the histograms with the same binning. Each histogram occupies a record with the sums of
+    // the weights and of the squared weights for all bins, including the underflow and the overflow, followed by
+    // the number of entries. Records are allocated in blocks of growing size and are released with the arena.
+    class Arena {
+    public:
+        explicit Arena(const Binning& _binning);
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        // Number of values in the record of a histogram with n_bins bins.
+        static size_t GetRecordSize(size_t n_bins) { return 2 * (n_bins + 2) + 1; }
+
+        const Binning& GetBinning() const { return *binning; }
+        double* Allocate();
+        size_t GetMemorySize() const { return n_allocated * sizeof(double); }
+
+    private:
+        static constexpr size_t MinBlockRecords = 16;
+        static constexpr size_t MaxBlockValues = 1 << 16;
+
+        const Binning* binning;
+        size_t record_size, n_records, block_capacity, block_used, n_allocated;
+        std::vector<std::unique_ptr<double[]>> blocks;
+    };
+
+    // View of a histogram record allocated in an arena.
+    class Histogram {
+    public:
+        Histogram(const Binning& _binning, double* _data);
+
+        const Binning& GetBinning() const { return *binning; }
+        void Fill(double x, double weight) { FillBin(binning->FindBin(x), weight); }
+        void FillBin(size_t bin, double weight)
+        {
+            data[bin] += weight;
+            data[n_values + bin] += weight * weight;
+            data[2 * n_values] += 1;
+        }
+        void Add(const Histogram& other);
+        // Adds the content of the histogram to the ROOT histogram with the same binning.
+        void AddTo(TH1D& hist) const;
+
+    private:
+        const Binning* binning;
+        size_t n_values;
+        double* data;
+    };
+
+    // Bin of the last value looked up in the binning. Histograms with the same binning are filled for the same value
+    // for all data ids of an event, therefore the bin search is done only once.
+    class BinIndexCache {
+    public:
+        explicit BinIndexCache(const Binning& _binning) : binning(&_binning), last_x(0), bin(0), valid(false) {}
+
+        size_t FindBin(double x)
+        {
+            if(!valid || x != last_x) {
+                bin = binning->FindBin(x);
+                last_x = x;
+                valid = true;
+            }
+            return bin;
+        }
+
+    private:
+        const Binning* binning;
+        double last_x;
+        size_t bin;
+        bool valid;
+    };
+
+    // Private copy of the store histograms touched by a single thread since the last merge.
+    class Replica {
+    public:
+        explicit Replica(HistogramStore& _store);
+        Replica(const Replica&) = delete;
+        Replica& operator=(const Replica&) = delete;
+
+        Histogram& Get(const PackedDataId& id, const std::string& hist_name);
+        BinIndexCache& GetBinIndexCache(const Binning& binning);
+        // Adds the content of the replica to the store and resets it.
+        void Merge();
+
+    private:
+        HistogramStore* store;
+        std::map<const Binning*, std::unique_ptr<Arena>> arenas;
+        std::deque<std::pair<Histogram*, Histogram>> histograms;
+        std::map<const Binning*, BinIndexCache> bin_index_caches;
+    };
+
+    HistogramStore(Channel _channel, HistDescResolverPtr _descriptors);
+    HistogramStore(const HistogramStore&) = delete;
+    HistogramStore& operator=(const HistogramStore&) = delete;
+
+    Histogram& Get(const PackedDataId& id, const std::string& hist_name);
+    size_t GetNumberOfBins(const std::string& hist_name, const DataId& id);
+    // Returns the ids of the stored histograms ordered by the unpacked ids, independently of the packed codes.
+    std::vector<PackedDataId> GetIds(const EventSubCategorySet& subCategories) const;
+    // Adds the histograms of the data id to the data and releases them from the store.
+    void Extract(const PackedDataId& id, EventAnalyzerData& anaData);
+    // Memory allocated by the arenas of the store, in bytes.
+    size_t GetMemorySize() const;
+
+private:
+    using ArenaKey = std::pair<const Binning*, PackedDataId::ElementCode>;
+
+    struct ArenaEntry {
+        std::unique_ptr<Arena> arena;
+        size_t n_histograms{0};
+    };
+
+    const Binning& GetBinning(const std::string& hist_name, const DataId& id);
+
+private:
+    Channel channel;
+    HistDescResolverPtr descriptors;
+    // Prototypes of the histograms are created in memory to obtain the binning from the descriptors.
+    std::shared_ptr<TFile> prototype_file;
+    root_ext::AnalyzerData prototype_data;
+    std::vector<std::shared_ptr<EventAnalyzerData::Entry>> prototypes;
+    std::map<const HistDesc*, std::unique_ptr<Binning>> binnings;
+    std::map<ArenaKey, ArenaEntry> arenas;
+    std::unordered_map<PackedDataId, std::map<std::string, Histogram>> histograms;
+    mutable Mutex mutex;
+};
+
+} // namespace analysis
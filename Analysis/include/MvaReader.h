@@ -30,6 +30,31 @@ public:
 
     virtual double Evaluate() override;
     virtual std::shared_ptr<TMVA::Reader> GetReader() override;
+
+    // Fast path for the variables already added to the reader: index is the position of the first SetValue call.
+    void SetValueByIndex(size_t index, double value);
+    size_t GetNumberOfVariables() const { return n_vars; }
+};
+
+// Records the values of all input variables of an event, in the order in which they are computed by
+// MvaVariables::AddEvent, so that they can be shared between several methods.
+class MvaVariablesRecorder : public MvaVariables {
+public:
+    MvaVariablesRecorder(const VarNameSet& _enabled_vars);
+
+    virtual void SetValue(const std::string& name, double value, char /*type*/) override;
+    virtual void AddEventVariables(size_t /*istraining*/, const SampleId& /*mass*/, double /*weight*/,
+                                   double /*sampleweight*/, int /*spin*/, std::string /*channel*/) override {}
+    virtual std::shared_ptr<TMVA::Reader> GetReader() override { return nullptr; }
+
+    void Record(EventInfo& event, EventFitResults* fit_results = nullptr);
+    const std::vector<std::string>& GetNames() const { return names; }
+    const std::vector<double>& GetValues() const { return values; }
+
+private:
+    std::vector<std::string> names;
+    std::vector<double> values;
+    size_t position;
 };
 
 class LegacyMvaVariables : public MvaVariablesBase {
@@ -42,13 +67,17 @@ private:
 public:
     LegacyMvaVariables(const std::string& _method_name, const std::string& bdt_weights, bool _isLow);
     virtual void AddEvent(analysis::EventInfo& eventbase, const SampleId& /*mass*/ , int /* spin*/,
-                          double /*sample_weight*/, int /*which_test*/) override;
+                          double /*sample_weight*/, int /*which_test*/,
+                          EventFitResults* fit_results = nullptr) override;
     virtual double Evaluate() override;
     virtual std::shared_ptr<TMVA::Reader> GetReader() override;
 };
 
 class MvaReader {
 public:
+    MvaReader();
+    ~MvaReader();
+
     using Vars = MvaVariablesBase;
     using VarsPtr = std::shared_ptr<Vars>;
 
@@ -60,17 +89,42 @@ public:
     };
 
     using MethodMap = std::map<MvaKey, VarsPtr>;
+    using ScoreMatrix = std::vector<std::vector<double>>;
 
     VarsPtr Add(const MvaKey& key, const std::string& bdt_weights, const std::unordered_set<std::string>& enabled_vars,
                 bool is_legacy = false, bool is_Low = true);
-    double Evaluate(const MvaKey& key, EventInfo* event);
+    double Evaluate(const MvaKey& key, EventInfo* event, EventFitResults* fit_results = nullptr);
+
+    // Evaluates the given methods for a block of events: scores[n][k] is the score of keys[k] for events[n].
+    // The input variables are computed once per event and shared between all methods. Each concurrent call uses
+    // its own set of readers, so calls from different threads do not block each other. If fit_results is not
+    // empty, fit_results[n] provides the fit results of events[n].
+    ScoreMatrix EvaluateBlock(const std::vector<EventInfo*>& events, const std::vector<MvaKey>& keys,
+                              const std::vector<EventFitResults*>& fit_results = {});
+    std::vector<double> EvaluateAll(EventInfo& event, const std::vector<MvaKey>& keys,
+                                    EventFitResults* fit_results = nullptr);
+    std::vector<MvaKey> GetKeys() const;
 
 private:
+    struct MethodDescriptor {
+        std::string bdt_weights;
+        std::unordered_set<std::string> enabled_vars;
+        bool is_legacy, is_Low;
+    };
+
+    struct ReaderSet;
+    using ReaderSetPtr = std::unique_ptr<ReaderSet>;
+
     VarsPtr CreateMvaVariables(const std::string& method_name, const std::string&  bdt_weights,
                                const std::unordered_set<std::string>& enabled_vars, bool is_legacy, bool isLow = true);
+    ReaderSetPtr AcquireReaderSet();
+    void ReleaseReaderSet(ReaderSetPtr&& reader_set);
 
 private:
     MethodMap methods;
+    std::map<MvaKey, MethodDescriptor> descriptors;
+    std::vector<ReaderSetPtr> free_reader_sets;
+    std::mutex mutex;
 };
 
 }
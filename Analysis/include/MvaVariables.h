@@ -8,6 +8,9 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 #include "h-tautau/Analysis/include/EventInfo.h"
 
 namespace analysis {
+
+class EventFitResults;
+
 namespace mva_study{
 
 using ::analysis::operator<<;
@@ -53,13 +56,14 @@ public:
     using Lock = std::lock_guard<Mutex>;
 
     virtual ~MvaVariablesBase() {}
+    // If fit_results is provided, SVfit and KinFit results are taken from it instead of the event.
     virtual void AddEvent(EventInfo& eventbase, const SampleId& mass, int  spin, double sample_weight = 1.,
-                          int which_test = -1) = 0;
+                          int which_test = -1, EventFitResults* fit_results = nullptr) = 0;
     virtual double Evaluate();
     virtual std::shared_ptr<TMVA::Reader> GetReader() = 0;
 
     double AddAndEvaluate(EventInfo& eventbase, const SampleId& mass, int spin,
-                          double sample_weight = 1., int which_test = -1);
+                          double sample_weight = 1., int which_test = -1, EventFitResults* fit_results = nullptr);
 
 private:
     Mutex mutex;
@@ -79,7 +83,8 @@ public:
     bool IsEnabled(const std::string& name) const;
 
     virtual void AddEvent(analysis::EventInfo& eventbase, const SampleId& mass, int spin,
-                          double sample_weight = 1., int which_test = -1) override;
+                          double sample_weight = 1., int which_test = -1,
+                          EventFitResults* fit_results = nullptr) override;
 
 private:
     std::mt19937_64 gen;
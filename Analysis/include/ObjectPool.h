@@ -0,0 +1,74 @@
+/*! Definition of ObjectPool, the pool of reusable objects which are not thread-safe.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace analysis {
+
+// Each object acquired from the pool is used by a single owner at a time. The object returns to the pool when the
+// last copy of the returned pointer is released, therefore objects referenced by results which outlive the scope
+// of the acquisition are not reused too early. New objects are created by the factory only if all existing objects
+// are in use. Objects released after the destruction of the pool are deleted.
+template<typename T>
+class ObjectPool {
+public:
+    using Factory = std::function<std::unique_ptr<T>()>;
+    using Mutex = std::mutex;
+
+    explicit ObjectPool(Factory factory) : state(std::make_shared<State>())
+    {
+        state->factory = factory;
+    }
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    std::shared_ptr<T> Acquire()
+    {
+        std::unique_ptr<T> object;
+        {
+            std::lock_guard<Mutex> lock(state->mutex);
+            if(!state->free_objects.empty()) {
+                object = std::move(state->free_objects.back());
+                state->free_objects.pop_back();
+            }
+        }
+        if(!object) {
+            // The factory can be expensive, so it is called without holding the lock.
+            object = state->factory();
+            std::lock_guard<Mutex> lock(state->mutex);
+            ++state->n_created;
+        }
+        std::weak_ptr<State> weak_state = state;
+        return std::shared_ptr<T>(object.release(), [weak_state](T* released) {
+            std::unique_ptr<T> released_object(released);
+            if(auto pool_state = weak_state.lock()) {
+                std::lock_guard<Mutex> lock(pool_state->mutex);
+                pool_state->free_objects.push_back(std::move(released_object));
+            }
+        });
+    }
+
+    size_t GetNumberOfCreatedObjects() const
+    {
+        std::lock_guard<Mutex> lock(state->mutex);
+        return state->n_created;
+    }
+
+private:
+    struct State {
+        Factory factory;
+        std::vector<std::unique_ptr<T>> free_objects;
+        size_t n_created{0};
+        Mutex mutex;
+    };
+
+    std::shared_ptr<State> state;
+};
+
+} // namespace analysis
@@ -0,0 +1,164 @@
+/*! Definition of PackedDataId, the packed 64-bit representation of EventAnalyzerDataId.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <deque>
+#include <shared_mutex>
+#include "EventAnalyzerDataId.h"
+
+namespace analysis {
+
+namespace detail {
+
+// Thread-safe dictionary that assigns dense codes to the values of an element of EventAnalyzerDataId.
+// Code 0 is reserved for an element that is not set.
+template<typename T>
+class DataIdElementRegistry {
+public:
+    using Code = uint32_t;
+
+    static DataIdElementRegistry<T>& Instance()
+    {
+        static DataIdElementRegistry<T> registry;
+        return registry;
+    }
+
+    Code GetCode(const T& value, Code max_code)
+    {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto iter = codes.find(value);
+            if(iter != codes.end())
+                return iter->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto iter = codes.find(value);
+        if(iter != codes.end())
+            return iter->second;
+        const Code code = static_cast<Code>(values.size() + 1);
+        if(code > max_code)
+            throw exception("PackedDataId: too many different values of %1%. Max number is %2%.")
+                % typeid(T).name() % max_code;
+        codes[value] = code;
+        values.push_back(value);
+        return code;
+    }
+
+    T GetValue(Code code) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        if(code == 0 || code > values.size())
+            throw exception("PackedDataId: unknown code %1% for %2%.") % code % typeid(T).name();
+        return values.at(code - 1);
+    }
+
+private:
+    DataIdElementRegistry() {}
+
+private:
+    std::map<T, Code> codes;
+    std::deque<T> values;
+    mutable std::shared_mutex mutex;
+};
+
+template<typename T> struct PackedDataIdField;
+template<> struct PackedDataIdField<EventCategory> { static constexpr size_t offset = 0, n_bits = 10; };
+template<> struct PackedDataIdField<EventSubCategory> { static constexpr size_t offset = 10, n_bits = 16; };
+template<> struct PackedDataIdField<EventRegion> { static constexpr size_t offset = 26, n_bits = 8; };
+template<> struct PackedDataIdField<UncertaintySource> { static constexpr size_t offset = 34, n_bits = 8; };
+template<> struct PackedDataIdField<UncertaintyScale> { static constexpr size_t offset = 42, n_bits = 4; };
+template<> struct PackedDataIdField<Dataset> { static constexpr size_t offset = 46, n_bits = 18; };
+
+} // namespace detail
+
+// Each element of the id is replaced by a dense code, assigned on the first use of its value. The codes are stable
+// only within the same process, therefore packed ids should not be stored in the output files.
+class PackedDataId {
+public:
+    using Code = uint64_t;
+    using ElementCode = uint32_t;
+
+    PackedDataId() : code(0) {}
+    PackedDataId(const EventAnalyzerDataId& id);
+    static PackedDataId FromCode(Code code);
+
+    EventAnalyzerDataId Unpack() const;
+    Code GetCode() const { return code; }
+
+    template<typename T>
+    static ElementCode EncodeElement(const T& value)
+    {
+        using Field = detail::PackedDataIdField<T>;
+        static constexpr ElementCode max_code = static_cast<ElementCode>((Code(1) << Field::n_bits) - 1);
+        return detail::DataIdElementRegistry<T>::Instance().GetCode(value, max_code);
+    }
+
+    template<typename T>
+    ElementCode GetElementCode() const
+    {
+        using Field = detail::PackedDataIdField<T>;
+        static constexpr Code mask = (Code(1) << Field::n_bits) - 1;
+        return static_cast<ElementCode>((code >> Field::offset) & mask);
+    }
+
+    template<typename T>
+    bool Has() const { return GetElementCode<T>() != 0; }
+
+    template<typename T>
+    T Get() const
+    {
+        if(!Has<T>())
+            throw exception("%1% is not specified in PackedDataId = '%2%'.") % typeid(T).name() % code;
+        return detail::DataIdElementRegistry<T>::Instance().GetValue(GetElementCode<T>());
+    }
+
+    template<typename T>
+    PackedDataId Set(const T& value) const { return SetElementCode<T>(EncodeElement(value)); }
+
+    template<typename T>
+    PackedDataId SetElementCode(ElementCode element_code) const
+    {
+        using Field = detail::PackedDataIdField<T>;
+        static constexpr Code mask = (Code(1) << Field::n_bits) - 1;
+        PackedDataId result(*this);
+        result.code = (code & ~(mask << Field::offset)) | ((Code(element_code) & mask) << Field::offset);
+        return result;
+    }
+
+    bool operator==(const PackedDataId& other) const { return code == other.code; }
+    bool operator!=(const PackedDataId& other) const { return code != other.code; }
+    // The packed ids are ordered by their codes. The codes depend on the order in which the element values were
+    // first used, which varies between the runs of a multi-threaded event loop, therefore this order is not
+    // reproducible. Where a reproducible order is needed, the ids should be sorted by the unpacked ids.
+    bool operator<(const PackedDataId& other) const { return code < other.code; }
+
+private:
+    template<typename T>
+    void PackElement(const EventAnalyzerDataId& id)
+    {
+        if(id.Has<T>())
+            *this = Set(id.Get<T>());
+    }
+
+    template<typename T>
+    void UnpackElement(EventAnalyzerDataId& id) const
+    {
+        if(Has<T>())
+            id = id.Set(Get<T>());
+    }
+
+private:
+    Code code;
+};
+
+std::ostream& operator<<(std::ostream& s, const PackedDataId& id);
+
+} // namespace analysis
+
+namespace std {
+template<>
+struct hash<analysis::PackedDataId> {
+    size_t operator()(const analysis::PackedDataId& id) const { return std::hash<uint64_t>{}(id.GetCode()); }
+};
+} // namespace std
@@ -45,9 +45,13 @@ struct AnalyzerSetup {
     std::map<SelectionCut,analysis::EllipseParameters> massWindowParams;
     std::map<std::string, std::vector<std::string>> limit_setup_raw;
     std::map<std::string, std::map<EventCategory, std::string>> limit_setup;
+    std::map<std::string, std::vector<std::string>> unc_variables_raw;
+    // Variables for which the histograms of the shifted uncertainty scales are produced.
+    std::map<UncertaintyScale, std::set<std::string>> unc_variables;
 
     bool IsSignal(const std::string& sample_name) const;
     void CreateLimitSetups();
+    void CreateUncVariables();
     void ConvertToEventRegion();
 };
 
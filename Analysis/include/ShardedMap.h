@@ -0,0 +1,86 @@
+/*! Definition of ShardedMap, the hash map for concurrent read-mostly access.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace analysis {
+
+// Hash map split into independent shards, each one guarded by its own shared mutex. Lookups of existing entries
+// take only the shared lock of a single shard, therefore they do not block each other, while an insertion blocks
+// only the lookups in the same shard. Entries are never removed and values are returned by copy, so Value should be
+// cheap to copy (e.g. a pointer).
+template<typename Key, typename Value, typename Hash = std::hash<Key>, size_t NumberOfShards = 64>
+class ShardedMap {
+public:
+    using Mutex = std::shared_mutex;
+
+    ShardedMap() {}
+    ShardedMap(const ShardedMap&) = delete;
+    ShardedMap& operator=(const ShardedMap&) = delete;
+
+    bool Find(const Key& key, Value& value) const
+    {
+        const Shard& shard = GetShard(key);
+        std::shared_lock<Mutex> lock(shard.mutex);
+        auto iter = shard.map.find(key);
+        if(iter == shard.map.end())
+            return false;
+        value = iter->second;
+        return true;
+    }
+
+    // Returns the value of the existing entry or inserts the value created by make(). make() is called with the lock
+    // of the shard held, hence it is called only once for each key.
+    template<typename Factory>
+    Value GetOrCreate(const Key& key, Factory&& make)
+    {
+        Value value;
+        if(Find(key, value))
+            return value;
+        Shard& shard = GetShard(key);
+        std::unique_lock<Mutex> lock(shard.mutex);
+        auto iter = shard.map.find(key);
+        if(iter == shard.map.end())
+            iter = shard.map.emplace(key, make()).first;
+        return iter->second;
+    }
+
+    size_t size() const
+    {
+        size_t n = 0;
+        for(const Shard& shard : shards) {
+            std::shared_lock<Mutex> lock(shard.mutex);
+            n += shard.map.size();
+        }
+        return n;
+    }
+
+private:
+    struct Shard {
+        std::unordered_map<Key, Value, Hash> map;
+        mutable Mutex mutex;
+    };
+
+    // The hash is mixed before selecting the shard, since std::hash of integers is usually the identity.
+    Shard& GetShard(const Key& key) { return shards[ShardIndex(key)]; }
+    const Shard& GetShard(const Key& key) const { return shards[ShardIndex(key)]; }
+    static size_t ShardIndex(const Key& key)
+    {
+        uint64_t h = static_cast<uint64_t>(Hash{}(key));
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<size_t>(h % NumberOfShards);
+    }
+
+private:
+    std::array<Shard, NumberOfShards> shards;
+};
+
+} // namespace analysis
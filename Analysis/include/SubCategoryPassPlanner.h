@@ -0,0 +1,49 @@
+/*! Definition of SubCategoryPassPlanner, the grouping of sub-categories into the processing passes.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include "AnalysisCategories.h"
+
+namespace analysis {
+
+// Groups the sub-categories into the passes, which are processed one at a time. If the memory budget is set, the
+// sub-categories are packed into the smallest number of passes whose estimated memory fits into the budget (using
+// the first-fit decreasing heuristic). A sub-category that alone exceeds the budget is processed in its own pass.
+// Otherwise, each pass contains up to n_parallel sub-categories in the original order.
+class SubCategoryPassPlanner {
+public:
+    struct Pass {
+        std::vector<EventSubCategory> subCategories;
+        size_t memory_estimate{0};
+    };
+
+    // Approximate size of a histogram object in memory without the bin contents.
+    static constexpr size_t HistogramOverhead = 1024;
+
+    SubCategoryPassPlanner(size_t _n_parallel, size_t _memory_budget);
+
+    // Memory needed to keep a histogram with n_bins bins, including the sums of the squared weights.
+    static size_t GetHistogramMemorySize(size_t n_bins);
+
+    void AddSubCategory(const EventSubCategory& subCategory, size_t memory_estimate = 0);
+    std::vector<Pass> Plan() const;
+    bool HasMemoryBudget() const { return memory_budget != 0; }
+    size_t GetMemoryBudget() const { return memory_budget; }
+
+private:
+    size_t n_parallel, memory_budget;
+    std::vector<EventSubCategory> subCategories;
+    std::vector<size_t> memory_estimates;
+};
+
+// Memory usage of the current process, as reported by /proc/self/status. The sizes are in bytes, and 0 is returned
+// if the information is not available.
+struct ProcessMemoryUsage {
+    static size_t GetRss();
+    static size_t GetPeakRss();
+    // Resets the peak RSS to the current RSS, so that the peak of the next pass can be measured.
+    static bool ResetPeakRss();
+};
+
+} // namespace analysis
@@ -0,0 +1,87 @@
+/*! Definition of SyncDataIdMatcher class, the matcher of data ids against the patterns of the sync descriptors.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#pragma once
+
+#include <mutex>
+#include <boost/regex.hpp>
+#include "PackedDataId.h"
+
+namespace analysis {
+
+// All values which the elements of EventAnalyzerDataId can take in the analyzer output.
+struct DataIdUniverse {
+    EventCategorySet categories;
+    EventSubCategorySet sub_categories;
+    EventRegionSet regions;
+    std::set<UncertaintySource> unc_sources;
+    std::set<UncertaintyScale> unc_scales;
+    std::set<Dataset> datasets;
+};
+
+// Matches data ids against a regular expression for their full names. If the expression can be split into
+// independent expressions for each element of the id (i.e. its separators are plain characters outside of groups,
+// character classes and repetitions, and there are no cross-element constructs), it is expanded at construction
+// over the universe of the possible values into a hashed set of packed ids, so that the matching requires only
+// a single lookup. Otherwise, the result of the regex matching is cached for each data id.
+class SyncDataIdMatcher {
+public:
+    using ElementCode = PackedDataId::ElementCode;
+    using CodeSet = std::unordered_set<ElementCode>;
+    static constexpr size_t MaxExpandedSize = 1 << 20;
+
+    SyncDataIdMatcher(const std::string& pattern, const DataIdUniverse& universe);
+
+    bool Match(const PackedDataId& id) const;
+    bool IsPrecompiled() const { return is_precompiled; }
+    const std::string& GetPattern() const { return pattern; }
+
+private:
+    template<typename T>
+    static std::vector<ElementCode> Expand(const std::string& element_pattern, const std::set<T>& values)
+    {
+        const boost::regex regex(element_pattern);
+        std::vector<ElementCode> allowed;
+        for(const auto& value : values) {
+            if(boost::regex_match(ToString(value), regex))
+                allowed.push_back(PackedDataId::EncodeElement(value));
+        }
+        return allowed;
+    }
+
+    template<typename T>
+    void AddElement(const std::vector<ElementCode>& element_codes, std::vector<PackedDataId>& ids)
+    {
+        allowed_codes.emplace_back(element_codes.begin(), element_codes.end());
+        if(!is_expanded) return;
+        if(ids.size() * element_codes.size() > MaxExpandedSize) {
+            is_expanded = false;
+            ids.clear();
+            return;
+        }
+        std::vector<PackedDataId> new_ids;
+        new_ids.reserve(ids.size() * element_codes.size());
+        for(const auto& id : ids) {
+            for(ElementCode code : element_codes)
+                new_ids.push_back(id.SetElementCode<T>(code));
+        }
+        ids = std::move(new_ids);
+    }
+
+    template<typename T>
+    bool IsAllowed(const PackedDataId& id, size_t element_index) const
+    {
+        return allowed_codes.at(element_index).count(id.GetElementCode<T>());
+    }
+
+private:
+    std::string pattern;
+    bool is_precompiled, is_expanded;
+    std::unordered_set<PackedDataId> allowed_ids;
+    std::vector<CodeSet> allowed_codes;
+    std::shared_ptr<boost::regex> regex;
+    mutable std::unordered_map<PackedDataId, bool> match_cache;
+    mutable std::mutex mutex;
+};
+
+} // namespace analysis
@@ -6,6 +6,7 @@ This file is part of https://github.com/hh-italian-group/h-tautau. */
 #include "AnalysisTools/Core/include/SmartTree.h"
 #include "h-tautau/Analysis/include/EventInfo.h"
 #include "h-tautau/Core/include/TauIdResults.h"
+#include "hh-bbtautau/Analysis/include/FitResultsCache.h"
 #include "hh-bbtautau/Analysis/include/MvaReader.h"
 
 #define LVAR(type, name, pref) VAR(type, name##_##pref)
@@ -273,9 +274,11 @@ INITIALIZE_TREE(htt_sync, SyncTuple, SYNC_DATA)
 namespace htt_sync {
 
 
+// If fit_results is provided, SVfit and KinFit results of the event are taken from it instead of the event.
 void FillSyncTuple(analysis::EventInfo& event, htt_sync::SyncTuple& sync, analysis::Period run_period,
                    bool apply_svFit, double weight, double lepton_id, double lepton_trigger,
                    double btag_weight, double shape_weight, double jet_pu_id_weight,
+                   analysis::EventFitResults* fit_results = nullptr,
                    analysis::mva_study::MvaReader* mva_reader = nullptr,
                    analysis::EventInfo* event_tau_up = nullptr,
                    analysis::EventInfo* event_tau_down = nullptr,
@@ -8,6 +8,7 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 #include "hh-bbtautau/Analysis/include/LimitsInputProducer.h"
 #include "hh-bbtautau/Analysis/include/SampleDescriptorConfigEntryReader.h"
 #include "hh-bbtautau/Analysis/include/StackedPlotsProducer.h"
+#include "hh-bbtautau/Analysis/include/SubCategoryPassPlanner.h"
 
 namespace analysis {
 
@@ -17,6 +18,8 @@ struct AnalyzerArguments : CoreAnalyzerArguments {
     REQ_ARG(std::string, output);
     REQ_ARG(std::string, vars);
     OPT_ARG(size_t, n_parallel, 10);
+    // Memory budget for the histograms of a single pass in MB. If set, it is used instead of n_parallel.
+    OPT_ARG(size_t, max_memory, 0);
 };
 
 class CreatePlots : public EventAnalyzerCore {
@@ -47,15 +50,14 @@ public:
                     ana_setup.draw_sequence, sample_descriptors, cmb_sample_descriptors, ana_setup.signals,
                     ana_setup.data, args.channel());
 
-        const std::vector<EventSubCategory> all_subCategories(sub_categories_to_process.begin(),
-                                                              sub_categories_to_process.end());
-
-        for(size_t n = 0; n * args.n_parallel() < all_subCategories.size(); ++n) {
+        const auto passes = PlanPasses();
+        for(size_t n = 0; n < passes.size(); ++n) {
+            ProcessMemoryUsage::ResetPeakRss();
             AnaDataCollection anaDataCollection(inputFile, channelId, activeVariables, histConfig.GetItems(),
                                                 true, bkg_names, unc_collection);
             EventSubCategorySet subCategories;
-            for(size_t k = 0; k < args.n_parallel() && n * args.n_parallel() + k < all_subCategories.size(); ++k) {
-                const auto& subCategory = all_subCategories.at(n * args.n_parallel() + k);
+            std::cout << "Pass " << n + 1 << "/" << passes.size() << ": ";
+            for(const auto& subCategory : passes.at(n).subCategories) {
                 subCategories.insert(subCategory);
                 std::cout << subCategory << " ";
             }
@@ -69,10 +71,50 @@ public:
                 pdf_prefix += "_part" + ToString(n + 1);
             plotsProducer.PrintStackedPlots(pdf_prefix, EventRegion::SignalRegion(), ana_setup.categories,
                                             subCategories, signal_names);
+            std::cout << "\tPass " << n + 1 << " memory: estimated = " << ToMB(passes.at(n).memory_estimate)
+                      << " MB, peak RSS = " << ToMB(ProcessMemoryUsage::GetPeakRss()) << " MB." << std::endl;
         }
     }
 
 private:
+    static double ToMB(size_t n_bytes) { return n_bytes / (1024. * 1024.); }
+
+    // The memory of a sub-category is estimated from the uncompressed size of the histograms in the signal region,
+    // which are read from the input file to draw the plots.
+    size_t EstimateMemory(const EventSubCategory& subCategory) const
+    {
+        size_t memory = 0;
+        for(const auto& category : ana_setup.categories) {
+            const std::string dir_name = boost::str(boost::format("%1%/%2%/%3%/%4%/%5%") % category % subCategory
+                    % EventRegion::SignalRegion() % UncertaintySource::None % UncertaintyScale::Central);
+            TDirectory* dir = inputFile->GetDirectory(dir_name.c_str());
+            if(!dir) continue;
+            for(const auto sample_key_obj : *dir->GetListOfKeys()) {
+                TDirectory* sample_dir = dir->GetDirectory(sample_key_obj->GetName());
+                if(!sample_dir) continue;
+                for(const auto hist_key_obj : *sample_dir->GetListOfKeys()) {
+                    const TKey* hist_key = dynamic_cast<const TKey*>(hist_key_obj);
+                    if(hist_key && activeVariables.count(hist_key->GetName()))
+                        memory += SubCategoryPassPlanner::HistogramOverhead
+                                  + static_cast<size_t>(hist_key->GetObjlen());
+                }
+            }
+        }
+        return memory;
+    }
+
+    std::vector<SubCategoryPassPlanner::Pass> PlanPasses() const
+    {
+        static constexpr size_t MB = 1024 * 1024;
+        SubCategoryPassPlanner planner(args.n_parallel(), args.max_memory() * MB);
+        for(const auto& subCategory : sub_categories_to_process)
+            planner.AddSubCategory(subCategory, planner.HasMemoryBudget() ? EstimateMemory(subCategory) : 0);
+        const auto passes = planner.Plan();
+        if(planner.HasMemoryBudget())
+            std::cout << "Sub-categories are split into " << passes.size() << " passes to fit into the memory budget"
+                      << " of " << args.max_memory() << " MB." << std::endl;
+        return passes;
+    }
 
     static std::set<std::string> ParseVarSet(const std::string& active_vars_str)
     {
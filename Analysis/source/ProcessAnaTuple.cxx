@@ -5,9 +5,12 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 #include "hh-bbtautau/Analysis/include/AnaTuple.h"
 #include "hh-bbtautau/Analysis/include/EventAnalyzerCore.h"
 #include "hh-bbtautau/Analysis/include/EventAnalyzerDataCollection.h"
+#include "hh-bbtautau/Analysis/include/HistogramStore.h"
 #include "hh-bbtautau/Analysis/include/LimitsInputProducer.h"
 #include "hh-bbtautau/Analysis/include/SampleDescriptorConfigEntryReader.h"
 #include "hh-bbtautau/Analysis/include/StackedPlotsProducer.h"
+#include "hh-bbtautau/Analysis/include/SubCategoryPassPlanner.h"
+#include <TROOT.h>
 
 namespace analysis {
 
@@ -20,6 +23,10 @@ struct AnalyzerArguments : CoreAnalyzerArguments {
     OPT_ARG(bool, draw, true);
     OPT_ARG(std::string, vars, "");
     OPT_ARG(size_t, n_parallel, 10);
+    // Memory budget for the histograms of a single pass in MB. If set, the sub-categories are split into several
+    // event loops to fit into the budget, and it is used instead of n_parallel.
+    OPT_ARG(size_t, max_memory, 0);
+    OPT_ARG(std::string, column_cache, "");
 };
 
 class ProcessAnaTuple : public EventAnalyzerCore {
@@ -30,7 +37,7 @@ public:
 
     ProcessAnaTuple(const AnalyzerArguments& _args) :
         EventAnalyzerCore(_args, _args.channel()), args(_args), activeVariables(ParseVarSet(args.vars())),
-        tupleReader(args.input(), args.channel(), activeVariables),
+        tupleReader(args.input(), args.channel(), activeVariables, args.column_cache()),
         outputFile(root_ext::CreateRootFile(args.output() + "_full.root"))
     {
         histConfig.Parse(FullPath(ana_setup.hist_cfg));
@@ -54,6 +61,24 @@ public:
                 }
             }
         }
+
+        // Only the listed variables, or the limit variables by default, are filled for the shifted scales.
+        for(UncertaintyScale scale : { UncertaintyScale::Up, UncertaintyScale::Down }) {
+            const auto iter = ana_setup.unc_variables.find(scale);
+            if(iter == ana_setup.unc_variables.end()) {
+                uncScaleVariables[scale] = limitVariables;
+                continue;
+            }
+            for(const auto& var : limitVariables) {
+                if(!iter->second.count(var))
+                    throw exception("Variable '%1%' is used in the limit setup, but it is not listed in unc_variables"
+                                    " for the uncertainty scale %2%.") % var % scale;
+            }
+            for(const auto& var : iter->second) {
+                if(activeVariables.count(var))
+                    uncScaleVariables[scale].insert(var);
+            }
+        }
     }
 
     void Run()
@@ -66,57 +91,47 @@ public:
 
         std::ofstream qcd_out(args.output() +"_QCD.txt");
 
-        const std::vector<EventSubCategory> all_subCategories(sub_categories_to_process.begin(),
-                                                              sub_categories_to_process.end());
-
-        for(size_t n = 0; n * args.n_parallel() < all_subCategories.size(); ++n) {
-            AnaDataCollection anaDataCollection(outputFile, channelId, activeVariables, histConfig.GetItems(),
-                                                false, bkg_names, unc_collection);
-            EventSubCategorySet subCategories;
-            for(size_t k = 0; k < args.n_parallel() && n * args.n_parallel() + k < all_subCategories.size(); ++k) {
-                const auto& subCategory = all_subCategories.at(n * args.n_parallel() + k);
-                subCategories.insert(subCategory);
-                std::cout << subCategory << " ";
-            }
-            std::cout << std::endl;
-
-            std::cout << "\tCreating histograms..." << std::endl;
-            ProduceHistograms(anaDataCollection, subCategories);
-
-            std::cout << "\tProcessing combined samples and QCD... " << std::endl;
-            for(const auto& subCategory : subCategories) {
-
-                ProcessCombinedSamples(anaDataCollection, subCategory, ana_setup.cmb_samples);
-                for(const auto& sample : sample_descriptors) {
-                    if(sample.second.sampleType == SampleType::QCD) {
-                        EstimateQCD(anaDataCollection, subCategory, sample.second, qcd_out);
-                        break;
-                    }
+        auto histDescs = std::make_shared<HistDescResolver>(histConfig.GetItems());
+        auto histogramStore = std::make_shared<HistogramStore>(args.channel(), histDescs);
+
+        // Each pass is a single event loop over the AnaTuple. Without the memory budget, all sub-categories are
+        // filled in a single pass and are processed afterwards in chunks of n_parallel sub-categories. With the
+        // memory budget, the passes are planned before the histograms are filled, so that the store holds only the
+        // histograms of the sub-categories of the current pass, and each pass is processed at once.
+        const auto memory_estimates = EstimateMemory(*histogramStore);
+        const auto passes = PlanPasses(memory_estimates);
+        size_t n_chunks = 0;
+        for(size_t n = 0; n < passes.size(); ++n) {
+            ProcessMemoryUsage::ResetPeakRss();
+            const EventSubCategorySet subCategories(passes.at(n).subCategories.begin(),
+                                                    passes.at(n).subCategories.end());
+            const auto chunks = SplitIntoChunks(passes.at(n));
+            for(size_t k = 0; k < chunks.size(); ++k) {
+                AnaDataCollection anaDataCollection(outputFile, channelId, activeVariables, histDescs, false,
+                                                    bkg_names, unc_collection);
+                for(const auto& [scale, vars] : uncScaleVariables)
+                    anaDataCollection.SetUncertaintyScaleHistograms(scale, vars);
+                anaDataCollection.SetHistogramStore(histogramStore);
+
+                if(k == 0) {
+                    std::cout << "Creating histograms for " << subCategories.size() << " sub-categories";
+                    if(passes.size() > 1)
+                        std::cout << " in pass " << n + 1 << "/" << passes.size();
+                    std::cout << "..." << std::endl;
+                    FillHistograms(*histogramStore, anaDataCollection, subCategories, memory_estimates);
                 }
-            }
 
-            if(args.shapes()) {
-                std::cout << "\t\tProducing inputs for limits..." << std::endl;
-                LimitsInputProducer limitsInputProducer(anaDataCollection, sample_descriptors,
-                                                        cmb_sample_descriptors);
-                for(const auto& limit_setup : ana_setup.limit_setup){
-                    std::cout << "\t\tsetup_name: " << limit_setup.first <<  std::endl;
-                    for(const auto& subCategory : subCategories)
-                        limitsInputProducer.Produce(args.output(), limit_setup.first, limit_setup.second, subCategory,
-                                                    ana_setup.unc_sources, ana_setup.regions, mva_sel_aliases,
-                                                    args.period());
-                }
-            }
-            if(args.draw()) {
-                std::cout << "\t\tCreating plots..." << std::endl;
-                PlotsProducer plotsProducer(anaDataCollection, samplesToDraw, FullPath(ana_setup.plot_cfg),
-                                            ana_setup.plot_page_opt);
-                std::string pdf_prefix = args.output();
-                if(n != 0)
-                    pdf_prefix += "_part" + ToString(n + 1);
-                plotsProducer.PrintStackedPlots(pdf_prefix, EventRegion::SignalRegion(), ana_setup.categories,
-                                                subCategories, signal_names);
+                std::cout << "Processing sub-categories: ";
+                for(const auto& subCategory : chunks.at(k))
+                    std::cout << subCategory << " ";
+                std::cout << std::endl;
+                ProcessSubCategories(anaDataCollection, chunks.at(k), n_chunks++, signal_names, samplesToDraw,
+                                     qcd_out);
             }
+            std::cout << "\tPass " << n + 1 << " memory: ";
+            if(GetMemoryBudget())
+                std::cout << "estimated = " << ToMB(passes.at(n).memory_estimate) << " MB, ";
+            std::cout << "peak RSS = " << ToMB(ProcessMemoryUsage::GetPeakRss()) << " MB." << std::endl;
         }
 
         std::cout << "Saving output file..." << std::endl;
@@ -124,118 +139,343 @@ public:
 
 private:
 
+    // Data ids selected for the histograms. The table is indexed by the dense index of the data id in AnaTupleReader.
+    struct DataIdSlot {
+        // nullptr, if the data id is not selected.
+        const EventAnalyzerDataId* dataId{nullptr};
+        UncertaintyScale scale{UncertaintyScale::Central};
+    };
+    using DataIdSlotTable = std::vector<DataIdSlot>;
+
+    // RDataFrame creates a copy of the filler for each processing slot. Each copy fills its own replica of the
+    // histograms without locks. The replicas are merged into the store every ReplicaFlushEntries entries of the
+    // slot and at the end of the event loop, so that a replica holds only the histograms filled since the last merge.
     struct AnaDataFiller : public TObject {
-        using Hist = EventAnalyzerData::Entry::Hist;
-        using Mutex = Hist::Mutex;
-        using HistMap = std::map<size_t, Hist*>;
+        using Hist = HistogramStore::Histogram;
+        using Mutex = HistogramStore::Mutex;
+        using Replica = HistogramStore::Replica;
+        using BinIndexCache = HistogramStore::BinIndexCache;
+
+        struct HistEntry {
+            Hist* hist{nullptr};
+            BinIndexCache* bin_index{nullptr};
+            bool resolved{false};
+        };
+        using HistVector = std::vector<HistEntry>;
+        static constexpr size_t ReplicaFlushEntries = 10000;
         // template <typename T> using VecType = std::vector<T>;
 
         const bbtautau::AnaTupleReader* tupleReader;
-        AnaDataCollection* anaDataCollection;
-        const EventCategorySet* categories;
-        const EventSubCategorySet* subCategories;
-        const std::set<UncertaintySource>* unc_sources;
+        HistogramStore* histogramStore;
+        const DataIdSlotTable* slots;
         std::string hist_name;
-        bool is_mva_score, is_limit_var;
-        std::shared_ptr<HistMap> histograms;
-        std::shared_ptr<Mutex> mutex;
-
-        AnaDataFiller(const bbtautau::AnaTupleReader& _tupleReader, AnaDataCollection& _anaDataCollection,
-                      const EventCategorySet& _categories, const EventSubCategorySet& _subCategories,
-                      const std::set<UncertaintySource>& _unc_sources,
-                      const std::string& _hist_name, bool _is_limit_var) :
-                tupleReader(&_tupleReader), anaDataCollection(&_anaDataCollection), categories(&_categories),
-                subCategories(&_subCategories), unc_sources(&_unc_sources), hist_name(_hist_name),
-                is_mva_score(_hist_name == "mva_score"), is_limit_var(_is_limit_var),
-                histograms(std::make_shared<HistMap>()), mutex(std::make_shared<Mutex>()) {}
-        AnaDataFiller(AnaDataFiller&) = default;
+        bool is_mva_score;
+        // Uncertainty scales for which the variable is filled.
+        std::set<UncertaintyScale> scales;
+        std::shared_ptr<Replica> replica;
+        std::shared_ptr<HistVector> histograms;
+
+        AnaDataFiller(const bbtautau::AnaTupleReader& _tupleReader, HistogramStore& _histogramStore,
+                      const DataIdSlotTable& _slots, const std::string& _hist_name,
+                      const std::set<UncertaintyScale>& _scales) :
+                tupleReader(&_tupleReader), histogramStore(&_histogramStore), slots(&_slots), hist_name(_hist_name),
+                is_mva_score(_hist_name == "mva_score"), scales(_scales),
+                replica(std::make_shared<Replica>(_histogramStore)),
+                histograms(std::make_shared<HistVector>(_slots.size())) {}
+        AnaDataFiller(const AnaDataFiller& other) :
+                TObject(other), tupleReader(other.tupleReader), histogramStore(other.histogramStore),
+                slots(other.slots), hist_name(other.hist_name), is_mva_score(other.is_mva_score),
+                scales(other.scales), replica(std::make_shared<Replica>(*other.histogramStore)),
+                histograms(std::make_shared<HistVector>(other.slots->size())) {}
         AnaDataFiller(AnaDataFiller&&) = default;
         //AnaDataFiller& operator=(const AnaDataFiller&) = default;
         // virtual ~AnaDataFiller() {}
 
 
         template<typename T>
-        void Fill(size_t dataId_hash, double weight, T&& value) const
+        void Fill(unsigned dataId_index, double weight, T&& value) const
         {
-            Hist* hist = GetHistogram(dataId_hash);
-            if(hist) {
+            const HistEntry& entry = GetHistogram(dataId_index);
+            if(entry.hist) {
                 auto x = value;
                 if(is_mva_score) {
-                    const auto& dataId = tupleReader->GetDataIdByHash(dataId_hash);
+                    const auto& dataId = *slots->at(dataId_index).dataId;
                     x = static_cast<T>(tupleReader->GetNormalizedMvaScore(dataId, static_cast<float>(x)));
                 }
-
-                std::lock_guard<Hist::Mutex> lock(hist->GetMutex());
-                hist->Fill(x, weight);
+                entry.hist->FillBin(entry.bin_index->FindBin(static_cast<double>(x)), weight);
             }
         }
 
-        void Merge(TList*) {}
+        void Merge(TList* others)
+        {
+            for(TObject* other : *others)
+                static_cast<AnaDataFiller*>(other)->replica->Merge();
+        }
+
+        // Adds the content of the replica to the store and releases it. The histograms are resolved again when they
+        // are filled next time.
+        void FlushReplica()
+        {
+            replica->Merge();
+            for(auto& entry : *histograms)
+                entry = HistEntry();
+        }
 
     private:
-        Hist* GetHistogram(size_t dataId_hash) const
+        const HistEntry& GetHistogram(unsigned dataId_index) const
         {
-            std::lock_guard<Mutex> lock(*mutex);
-            auto iter = histograms->find(dataId_hash);
-            if(iter != histograms->end())
-                return iter->second;
-            const auto& dataId = tupleReader->GetDataIdByHash(dataId_hash);
-            Hist* hist = nullptr;
-            if(categories->count(dataId.Get<EventCategory>())
-                    && subCategories->count(dataId.Get<EventSubCategory>())
-                    && unc_sources->count(dataId.Get<UncertaintySource>())
-                    && (is_limit_var || dataId.Get<UncertaintyScale>() == UncertaintyScale::Central)) {
-                 hist = &anaDataCollection->Get(dataId).GetHistogram(hist_name)();
-             }
-            (*histograms)[dataId_hash] = hist;
-            return hist;
+            HistEntry& entry = histograms->at(dataId_index);
+            if(!entry.resolved) {
+                const DataIdSlot& slot = slots->at(dataId_index);
+                if(slot.dataId && scales.count(slot.scale)) {
+                    entry.hist = &replica->Get(*slot.dataId, hist_name);
+                    entry.bin_index = &replica->GetBinIndexCache(entry.hist->GetBinning());
+                }
+                entry.resolved = true;
+            }
+            return entry;
         }
     };
 
     template <typename T> using VecType = ROOT::VecOps::RVec<T>;
 
-    void ProduceHistograms(AnaDataCollection& anaDataCollection, const EventSubCategorySet& subCategories)
+    bool IsSelected(const EventAnalyzerDataId& dataId, const EventSubCategorySet& subCategories) const
     {
-        const auto has_column = [](bbtautau::AnaTupleReader::RDF& df, const std::string& column_name) {
-            auto columns = df.GetColumnNames();
-            auto iter = std::find(columns.begin(), columns.end(), column_name);
-            return iter != columns.end();
-        };
+        return ana_setup.categories.count(dataId.Get<EventCategory>())
+                && subCategories.count(dataId.Get<EventSubCategory>())
+                && ana_setup.unc_sources.count(dataId.Get<UncertaintySource>());
+    }
 
-        const auto is_defined_column = [](bbtautau::AnaTupleReader::RDF& df, const std::string& column_name) {
-            auto columns = df.GetDefinedColumnNames();
-            auto iter = std::find(columns.begin(), columns.end(), column_name);
-            return iter != columns.end();
-        };
+    std::set<UncertaintyScale> GetUncertaintyScales(const std::string& hist_name) const
+    {
+        std::set<UncertaintyScale> scales = { UncertaintyScale::Central };
+        for(const auto& [scale, vars] : uncScaleVariables) {
+            if(vars.count(hist_name))
+                scales.insert(scale);
+        }
+        return scales;
+    }
 
-        const auto get_df = [&](const std::string& hist_name) {
-            auto main_df = tupleReader.GetDataFrame();
-            if(has_column(main_df, hist_name)) return main_df;
-            for(auto df : tupleReader.GetSkimmedDataFrames())
-                if(has_column(df, hist_name)) return df;
-            throw exception("ProduceHistograms: Column with name '%1%' not found.") % hist_name;
-        };
+    static double ToMB(size_t n_bytes) { return n_bytes / (1024. * 1024.); }
+
+    static size_t GetNumberOfSlots() { return ROOT::IsImplicitMTEnabled() ? ROOT::GetThreadPoolSize() : 1; }
+
+    size_t GetMemoryBudget() const
+    {
+        static constexpr size_t MB = 1024 * 1024;
+        return args.max_memory() * MB;
+    }
+
+    struct MemoryEstimate {
+        // ROOT histograms, created when the histograms are extracted from the store.
+        size_t histograms{0};
+        // Records in the store and in the replicas of all processing slots, kept while the histograms are filled.
+        size_t fill{0};
+
+        size_t GetTotal() const { return histograms + fill; }
+    };
+    using MemoryEstimateMap = std::map<EventSubCategory, std::map<std::string, MemoryEstimate>>;
+
+    // The memory of each variable in a sub-category is estimated from the histograms of the data ids in the AnaAux
+    // dictionary, if the memory budget is set. Histograms of the combined samples and of QCD are not included.
+    MemoryEstimateMap EstimateMemory(HistogramStore& histogramStore) const
+    {
+        MemoryEstimateMap memory_estimates;
+        if(!GetMemoryBudget()) return memory_estimates;
+        const size_t n_records = 1 + GetNumberOfSlots();
+        std::map<std::string, std::set<UncertaintyScale>> hist_scales;
+        for(const auto& hist_name : activeVariables)
+            hist_scales[hist_name] = GetUncertaintyScales(hist_name);
+        for(size_t n = 0; n < tupleReader.GetNumberOfDataIds(); ++n) {
+            const auto& dataId = tupleReader.GetDataIdByIndex(n);
+            if(!IsSelected(dataId, sub_categories_to_process)) continue;
+            auto& subCategory_estimates = memory_estimates[dataId.Get<EventSubCategory>()];
+            for(const auto& [hist_name, scales] : hist_scales) {
+                if(!scales.count(dataId.Get<UncertaintyScale>())) continue;
+                const size_t n_bins = histogramStore.GetNumberOfBins(hist_name, dataId);
+                auto& estimate = subCategory_estimates[hist_name];
+                estimate.histograms += SubCategoryPassPlanner::GetHistogramMemorySize(n_bins);
+                estimate.fill += n_records * HistogramStore::Arena::GetRecordSize(n_bins) * sizeof(double);
+            }
+        }
+        return memory_estimates;
+    }
+
+    // Without the memory budget, all sub-categories are filled in a single pass.
+    std::vector<SubCategoryPassPlanner::Pass> PlanPasses(const MemoryEstimateMap& memory_estimates) const
+    {
+        if(!GetMemoryBudget()) {
+            SubCategoryPassPlanner::Pass pass;
+            pass.subCategories.assign(sub_categories_to_process.begin(), sub_categories_to_process.end());
+            return { pass };
+        }
+        SubCategoryPassPlanner planner(args.n_parallel(), GetMemoryBudget());
+        for(const auto& subCategory : sub_categories_to_process) {
+            size_t memory = 0;
+            const auto iter = memory_estimates.find(subCategory);
+            if(iter != memory_estimates.end()) {
+                for(const auto& [hist_name, estimate] : iter->second)
+                    memory += estimate.GetTotal();
+            }
+            planner.AddSubCategory(subCategory, memory);
+        }
+        const auto passes = planner.Plan();
+        std::cout << "Sub-categories are split into " << passes.size() << " passes to fit into the memory budget"
+                  << " of " << args.max_memory() << " MB." << std::endl;
+        for(const auto& pass : passes) {
+            if(pass.memory_estimate > planner.GetMemoryBudget())
+                std::cout << "Warning: estimated memory of the sub-category " << pass.subCategories.front()
+                          << " (" << ToMB(pass.memory_estimate) << " MB) exceeds the budget. Its variables"
+                          << " will be filled in several event loops." << std::endl;
+        }
+        return passes;
+    }
+
+    // With the memory budget, the pass is planned to fit into it and it is processed at once. Otherwise, the
+    // sub-categories of the pass are processed in chunks of n_parallel sub-categories.
+    std::vector<EventSubCategorySet> SplitIntoChunks(const SubCategoryPassPlanner::Pass& pass) const
+    {
+        if(GetMemoryBudget())
+            return { EventSubCategorySet(pass.subCategories.begin(), pass.subCategories.end()) };
+        SubCategoryPassPlanner planner(args.n_parallel(), 0);
+        for(const auto& subCategory : pass.subCategories)
+            planner.AddSubCategory(subCategory);
+        std::vector<EventSubCategorySet> chunks;
+        for(const auto& chunk : planner.Plan())
+            chunks.emplace_back(chunk.subCategories.begin(), chunk.subCategories.end());
+        return chunks;
+    }
+
+    // Splits the variables into groups, which are filled in separate event loops. Usually all variables are filled
+    // in a single event loop. If the histograms of the pass exceed the memory budget, which can happen only for a
+    // sub-category that alone does not fit into the budget, the variables are split so that the ROOT histograms of
+    // the pass and the records of a single group fit into the budget, if possible.
+    std::vector<std::set<std::string>> PlanFillGroups(const EventSubCategorySet& subCategories,
+                                                      const MemoryEstimateMap& memory_estimates) const
+    {
+        size_t histograms_memory = 0;
+        std::map<std::string, size_t> fill_memory;
+        for(const auto& subCategory : subCategories) {
+            const auto iter = memory_estimates.find(subCategory);
+            if(iter == memory_estimates.end()) continue;
+            for(const auto& [hist_name, estimate] : iter->second) {
+                histograms_memory += estimate.histograms;
+                fill_memory[hist_name] += estimate.fill;
+            }
+        }
+
+        const size_t budget = GetMemoryBudget();
+        std::vector<std::set<std::string>> groups(1);
+        size_t group_memory = 0;
+        for(const auto& hist_name : activeVariables) {
+            const size_t memory = fill_memory[hist_name];
+            if(budget && !groups.back().empty() && histograms_memory + group_memory + memory > budget) {
+                groups.emplace_back();
+                group_memory = 0;
+            }
+            groups.back().insert(hist_name);
+            group_memory += memory;
+        }
+        if(groups.size() > 1) {
+            std::cout << "\tVariables are filled in " << groups.size() << " event loops to fit into the memory budget."
+                      << std::endl;
+        }
+        return groups;
+    }
+
+    // Fills the histograms of the sub-categories into the store. If the variables are split into several event
+    // loops, the histograms filled by all loops except the last are moved into the collection.
+    void FillHistograms(HistogramStore& histogramStore, AnaDataCollection& anaDataCollection,
+                        const EventSubCategorySet& subCategories, const MemoryEstimateMap& memory_estimates)
+    {
+        const auto fill_groups = PlanFillGroups(subCategories, memory_estimates);
+        for(size_t k = 0; k < fill_groups.size(); ++k) {
+            if(fill_groups.size() > 1)
+                std::cout << "\tEvent loop " << k + 1 << "/" << fill_groups.size() << std::endl;
+            ProduceHistograms(histogramStore, subCategories, fill_groups.at(k));
+            std::cout << "\tHistogram store memory: " << ToMB(histogramStore.GetMemorySize()) << " MB."
+                      << std::endl;
+            // The filled histograms are moved into the collection before the next event loop, so that the store
+            // holds only the histograms of a single group of variables.
+            if(k + 1 < fill_groups.size())
+                anaDataCollection.LoadStoredHistograms(subCategories);
+        }
+    }
+
+    void ProcessSubCategories(AnaDataCollection& anaDataCollection, const EventSubCategorySet& subCategories,
+                              size_t chunk_index, const std::set<std::string>& signal_names,
+                              const PlotsProducer::SampleCollection& samplesToDraw, std::ostream& qcd_out)
+    {
+        std::cout << "\tProcessing combined samples and QCD... " << std::endl;
+        for(const auto& subCategory : subCategories) {
+
+            ProcessCombinedSamples(anaDataCollection, subCategory, ana_setup.cmb_samples);
+            for(const auto& sample : sample_descriptors) {
+                if(sample.second.sampleType == SampleType::QCD) {
+                    EstimateQCD(anaDataCollection, subCategory, sample.second, qcd_out);
+                    break;
+                }
+            }
+        }
+
+        if(args.shapes()) {
+            std::cout << "\t\tProducing inputs for limits..." << std::endl;
+            LimitsInputProducer limitsInputProducer(anaDataCollection, sample_descriptors,
+                                                    cmb_sample_descriptors);
+            for(const auto& limit_setup : ana_setup.limit_setup){
+                std::cout << "\t\tsetup_name: " << limit_setup.first <<  std::endl;
+                for(const auto& subCategory : subCategories)
+                    limitsInputProducer.Produce(args.output(), limit_setup.first, limit_setup.second, subCategory,
+                                                ana_setup.unc_sources, ana_setup.regions, mva_sel_aliases,
+                                                args.period());
+            }
+        }
+        if(args.draw()) {
+            std::cout << "\t\tCreating plots..." << std::endl;
+            PlotsProducer plotsProducer(anaDataCollection, samplesToDraw, FullPath(ana_setup.plot_cfg),
+                                        ana_setup.plot_page_opt);
+            std::string pdf_prefix = args.output();
+            if(chunk_index != 0)
+                pdf_prefix += "_part" + ToString(chunk_index + 1);
+            plotsProducer.PrintStackedPlots(pdf_prefix, EventRegion::SignalRegion(), ana_setup.categories,
+                                            subCategories, signal_names);
+        }
+        anaDataCollection.WriteStoredHistograms(subCategories);
+    }
+
+    void ProduceHistograms(HistogramStore& histogramStore, const EventSubCategorySet& subCategories,
+                           const std::set<std::string>& variables)
+    {
+        DataIdSlotTable slots(tupleReader.GetNumberOfDataIds());
+        for(size_t n = 0; n < slots.size(); ++n) {
+            const auto& dataId = tupleReader.GetDataIdByIndex(n);
+            if(IsSelected(dataId, subCategories)) {
+                slots.at(n).dataId = &dataId;
+                slots.at(n).scale = dataId.Get<UncertaintyScale>();
+            }
+        }
 
         std::vector<ROOT::RDF::RResultPtr<AnaDataFiller>> results;
         std::cout << "\t\tAdding: ";
-        for(const auto& hist_name : activeVariables) {
+        for(const auto& hist_name : variables) {
             std::cout << hist_name << " ";
             const std::string df_hist_name = hist_name == "mva_score" ? "all_mva_scores" : hist_name;
-            const std::vector<std::string> branches = {"dataIds", "all_weights", df_hist_name};
-            AnaDataFiller filter(tupleReader, anaDataCollection, ana_setup.categories, subCategories,
-                                 ana_setup.unc_sources, hist_name, limitVariables.count(hist_name));
-            auto df = get_df(hist_name);
+            const std::vector<std::string> branches = {"dataId_indices", "all_weights", df_hist_name};
+            AnaDataFiller filter(tupleReader, histogramStore, slots, hist_name, GetUncertaintyScales(hist_name));
+            auto df = tupleReader.GetDataFrame(hist_name);
             ROOT::RDF::RResultPtr<AnaDataFiller> result;
             if(filter.is_mva_score)
-                result = df.Fill<VecType<size_t>, VecType<double>, VecType<float>>(std::move(filter), branches);
+                result = df.Fill<VecType<unsigned>, VecType<double>, VecType<float>>(std::move(filter), branches);
             else if(bbtautau::AnaTupleReader::BoolBranches.count(df_hist_name))
-                result = df.Fill<VecType<size_t>, VecType<double>, bool>(std::move(filter), branches);
+                result = df.Fill<VecType<unsigned>, VecType<double>, bool>(std::move(filter), branches);
             else if(bbtautau::AnaTupleReader::IntBranches.count(df_hist_name))
-                result = df.Fill<VecType<size_t>, VecType<double>, int>(std::move(filter), branches);
-            else if(is_defined_column(df, hist_name))
-                result = df.Fill<VecType<size_t>, VecType<double>, double>(std::move(filter), branches);
+                result = df.Fill<VecType<unsigned>, VecType<double>, int>(std::move(filter), branches);
+            else if(tupleReader.IsDefinedColumn(hist_name))
+                result = df.Fill<VecType<unsigned>, VecType<double>, double>(std::move(filter), branches);
             else
-                result = df.Fill<VecType<size_t>, VecType<double>, float>(std::move(filter), branches);
+                result = df.Fill<VecType<unsigned>, VecType<double>, float>(std::move(filter), branches);
+            result.OnPartialResultSlot(AnaDataFiller::ReplicaFlushEntries,
+                                       [](unsigned int, AnaDataFiller& slot_filler) { slot_filler.FlushReplica(); });
             results.push_back(result);
         }
         std::cout << std::endl;
@@ -253,7 +493,7 @@ private:
         });
 
         for(auto& result : results)
-            result.GetValue();
+            result->FlushReplica();
         progressReporter.Report(n_total, true);
         // std::cout << "number of event loops: " << df.GetNRuns() << std::endl;
     }
@@ -356,6 +596,7 @@ private:
 private:
     AnalyzerArguments args;
     std::set<std::string> activeVariables, limitVariables;
+    std::map<UncertaintyScale, std::set<std::string>> uncScaleVariables;
     bbtautau::AnaTupleReader tupleReader;
     std::shared_ptr<TFile> outputFile;
     PropertyConfigReader histConfig;
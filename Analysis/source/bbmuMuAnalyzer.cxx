@@ -30,7 +30,8 @@ protected:
         return EventRegion::Unknown();
     }
 
-    virtual EventSubCategory DetermineEventSubCategory(EventInfo& event, const EventCategory& /*category*/,
+    virtual EventSubCategory DetermineEventSubCategory(EventInfo& event, EventFitResults& /*fit_results*/,
+                                                       const EventCategory& /*category*/,
                                                        std::map<SelectionCut, double>& /*mva_scores*/) override
     {
         const double mass_muMu = event.GetHiggsTTMomentum(false)->M();
@@ -2,22 +2,155 @@
 This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
 #include "hh-bbtautau/Analysis/include/AnaTuple.h"
+#include "hh-bbtautau/Analysis/include/AnaTupleManifest.h"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+#include <TROOT.h>
 
 namespace analysis {
 namespace bbtautau {
 
+namespace {
+ROOT::ECompressionAlgorithm ToRootCompression(AnaTupleCompression compression)
+{
+    static const std::map<AnaTupleCompression, ROOT::ECompressionAlgorithm> algorithms = {
+        { AnaTupleCompression::ZLIB, ROOT::kZLIB }, { AnaTupleCompression::LZMA, ROOT::kLZMA },
+        { AnaTupleCompression::LZ4, ROOT::kLZ4 }, { AnaTupleCompression::ZSTD, ROOT::kZSTD }
+    };
+    return algorithms.at(compression);
+}
+
+// Disables the implicit multi-threading of ROOT for the lifetime of the object and restores it afterwards, also if
+// an exception is thrown.
+class ImplicitMTSuspender {
+public:
+    ImplicitMTSuspender() : n_threads(ROOT::IsImplicitMTEnabled() ? ROOT::GetThreadPoolSize() : 0)
+    {
+        if(n_threads)
+            ROOT::DisableImplicitMT();
+    }
+    ImplicitMTSuspender(const ImplicitMTSuspender&) = delete;
+    ImplicitMTSuspender& operator=(const ImplicitMTSuspender&) = delete;
+    ~ImplicitMTSuspender()
+    {
+        if(n_threads)
+            ROOT::EnableImplicitMT(n_threads);
+    }
+
+private:
+    unsigned n_threads;
+};
+
+// Empty temporary directory, which is removed with its content on destruction unless it is committed.
+class TemporaryDirectory {
+public:
+    explicit TemporaryDirectory(const std::string& _path) : path(_path)
+    {
+        boost::filesystem::remove_all(path);
+        boost::filesystem::create_directories(path);
+    }
+    TemporaryDirectory(const TemporaryDirectory&) = delete;
+    TemporaryDirectory& operator=(const TemporaryDirectory&) = delete;
+    ~TemporaryDirectory()
+    {
+        if(committed) return;
+        boost::system::error_code error;
+        boost::filesystem::remove_all(path, error);
+    }
+
+    const std::string& GetPath() const { return path; }
+
+    // Moves the directory to its final location.
+    void Commit(const std::string& final_path)
+    {
+        boost::filesystem::rename(path, final_path);
+        committed = true;
+    }
+
+private:
+    std::string path;
+    bool committed{false};
+};
+
+// Wraps the expression of a column of a skimmed data frame, so that it is evaluated only for the events which pass
+// the skim and returns the default value otherwise.
+template<typename F, typename... Args>
+auto MakeSkimmedExpr(F expr, ROOT::TypeTraits::TypeList<Args...>)
+{
+    using Result = typename ROOT::TypeTraits::CallableTraits<F>::ret_type;
+    return [expr](bool pass, Args... args) -> Result { return pass ? expr(args...) : Result(); };
+}
+}
+
 AnaTupleWriter::AnaTupleWriter(const std::string& file_name, Channel channel, bool _runKinFit, bool _runSVfit,
-                               bool _allow_calc_svFit) :
-    file(root_ext::CreateRootFile(file_name, ROOT::kLZ4, 4)), tuple(ToString(channel), file.get(), false),
+                               bool _allow_calc_svFit, const Options& _options) :
+    options(_options),
+    file(root_ext::CreateRootFile(file_name, ToRootCompression(options.compression), options.compression_level)),
+    tuple(ToString(channel), options.backend == AnaTupleBackend::TTree ? file.get() : nullptr, false,
+          options.GetDisabledBranches()),
     aux_tuple(file.get(), false), runKinFit(_runKinFit), runSVfit(_runSVfit), allow_calc_svFit(_allow_calc_svFit)
 {
+    if(options.backend == AnaTupleBackend::TTree) {
+        // Negative value of auto flush defines the cluster size in bytes.
+        auto tree = dynamic_cast<TTree*>(file->Get(ToString(channel).c_str()));
+        if(options.cluster_size && tree)
+            tree->SetAutoFlush(-static_cast<Long64_t>(options.cluster_size));
+    } else {
+#ifdef ANA_TUPLE_HAS_RNTUPLE
+        // The event data are filled into the buffer of AnaTuple, which is not attached to the file, and then
+        // copied into the fields of the RNTuple model.
+        auto model = rntuple::RNTupleModel::Create();
+        ntuple_fields = std::make_unique<AnaNTupleFields>(*model, options.GetDisabledBranches());
+        rntuple::RNTupleWriteOptions write_options;
+        write_options.SetCompression(static_cast<int>(ToRootCompression(options.compression)) * 100
+                                     + options.compression_level);
+        if(options.cluster_size)
+            write_options.SetApproxZippedClusterSize(options.cluster_size);
+        ntuple_writer = rntuple::RNTupleWriter::Append(std::move(model), ToString(channel), *file, write_options);
+#else
+        throw exception("RNTuple output is not supported by ROOT %1%.") % ROOT_RELEASE;
+#endif
+    }
+    if(options.write_buffer_size) {
+        write_queue = std::make_unique<EventQueue>(options.write_buffer_size);
+        write_queue->SetAllDone(false);
+        write_thread = std::thread(&AnaTupleWriter::WriteThread, this);
+    }
+}
+
+std::set<std::string> AnaTupleWriter::Options::GetDisabledBranches() const
+{
+    std::set<std::string> disabled;
+    disabled.insert(index_data_ids ? "dataIds" : "dataId_codes");
+    disabled.insert(float_weights ? "all_weights" : "all_weights_f");
+    return disabled;
 }
 
 AnaTupleWriter::~AnaTupleWriter()
 {
-    for(const auto& id : known_data_ids.left) {
-        aux_tuple().dataIds.push_back(id.second);
-        aux_tuple().dataId_names.push_back(id.first.GetName());
+    try {
+        Close();
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+    }
+}
+
+void AnaTupleWriter::Close()
+{
+    if(closed) return;
+    closed = true;
+    if(write_queue) {
+        write_queue->SetAllDone(true);
+        write_thread.join();
+    }
+    if(write_failed)
+        std::rethrow_exception(write_error);
+
+    // Data ids are stored in the order of their codes, so that the code is the position in the aux dictionary.
+    for(const auto& id : data_ids_by_code) {
+        aux_tuple().dataIds.push_back(known_data_ids.left.at(id));
+        aux_tuple().dataId_names.push_back(id.GetName());
     }
     for(const auto& id : known_sample_ids.left) {
         aux_tuple().sampleIds.push_back(id.second);
@@ -30,18 +163,34 @@ AnaTupleWriter::~AnaTupleWriter()
     }
     aux_tuple.Fill();
     aux_tuple.Write();
-    tuple.Write();
+    if(options.backend == AnaTupleBackend::TTree)
+        tuple.Write();
+#ifdef ANA_TUPLE_HAS_RNTUPLE
+    // The writer commits the last cluster and the RNTuple anchor into the file on destruction.
+    ntuple_writer.reset();
+#endif
 }
 
-void AnaTupleWriter::AddEvent(EventInfo& event, const AnaTupleWriter::DataIdMap& dataIds, const bool pass_VBF_trigger)
+void AnaTupleWriter::AddEvent(EventInfo& event, const AnaTupleWriter::DataIdMap& dataIds, const bool pass_VBF_trigger,
+                              EventFitResults* fit_results)
 {
     static constexpr float def_val = std::numeric_limits<float>::lowest();
     static constexpr int def_val_int = std::numeric_limits<int>::lowest();
 
     if(!dataIds.size()) return;
-    tuple().is_central_es = false;
-    tuple().weight = def_val;
-    tuple().mva_score = def_val;
+    if(write_failed)
+        std::rethrow_exception(write_error);
+
+    // With the asynchronous writer the event is filled into a separate buffer, which is passed to the writer
+    // thread, while the buffer of the tuple is owned by the writer thread.
+    std::shared_ptr<AnaEvent> buffered_event;
+    if(write_queue)
+        buffered_event = std::make_shared<AnaEvent>();
+    AnaEvent& data = buffered_event ? *buffered_event : tuple();
+
+    data.is_central_es = false;
+    data.weight = def_val;
+    data.mva_score = def_val;
 
     boost::optional<std::string> sample_id;
     for(const auto& entry : dataIds) {
@@ -59,25 +208,33 @@ void AnaTupleWriter::AddEvent(EventInfo& event, const AnaTupleWriter::DataIdMap&
                         %  known_sample_ids.right.at(hash);
                 known_sample_ids.insert({*sample_id, hash});
             }
-            tuple().sample_id = known_sample_ids.left.at(*sample_id);
+            data.sample_id = known_sample_ids.left.at(*sample_id);
         }
         // if(*sample_id != data_id.Get<std::string>()) {
         //     throw exception("Single event has two distinct sample ids: %1% and %2%") % (*sample_id)
         //             % data_id.Get<std::string>();
         // }
 
-        if(!known_data_ids.left.count(data_id)) {
+        const PackedDataId packed_id(data_id);
+        auto id_iter = data_id_entries.find(packed_id);
+        if(id_iter == data_id_entries.end()) {
             const size_t hash = std::hash<std::string>{}(data_id.GetName());
             if(known_data_ids.right.count(hash))
                 throw exception("Duplicated hash for event id '%1%' and '%2%'.") % data_id
                     %  known_data_ids.right.at(hash);
+            const size_t code = data_ids_by_code.size();
+            if(options.index_data_ids && code > std::numeric_limits<UShort_t>::max())
+                throw exception("Number of data ids exceeds the capacity of the 16-bit index. Please, run without"
+                                " --output_index_data_ids to store data ids as hashes.");
             known_data_ids.insert({data_id, hash});
+            data_ids_by_code.push_back(data_id);
+            id_iter = data_id_entries.emplace(packed_id, std::make_pair(hash, code)).first;
         }
 
         if(unc_source == UncertaintySource::None) {
-            tuple().is_central_es = true;
-            tuple().weight = weight;
-            tuple().mva_score = static_cast<float>(mva_score);
+            data.is_central_es = true;
+            data.weight = weight;
+            data.mva_score = static_cast<float>(mva_score);
         }
 
         SelectionCut mva_cut;
@@ -85,32 +242,38 @@ void AnaTupleWriter::AddEvent(EventInfo& event, const AnaTupleWriter::DataIdMap&
             mva_ranges[mva_cut] = mva_ranges[mva_cut].Extend(mva_score);
         }
 
-        tuple().dataIds.push_back(known_data_ids.left.at(data_id));
-        tuple().all_weights.push_back(weight);
-        tuple().all_mva_scores.push_back(static_cast<float>(mva_score));
+        if(options.index_data_ids)
+            data.dataId_codes.push_back(static_cast<UShort_t>(id_iter->second.second));
+        else
+            data.dataIds.push_back(id_iter->second.first);
+        if(options.float_weights)
+            data.all_weights_f.push_back(static_cast<float>(weight));
+        else
+            data.all_weights.push_back(weight);
+        data.all_mva_scores.push_back(static_cast<float>(mva_score));
     }
 
-    tuple().has_b_pair = event.HasBjetPair();
-    tuple().has_VBF_pair = event.HasVBFjetPair();
-    tuple().pass_VBF_trigger = pass_VBF_trigger;
-    tuple().run = event->run;
-    tuple().lumi = event->lumi;
-    tuple().evt = event->evt;
+    data.has_b_pair = event.HasBjetPair();
+    data.has_VBF_pair = event.HasVBFjetPair();
+    data.pass_VBF_trigger = pass_VBF_trigger;
+    data.run = event->run;
+    data.lumi = event->lumi;
+    data.evt = event->evt;
 
     #define TAU_DATA(name, obj) \
-        tuple().name##_pt = static_cast<float>(obj.GetMomentum().pt()); \
-        tuple().name##_eta = static_cast<float>(obj.GetMomentum().eta()); \
-        tuple().name##_phi = static_cast<float>(obj.GetMomentum().phi()); \
-        tuple().name##_m = static_cast<float>(obj.GetMomentum().M()); \
-        tuple().name##_iso = obj->leg_type() != LegType::tau ? static_cast<float>(obj.GetIsolation()) : def_val; \
-        tuple().name##_DeepTauVSe = obj->leg_type() == LegType::tau \
-                                  ? obj->GetRawValue(TauIdDiscriminator::byDeepTau2017v2p1VSe) : def_val; \
-        tuple().name##_DeepTauVSmu = obj->leg_type() == LegType::tau \
-                                   ? obj->GetRawValue(TauIdDiscriminator::byDeepTau2017v2p1VSmu) : def_val; \
-        tuple().name##_DeepTauVSjet = obj->leg_type() == LegType::tau \
-                                    ? obj->GetRawValue(TauIdDiscriminator::byDeepTau2017v2p1VSjet) : def_val; \
-        tuple().name##_q = obj->charge(); \
-        tuple().name##_gen_match = static_cast<int>(obj->gen_match()); \
+        data.name##_pt = static_cast<float>(obj.GetMomentum().pt()); \
+        data.name##_eta = static_cast<float>(obj.GetMomentum().eta()); \
+        data.name##_phi = static_cast<float>(obj.GetMomentum().phi()); \
+        data.name##_m = static_cast<float>(obj.GetMomentum().M()); \
+        data.name##_iso = obj->leg_type() != LegType::tau ? static_cast<float>(obj.GetIsolation()) : def_val; \
+        data.name##_DeepTauVSe = obj->leg_type() == LegType::tau \
+                               ? obj->GetRawValue(TauIdDiscriminator::byDeepTau2017v2p1VSe) : def_val; \
+        data.name##_DeepTauVSmu = obj->leg_type() == LegType::tau \
+                                ? obj->GetRawValue(TauIdDiscriminator::byDeepTau2017v2p1VSmu) : def_val; \
+        data.name##_DeepTauVSjet = obj->leg_type() == LegType::tau \
+                                 ? obj->GetRawValue(TauIdDiscriminator::byDeepTau2017v2p1VSjet) : def_val; \
+        data.name##_q = obj->charge(); \
+        data.name##_gen_match = static_cast<int>(obj->gen_match()); \
         /**/
 
     const auto& t1 = event.GetLeg(1);
@@ -120,18 +283,18 @@ void AnaTupleWriter::AddEvent(EventInfo& event, const AnaTupleWriter::DataIdMap&
     #undef TAU_DATA
 
     #define JET_DATA(name, obj) \
-        tuple().name##_pt = obj ? static_cast<float>(obj->GetMomentum().pt()) : def_val; \
-        tuple().name##_eta = obj ? static_cast<float>(obj->GetMomentum().eta()) : def_val; \
-        tuple().name##_phi = obj ? static_cast<float>(obj->GetMomentum().phi()) : def_val; \
-        tuple().name##_m = obj ? static_cast<float>(obj->GetMomentum().M()) : def_val; \
-        tuple().name##_CSV = obj ? (*obj)->csv() : def_val; \
-        tuple().name##_DeepCSV = obj ? (*obj)->deepcsv() : def_val; \
-        tuple().name##_DeepFlavour = obj ? (*obj)->deepFlavour() : def_val; \
-        tuple().name##_DeepFlavour_CvsL = obj ? (*obj)->deepFlavour_CvsL() : def_val; \
-        tuple().name##_DeepFlavour_CvsB = obj ? (*obj)->deepFlavour_CvsB() : def_val; \
-        tuple().name##_HHbtag = obj ? (*obj)->hh_btag() : def_val; \
-        tuple().name##_valid = obj != nullptr; \
-        tuple().name##_hadronFlavour = obj ? (*obj)->hadronFlavour() : def_val_int; \
+        data.name##_pt = obj ? static_cast<float>(obj->GetMomentum().pt()) : def_val; \
+        data.name##_eta = obj ? static_cast<float>(obj->GetMomentum().eta()) : def_val; \
+        data.name##_phi = obj ? static_cast<float>(obj->GetMomentum().phi()) : def_val; \
+        data.name##_m = obj ? static_cast<float>(obj->GetMomentum().M()) : def_val; \
+        data.name##_CSV = obj ? (*obj)->csv() : def_val; \
+        data.name##_DeepCSV = obj ? (*obj)->deepcsv() : def_val; \
+        data.name##_DeepFlavour = obj ? (*obj)->deepFlavour() : def_val; \
+        data.name##_DeepFlavour_CvsL = obj ? (*obj)->deepFlavour_CvsL() : def_val; \
+        data.name##_DeepFlavour_CvsB = obj ? (*obj)->deepFlavour_CvsB() : def_val; \
+        data.name##_HHbtag = obj ? (*obj)->hh_btag() : def_val; \
+        data.name##_valid = obj != nullptr; \
+        data.name##_hadronFlavour = obj ? (*obj)->hadronFlavour() : def_val_int; \
         /**/
 
     const JetCandidate *b1 = nullptr, *b2 = nullptr, *vbf1 = nullptr, *vbf2 = nullptr;
@@ -150,54 +313,93 @@ void AnaTupleWriter::AddEvent(EventInfo& event, const AnaTupleWriter::DataIdMap&
 
     #undef JET_DATA
 
-    tuple().MET_pt = static_cast<float>(event.GetMET().GetMomentum().pt());
-    tuple().MET_phi = static_cast<float>(event.GetMET().GetMomentum().phi());
+    data.MET_pt = static_cast<float>(event.GetMET().GetMomentum().pt());
+    data.MET_phi = static_cast<float>(event.GetMET().GetMomentum().phi());
+
 
+    boost::optional<EventFitResults> own_fit_results;
+    if(!fit_results) {
+        own_fit_results.emplace(event, allow_calc_svFit, nullptr, UncertaintySource::None, UncertaintyScale::Central);
+        fit_results = &*own_fit_results;
+    }
 
     const sv_fit_ana::FitResults* SVfit = nullptr;
-    if(runSVfit && event.GetSVFitResults(allow_calc_svFit).has_valid_momentum)
-        SVfit = &event.GetSVFitResults(allow_calc_svFit);
-    tuple().SVfit_valid = SVfit != nullptr;
-    tuple().SVfit_pt = SVfit ? static_cast<float>(SVfit->momentum.pt()) : def_val;
-    tuple().SVfit_eta = SVfit ? static_cast<float>(SVfit->momentum.eta()) : def_val;
-    tuple().SVfit_phi = SVfit ? static_cast<float>(SVfit->momentum.phi()) : def_val;
-    tuple().SVfit_m = SVfit ? static_cast<float>(SVfit->momentum.mass()) : def_val;
-    tuple().SVfit_mt = SVfit ? static_cast<float>(SVfit->transverseMass) : def_val;
-    tuple().SVfit_pt_error = SVfit ? static_cast<float>(SVfit->momentum_error.pt()) : def_val;
-    tuple().SVfit_eta_error = SVfit ? static_cast<float>(SVfit->momentum_error.eta()) : def_val;
-    tuple().SVfit_phi_error = SVfit ? static_cast<float>(SVfit->momentum_error.phi()) : def_val;
-    tuple().SVfit_m_error = SVfit ? static_cast<float>(SVfit->momentum_error.mass()) : def_val;
-    tuple().SVfit_mt_error = SVfit ? static_cast<float>(SVfit->transverseMass_error) : def_val;
+    if(runSVfit && fit_results->GetSVFitResults().has_valid_momentum)
+        SVfit = &fit_results->GetSVFitResults();
+    data.SVfit_valid = SVfit != nullptr;
+    data.SVfit_pt = SVfit ? static_cast<float>(SVfit->momentum.pt()) : def_val;
+    data.SVfit_eta = SVfit ? static_cast<float>(SVfit->momentum.eta()) : def_val;
+    data.SVfit_phi = SVfit ? static_cast<float>(SVfit->momentum.phi()) : def_val;
+    data.SVfit_m = SVfit ? static_cast<float>(SVfit->momentum.mass()) : def_val;
+    data.SVfit_mt = SVfit ? static_cast<float>(SVfit->transverseMass) : def_val;
+    data.SVfit_pt_error = SVfit ? static_cast<float>(SVfit->momentum_error.pt()) : def_val;
+    data.SVfit_eta_error = SVfit ? static_cast<float>(SVfit->momentum_error.eta()) : def_val;
+    data.SVfit_phi_error = SVfit ? static_cast<float>(SVfit->momentum_error.phi()) : def_val;
+    data.SVfit_m_error = SVfit ? static_cast<float>(SVfit->momentum_error.mass()) : def_val;
+    data.SVfit_mt_error = SVfit ? static_cast<float>(SVfit->transverseMass_error) : def_val;
 
     const kin_fit::FitResults* kinFit = nullptr;
     if(runKinFit && event.HasBjetPair())
-        kinFit = &event.GetKinFitResults(allow_calc_svFit);
-    tuple().kinFit_convergence = kinFit ? kinFit->convergence : def_val_int;
-    tuple().kinFit_m = kinFit && kinFit->HasValidMass() ? static_cast<float>(kinFit->mass) : def_val;
-    tuple().kinFit_chi2 = kinFit && kinFit->HasValidMass() ? static_cast<float>(kinFit->chi2) : def_val;
-
-    tuple().MT2 = event.HasBjetPair() ? static_cast<float>(event.GetMT2()) : def_val;
-
-    tuple().npv = event->npv;
-    tuple().HT_total = static_cast<float>(event.GetHT(true, true));
-    tuple().HT_otherjets = static_cast<float>(event.GetHT(false, true));
-    tuple().lhe_HT = event->lhe_HT;
-    tuple().n_jets = event.GetAllJets().size();
-    tuple().n_jets_eta24 = event.GetCentralJets().size();
-    tuple().n_jets_eta24_eta5 = event.GetForwardJets().size();
-
-    tuple().n_selected_gen_jets =  event->genJets_p4.size();
+        kinFit = &fit_results->GetKinFitResults();
+    data.kinFit_convergence = kinFit ? kinFit->convergence : def_val_int;
+    data.kinFit_m = kinFit && kinFit->HasValidMass() ? static_cast<float>(kinFit->mass) : def_val;
+    data.kinFit_chi2 = kinFit && kinFit->HasValidMass() ? static_cast<float>(kinFit->chi2) : def_val;
+
+    data.MT2 = event.HasBjetPair() ? static_cast<float>(event.GetMT2()) : def_val;
+
+    data.npv = event->npv;
+    data.HT_total = static_cast<float>(event.GetHT(true, true));
+    data.HT_otherjets = static_cast<float>(event.GetHT(false, true));
+    data.lhe_HT = event->lhe_HT;
+    data.n_jets = event.GetAllJets().size();
+    data.n_jets_eta24 = event.GetCentralJets().size();
+    data.n_jets_eta24_eta5 = event.GetForwardJets().size();
+
+    data.n_selected_gen_jets =  event->genJets_p4.size();
     int n_bflavour=0;
     static constexpr double b_Flavour = 5;
     for(size_t i = 0; i < event->genJets_hadronFlavour.size(); ++i) {
         if(event->genJets_hadronFlavour.at(i) == b_Flavour) ++n_bflavour;
     }
-    tuple().n_selected_gen_bjets = n_bflavour;
-    tuple().genJets_nTotal = event->genJets_nTotal;
-    tuple().jets_nTotal_hadronFlavour_b = event->jets_nTotal_hadronFlavour_b;
-    tuple().jets_nTotal_hadronFlavour_c = event->jets_nTotal_hadronFlavour_c;
+    data.n_selected_gen_bjets = n_bflavour;
+    data.genJets_nTotal = event->genJets_nTotal;
+    data.jets_nTotal_hadronFlavour_b = event->jets_nTotal_hadronFlavour_b;
+    data.jets_nTotal_hadronFlavour_c = event->jets_nTotal_hadronFlavour_c;
+
+    if(buffered_event)
+        write_queue->Push(buffered_event);
+    else
+        FillTuple();
+}
 
-    tuple.Fill();
+void AnaTupleWriter::FillTuple()
+{
+    if(options.backend == AnaTupleBackend::TTree) {
+        tuple.Fill();
+        return;
+    }
+#ifdef ANA_TUPLE_HAS_RNTUPLE
+    ntuple_fields->Assign(tuple());
+    ntuple_writer->Fill();
+    tuple() = AnaEvent();
+#endif
+}
+
+void AnaTupleWriter::WriteThread()
+{
+    // After a failure the remaining events are discarded, so that the analyzer thread is never blocked by
+    // the full queue. The error is rethrown by the next call of AddEvent or by Close.
+    std::shared_ptr<AnaEvent> event;
+    while(write_queue->Pop(event)) {
+        if(write_failed) continue;
+        try {
+            tuple() = std::move(*event);
+            FillTuple();
+        } catch(...) {
+            write_error = std::current_exception();
+            write_failed = true;
+        }
+    }
 }
 
 const AnaTupleReader::NameSet AnaTupleReader::BoolBranches = {
@@ -211,58 +413,128 @@ const AnaTupleReader::NameSet AnaTupleReader::IntBranches = {
     "SVfit_valid", "kinFit_convergence"
 };
 
-AnaTupleReader::AnaTupleReader(const std::string& file_name, Channel channel, NameSet& active_var_names) :
-    file(root_ext::OpenRootFile(file_name)), tree(root_ext::ReadObject<TTree>(*file, ToString(channel))),
-    dataFrame(*tree), df(dataFrame)
+const std::string AnaTupleReader::CachedColumnPrefix = "cached_";
+
+AnaTupleReader::AnaTupleReader(const std::string& file_name, Channel channel, NameSet& active_var_names,
+                               const std::string& column_cache) :
+    file_names(AnaTupleManifest::GetInputFiles(file_name)), backend(DetectBackend(file_names, ToString(channel))),
+    n_entries(CountEntries(file_names, ToString(channel), backend)),
+    dataFrame(std::make_unique<ROOT::RDataFrame>(ToString(channel), file_names)), df(*dataFrame)
 {
     static const NameSet support_branches = {
-        "dataIds", "all_weights", "is_central_es", "sample_id", "all_mva_scores",
-        "weight", "evt", "run", "lumi", "tau1_p4", "tau2_p4", "b1_valid", "b1_p4", "b2_valid", "b2_p4", "MET_p4",
-        "Hbb_p4", "Htt_p4", "HttMET_p4", "VBF1_valid", "VBF1_p4", "VBF2_valid", "VBF2_p4", "SVfit_p4", "mass_top_pair",
+        "dataIds", "dataId_codes", "dataId_indices", "all_weights", "all_weights_f", "is_central_es", "sample_id",
+        "all_mva_scores", "weight", "evt", "run", "lumi", "tau1_p4", "tau2_p4", "b1_valid", "b1_p4", "b2_valid",
+        "b2_p4", "MET_p4", "Hbb_p4", "Htt_p4", "HttMET_p4", "VBF1_valid", "VBF1_p4", "VBF2_valid", "VBF2_p4",
+        "SVfit_p4", "mass_top_pair",
     };
 
-    DefineBranches(active_var_names, active_var_names.empty());
-    if(active_var_names.empty()) {
-        std::vector<std::vector<std::string>> names = {
-            df.GetColumnNames(),
-        };
-        for(auto& other_df : skimmed_df)
-            names.push_back(other_df.GetColumnNames());
-        for(const auto& name_set : names) {
-            for(const auto& name : name_set) {
-                if(!support_branches.count(name))
-                    active_var_names.insert(name);
-            }
+    const bool all_vars = active_var_names.empty();
+    if(!column_cache.empty())
+        SetupColumnCache(column_cache, ToString(channel), active_var_names, all_vars);
+
+    // Each shard has its own aux dictionary. Dictionaries are merged, while the compact data id codes, which are
+    // positions in the dictionary of their shard, can be decoded only for a single file.
+    for(size_t n = 0; n < file_names.size(); ++n) {
+        auto file = root_ext::OpenRootFile(file_names.at(n));
+        AnaAuxTuple aux_tuple(file.get(), true);
+        aux_tuple.GetEntry(0);
+        ExtractDataIds(aux_tuple());
+        ExtractMvaRanges(aux_tuple());
+        if(n == 0)
+            DefineDecodedBranches(aux_tuple());
+    }
+    DefineDataIdIndices();
+
+    DefineBranches(df, skimmed_df, active_var_names, all_vars,
+                   cached_columns.empty() ? ColumnMode::Compute : ColumnMode::Cached);
+    IndexColumns();
+    if(all_vars) {
+        for(const auto& column : column_index) {
+            const std::string& name = column.first;
+            if(!support_branches.count(name) && !boost::starts_with(name, CachedColumnPrefix)
+                    && name.find("." + CachedColumnPrefix) == std::string::npos)
+                active_var_names.insert(name);
         }
     }
+}
 
-    AnaAuxTuple aux_tuple(file.get(), true);
-    aux_tuple.GetEntry(0);
-    ExtractDataIds(aux_tuple());
-    ExtractMvaRanges(aux_tuple());
+void AnaTupleReader::IndexColumns()
+{
+    // The main data frame is indexed first, so that the columns available for all events are taken from it.
+    std::vector<RDF*> frames = { &df };
+    for(auto& skim_df : skimmed_df)
+        frames.push_back(&skim_df);
+    for(RDF* frame : frames) {
+        const auto defined_columns = frame->GetDefinedColumnNames();
+        const NameSet defined_set(defined_columns.begin(), defined_columns.end());
+        for(const auto& name : frame->GetColumnNames()) {
+            if(!column_index.count(name))
+                column_index[name] = ColumnInfo{frame, defined_set.count(name) > 0};
+        }
+    }
 }
 
-void AnaTupleReader::DefineBranches(const NameSet& active_var_names, bool all)
+void AnaTupleReader::DefineBranches(RDF& main_df, std::list<RDF>& skims, const NameSet& active_var_names, bool all,
+                                    ColumnMode mode, std::vector<MaterialisedSkim>* materialised) const
 {
-    // const auto Define = [&](RDF& target_df, const std::string& var, const std::string& expr) {
-    //     if(all || active_var_names.count(var))
-    //         target_df = target_df.Define(var, boost::str(boost::format("static_cast<double>(%1%)") % expr));
-    // };
-
-    const auto Define = [&](RDF& target_df, const std::string& var, auto expr,
-                              const std::vector<std::string>& columns, bool force = false) {
-        if(force || all || active_var_names.count(var))
-            target_df = target_df.Define(var, expr, columns);
+    // Increase DerivedColumnsVersion when the definitions below are changed, to invalidate the column caches.
+
+    // In the materialisation mode the skims are not applied, so that all data frames have one entry per event.
+    // Instead, the columns of a skimmed data frame are evaluated only for the events which pass the skim.
+    // Skims which do not define any of the requested variables are not added to the graph.
+    struct Skim {
+        std::string name;
+        RDF df;
+        std::string pass;
+        std::vector<std::string> materialised_columns;
+        bool used{false};
     };
 
-    const auto Filter = [](RDF& target_df, const std::string& var) -> RDF {
-        return target_df.Filter([](bool flag){ return flag; }, {var});
+    const bool materialise = mode == ColumnMode::Materialise;
+
+    const auto Define = [&](Skim& target, const std::string& var, auto expr,
+                            const std::vector<std::string>& columns, bool force = false) {
+        if(!(force || all || active_var_names.count(var))) return;
+        target.used = target.used || !force;
+        using Result = typename ROOT::TypeTraits::CallableTraits<decltype(expr)>::ret_type;
+        const auto Identity = [](const Result& x) { return x; };
+        if(mode == ColumnMode::Cached && !force) {
+            const auto skim_iter = cached_columns.find(target.name);
+            if(skim_iter != cached_columns.end() && skim_iter->second.count(var)) {
+                target.df = target.df.Define(var, Identity, { skim_iter->second.at(var) });
+                return;
+            }
+        }
+        if(target.pass.empty()) {
+            target.df = target.df.Define(var, expr, columns);
+        } else {
+            std::vector<std::string> skim_columns = { target.pass };
+            skim_columns.insert(skim_columns.end(), columns.begin(), columns.end());
+            using ArgTypes = typename ROOT::TypeTraits::CallableTraits<decltype(expr)>::arg_types;
+            target.df = target.df.Define(var, MakeSkimmedExpr(expr, ArgTypes()), skim_columns);
+        }
+        if(materialise && !force && std::is_arithmetic<Result>::value) {
+            const std::string cached_name = CachedColumnPrefix + var;
+            target.df = target.df.Define(cached_name, Identity, { var });
+            target.materialised_columns.push_back(cached_name);
+        }
     };
 
-    const auto FilterInt = [](RDF& target_df, const std::string& var) -> RDF {
-        return target_df.Filter([](int flag) -> bool { return flag; }, {var});
+    const auto Filter = [&](Skim& parent, const std::string& name, auto predicate,
+                            const std::string& var) -> Skim {
+        if(!materialise)
+            return Skim{name, parent.df.Filter(predicate, {var}), "", {}, false};
+        const std::string pass = "skim_pass_" + name;
+        if(parent.pass.empty())
+            return Skim{name, parent.df.Define(pass, predicate, {var}), pass, {}, false};
+        auto df_own = parent.df.Define(pass + "_own", predicate, {var});
+        return Skim{name, df_own.Define(pass, [](bool a, bool b) { return a && b; }, {parent.pass, pass + "_own"}),
+                    pass, {}, false};
     };
 
+    const auto PassFlag = [](bool flag) { return flag; };
+    const auto PassIntFlag = [](int flag) -> bool { return flag; };
+
     const auto Sum = [](float a, float b) -> double { return a + b; };
     const auto Delta = [](float a, float b) -> double { return a - b; };
 
@@ -297,8 +569,8 @@ void AnaTupleReader::DefineBranches(const NameSet& active_var_names, bool all)
         return ROOT::Math::VectorUtil::DeltaR(p4_1, p4_2);
     };
 
-    const auto DefineP4 = [&](RDF& target_df, const std::string& prefix) {
-        Define(target_df, prefix + "_p4", ReturnP4,
+    const auto DefineP4 = [&](Skim& target, const std::string& prefix) {
+        Define(target, prefix + "_p4", ReturnP4,
                { prefix + "_pt", prefix + "_eta", prefix + "_phi", prefix + "_m" }, true);
     };
 
@@ -306,48 +578,51 @@ void AnaTupleReader::DefineBranches(const NameSet& active_var_names, bool all)
         return Calculate_MT(p4, MET_p4);
     };
 
-    DefineP4(df, "tau1");
-    DefineP4(df, "tau2");
-    Define(df, "Htt_p4", SumP4, { "tau1_p4", "tau2_p4" }, true);
-    Define(df, "MET_p4", ReturnMETP4, {"MET_pt", "MET_phi"}, true);
-    Define(df, "HttMET_p4", SumP4, { "Htt_p4", "MET_p4" }, true);
+    Skim df_main{"", main_df, "", {}, false};
+    DefineP4(df_main, "tau1");
+    DefineP4(df_main, "tau2");
+    Define(df_main, "Htt_p4", SumP4, { "tau1_p4", "tau2_p4" }, true);
+    Define(df_main, "MET_p4", ReturnMETP4, {"MET_pt", "MET_phi"}, true);
+    Define(df_main, "HttMET_p4", SumP4, { "Htt_p4", "MET_p4" }, true);
 
-    auto df_bb = Filter(df, "has_b_pair");
+    auto df_bb = Filter(df_main, "bb", PassFlag, "has_b_pair");
     DefineP4(df_bb, "b1");
     DefineP4(df_bb, "b2");
     Define(df_bb, "Hbb_p4", SumP4, { "b1_p4", "b2_p4" }, true);
 
-    auto df_vbf = Filter(df_bb, "has_VBF_pair");
+    auto df_vbf = Filter(df_bb, "vbf", PassFlag, "has_VBF_pair");
     DefineP4(df_vbf, "VBF1");
     DefineP4(df_vbf, "VBF2");
 
-    auto df_sv = FilterInt(df, "SVfit_valid");
+    auto df_sv = Filter(df_main, "sv", PassIntFlag, "SVfit_valid");
     DefineP4(df_sv, "SVfit");
 
-    auto df_bb_sv = FilterInt(df_bb, "SVfit_valid");
+    auto df_bb_sv = Filter(df_bb, "bb_sv", PassIntFlag, "SVfit_valid");
     DefineP4(df_bb_sv, "SVfit");
 
-    Define(df, "m_tt_vis", GetMass, {"Htt_p4"});
-    Define(df, "pt_H_tt", GetPt, {"Htt_p4"});
-    Define(df, "eta_H_tt", GetEta, {"Htt_p4"});
-    Define(df, "phi_H_tt", GetPhi, {"Htt_p4"});
-    Define(df, "mt_1", _Calculate_MT, {"tau1_p4", "MET_p4"});
-    Define(df, "mt_2", _Calculate_MT, {"tau2_p4", "MET_p4"});
+    Define(df_main, "m_tt_vis", GetMass, {"Htt_p4"});
+    Define(df_main, "pt_H_tt", GetPt, {"Htt_p4"});
+    Define(df_main, "eta_H_tt", GetEta, {"Htt_p4"});
+    Define(df_main, "phi_H_tt", GetPhi, {"Htt_p4"});
+    Define(df_main, "mt_1", _Calculate_MT, {"tau1_p4", "MET_p4"});
+    Define(df_main, "mt_2", _Calculate_MT, {"tau2_p4", "MET_p4"});
     Define(df_sv, "MT_htautau", _Calculate_MT, {"SVfit_p4", "MET_p4"});
 
-    Define(df, "dR_l1l2", DeltaR, {"tau1_p4", "tau2_p4"});
-    Define(df, "abs_dphi_l1MET", AbsDeltaPhi, {"tau1_p4", "MET_p4"});
+    Define(df_main, "dR_l1l2", DeltaR, {"tau1_p4", "tau2_p4"});
+    Define(df_main, "abs_dphi_l1MET", AbsDeltaPhi, {"tau1_p4", "MET_p4"});
     Define(df_sv, "dphi_htautauMET", DeltaPhi, {"SVfit_p4", "MET_p4"});
-    Define(df, "dR_l1l2MET", DeltaR, {"Htt_p4", "MET_p4"});
+    Define(df_main, "dR_l1l2MET", DeltaR, {"Htt_p4", "MET_p4"});
     Define(df_sv, "dR_l1l2Pt_htautau", [](const LorentzVectorM& p4_1, const LorentzVectorM& p4_2, float pt)
         { return ROOT::Math::VectorUtil::DeltaR(p4_1, p4_2) * pt; }, {"tau1_p4", "tau2_p4", "SVfit_pt"});
-    Define(df, "mass_l1l2MET", GetMass, {"HttMET_p4"});
-    Define(df, "pt_l1l2MET", GetPt, {"HttMET_p4"});
-    Define(df, "p_zeta", [](const LorentzVectorM& tau1_p4, const LorentzVectorM& tau2_p4, const LorentzVectorM& MET_p4)
+    Define(df_main, "mass_l1l2MET", GetMass, {"HttMET_p4"});
+    Define(df_main, "pt_l1l2MET", GetPt, {"HttMET_p4"});
+    Define(df_main, "p_zeta", [](const LorentzVectorM& tau1_p4, const LorentzVectorM& tau2_p4,
+                                 const LorentzVectorM& MET_p4)
         { return Calculate_Pzeta(tau1_p4, tau2_p4, MET_p4); }, {"tau1_p4", "tau2_p4", "MET_p4"});
-    Define(df, "p_zetavisible", [](const LorentzVectorM& tau1_p4, const LorentzVectorM& tau2_p4)
+    Define(df_main, "p_zetavisible", [](const LorentzVectorM& tau1_p4, const LorentzVectorM& tau2_p4)
         { return Calculate_visiblePzeta(tau1_p4, tau2_p4); }, {"tau1_p4", "tau2_p4"});
-    Define(df, "mt_tot", [](const LorentzVectorM& tau1_p4, const LorentzVectorM& tau2_p4, const LorentzVectorM& MET_p4)
+    Define(df_main, "mt_tot", [](const LorentzVectorM& tau1_p4, const LorentzVectorM& tau2_p4,
+                                 const LorentzVectorM& MET_p4)
         { return Calculate_TotalMT(tau1_p4, tau2_p4, MET_p4); }, {"tau1_p4", "tau2_p4", "MET_p4"});
 
     Define(df_bb, "m_bb", GetMass, {"Hbb_p4"});
@@ -378,10 +653,17 @@ void AnaTupleReader::DefineBranches(const NameSet& active_var_names, bool all)
     Define(df_bb, "hh_btag_b1_minus_b2", Delta, {"b1_HHbtag", "b2_HHbtag"});
     Define(df_vbf, "hh_btag_VBF1VBF2", Sum, {"VBF1_HHbtag", "VBF2_HHbtag"});
 
-    skimmed_df.push_back(df_bb);
-    skimmed_df.push_back(df_vbf);
-    skimmed_df.push_back(df_sv);
-    skimmed_df.push_back(df_bb_sv);
+    main_df = df_main.df;
+    for(const Skim* skim : { &df_bb, &df_vbf, &df_sv, &df_bb_sv }) {
+        if(skim->used)
+            skims.push_back(skim->df);
+    }
+    if(materialised) {
+        for(const Skim* skim : { &df_main, &df_bb, &df_vbf, &df_sv, &df_bb_sv }) {
+            if(skim->materialised_columns.empty()) continue;
+            materialised->push_back(MaterialisedSkim{skim->name, skim->df, skim->materialised_columns});
+        }
+    }
 }
 
 const AnaTupleReader::DataId& AnaTupleReader::GetDataIdByHash(Hash hash) const
@@ -392,8 +674,31 @@ const AnaTupleReader::DataId& AnaTupleReader::GetDataIdByHash(Hash hash) const
     return iter->second;
 }
 
-size_t AnaTupleReader::GetNumberOfEntries() const { return static_cast<size_t>(tree->GetEntries()); }
+size_t AnaTupleReader::GetNumberOfDataIds() const { return data_id_hashes.size(); }
+
+const AnaTupleReader::DataId& AnaTupleReader::GetDataIdByIndex(size_t index) const
+{
+    if(index >= data_id_hashes.size())
+        throw exception("EventAnalyzerDataId not found for index = %1%") % index;
+    return GetDataIdByHash(data_id_hashes.at(index));
+}
+
+size_t AnaTupleReader::GetNumberOfEntries() const { return n_entries; }
 const AnaTupleReader::RDF& AnaTupleReader::GetDataFrame() const { return df; }
+
+const AnaTupleReader::RDF& AnaTupleReader::GetDataFrame(const std::string& column) const
+{
+    const auto iter = column_index.find(column);
+    if(iter == column_index.end())
+        throw exception("AnaTupleReader: column '%1%' not found.") % column;
+    return *iter->second.df;
+}
+
+bool AnaTupleReader::IsDefinedColumn(const std::string& column) const
+{
+    const auto iter = column_index.find(column);
+    return iter != column_index.end() && iter->second.is_defined;
+}
 const std::list<AnaTupleReader::RDF>& AnaTupleReader::GetSkimmedDataFrames() const { return skimmed_df; }
 
 void AnaTupleReader::ExtractDataIds(const AnaAux& aux)
@@ -405,16 +710,146 @@ void AnaTupleReader::ExtractDataIds(const AnaAux& aux)
         const auto hash = aux.dataIds.at(n);
         const auto& dataId_name = aux.dataId_names.at(n);
         const auto dataId = DataId::Parse(dataId_name);
-        if(known_data_ids.right.count(hash))
+        const auto known_iter = known_data_ids.right.find(hash);
+        if(known_iter != known_data_ids.right.end() && known_iter->second == dataId) continue;
+        if(known_iter != known_data_ids.right.end())
             throw exception("Duplicated hash = %1% in AnaAux tuple for dataId = %2%.\n"
                             "This hash is already assigned to %3%") % hash % dataId_name
                             % known_data_ids.right.at(hash);
         if(known_data_ids.left.count(dataId))
             throw exception("Duplicated dataId = '%1%' in AnaAux tuple.") % dataId_name;
         known_data_ids.insert({dataId, hash});
+        data_id_hashes.push_back(hash);
     }
 }
 
+void AnaTupleReader::DefineDecodedBranches(const AnaAux& aux)
+{
+    // Compact columns are decoded into the columns of the original format, so that the consumers do not depend on
+    // the encoding used by the writer.
+    const auto columns = df.GetColumnNames();
+    const auto has_column = [&](const std::string& name) {
+        return std::find(columns.begin(), columns.end(), name) != columns.end();
+    };
+    if(!has_column("dataIds") && has_column("dataId_codes")) {
+        if(file_names.size() > 1)
+            throw exception("Data ids stored as 16-bit codes can not be read from several AnaTuple files.");
+        const std::vector<size_t> hashes(aux.dataIds.begin(), aux.dataIds.end());
+        df = df.Define("dataIds", [hashes](const ROOT::VecOps::RVec<UShort_t>& codes) {
+            ROOT::VecOps::RVec<size_t> result(codes.size());
+            for(size_t n = 0; n < codes.size(); ++n)
+                result[n] = hashes.at(codes[n]);
+            return result;
+        }, {"dataId_codes"});
+    }
+    if(!has_column("all_weights") && has_column("all_weights_f")) {
+        df = df.Define("all_weights", [](const ROOT::VecOps::RVec<float>& weights) {
+            return ROOT::VecOps::RVec<double>(weights.begin(), weights.end());
+        }, {"all_weights_f"});
+    }
+}
+
+void AnaTupleReader::DefineDataIdIndices()
+{
+    // Hashes are resolved into dense indices once per event, so that the consumers can use flat tables indexed
+    // by the data id instead of the lookups by hash.
+    std::unordered_map<Hash, unsigned> indices;
+    for(size_t n = 0; n < data_id_hashes.size(); ++n)
+        indices[data_id_hashes.at(n)] = static_cast<unsigned>(n);
+    df = df.Define("dataId_indices", [indices](const ROOT::VecOps::RVec<size_t>& hashes) {
+        ROOT::VecOps::RVec<unsigned> result(hashes.size());
+        for(size_t n = 0; n < hashes.size(); ++n)
+            result[n] = indices.at(hashes[n]);
+        return result;
+    }, {"dataIds"});
+}
+
+void AnaTupleReader::SetupColumnCache(const std::string& cache_dir, const std::string& tree_name,
+                                      const NameSet& active_var_names, bool all)
+{
+    if(backend != AnaTupleBackend::TTree) {
+        std::cout << "Warning: derived columns are not cached for the RNTuple input." << std::endl;
+        return;
+    }
+    // The cache is identified by the input files, by the version of the column definitions and by the set of
+    // the requested variables.
+    std::ostringstream ss;
+    ss << DerivedColumnsVersion << '\n' << tree_name << '\n';
+    for(const auto& file_name : file_names)
+        ss << file_name << ' ' << AnaTupleManifest::GetFileFingerprint(file_name) << '\n';
+    if(all)
+        ss << '*';
+    for(const auto& var : active_var_names)
+        ss << var << ' ';
+    const auto cache_path = boost::filesystem::path(cache_dir)
+            / (tree_name + "_" + AnaTupleManifest::GetContentHash(ss.str()));
+    if(!boost::filesystem::exists(cache_path)) {
+        std::cout << "Materialising derived columns into '" << cache_path.string() << "'..." << std::endl;
+        MaterialiseColumns(cache_path.string(), tree_name, active_var_names, all);
+    }
+    AttachColumnCache(cache_path.string(), tree_name);
+}
+
+void AnaTupleReader::MaterialiseColumns(const std::string& cache_path, const std::string& tree_name,
+                                        const NameSet& active_var_names, bool all) const
+{
+    // The entries of the cache should be in the same order as the entries of the tuple, which is not guaranteed
+    // by the multi-threaded snapshot.
+    const ImplicitMTSuspender implicit_mt_suspender;
+    TemporaryDirectory tmp_dir(cache_path + ".tmp");
+    {
+        ROOT::RDataFrame materialise_df(tree_name, file_names);
+        RDF main_df = materialise_df;
+        std::list<RDF> skims;
+        std::vector<MaterialisedSkim> materialised;
+        DefineBranches(main_df, skims, active_var_names, all, ColumnMode::Materialise, &materialised);
+
+        // All snapshots are lazy, so that they are produced by a single event loop.
+        ROOT::RDF::RSnapshotOptions options;
+        options.fLazy = true;
+        std::vector<ROOT::RDF::RResultPtr<ROOT::RDF::RInterface<ROOT::Detail::RDF::RLoopManager>>> snapshots;
+        for(auto& skim : materialised) {
+            const std::string name = GetCacheTreeName(skim.skim_name);
+            const auto file_name = (boost::filesystem::path(tmp_dir.GetPath()) / (name + ".root")).string();
+            snapshots.push_back(skim.df.Snapshot(name, file_name, skim.columns, options));
+        }
+        for(auto& snapshot : snapshots)
+            snapshot.GetValue();
+    }
+    tmp_dir.Commit(cache_path);
+}
+
+void AnaTupleReader::AttachColumnCache(const std::string& cache_path, const std::string& tree_name)
+{
+    chain = std::make_unique<TChain>(tree_name.c_str());
+    for(const auto& file_name : file_names)
+        chain->Add(file_name.c_str());
+    for(const auto& entry : boost::filesystem::directory_iterator(cache_path)) {
+        if(entry.path().extension() != ".root") continue;
+        const std::string name = entry.path().stem().string();
+        auto cache_chain = std::make_unique<TChain>(name.c_str());
+        cache_chain->Add(entry.path().string().c_str());
+        if(static_cast<size_t>(cache_chain->GetEntries()) != n_entries)
+            throw exception("Inconsistent number of entries in the column cache '%1%'.") % entry.path().string();
+        cache_chain->LoadTree(0);
+        const std::string main_name = GetCacheTreeName("");
+        const std::string skim_name = name == main_name ? "" : name.substr(main_name.size() + 1);
+        for(const auto branch : *cache_chain->GetListOfBranches()) {
+            const std::string column = branch->GetName();
+            cached_columns[skim_name][column.substr(CachedColumnPrefix.size())] = name + "." + column;
+        }
+        chain->AddFriend(cache_chain.get());
+        cache_chains.push_back(std::move(cache_chain));
+    }
+    dataFrame = std::make_unique<ROOT::RDataFrame>(*chain);
+    df = *dataFrame;
+}
+
+std::string AnaTupleReader::GetCacheTreeName(const std::string& skim_name)
+{
+    return skim_name.empty() ? "derived" : "derived_" + skim_name;
+}
+
 void AnaTupleReader::ExtractMvaRanges(const AnaAux& aux)
 {
     const size_t N = aux.mva_selections.size();
@@ -422,10 +857,53 @@ void AnaTupleReader::ExtractMvaRanges(const AnaAux& aux)
         throw exception("Inconsistent mva range info in AnaAux tuple.");
     for(size_t n = 0; n < N; ++n) {
         const SelectionCut sel = static_cast<SelectionCut>(aux.mva_selections.at(n));
-        if(mva_ranges.count(sel))
-            throw exception("Duplicated mva selection = %1% in AnaAux tuple.") % sel;
-        mva_ranges[sel] = Range(aux.mva_min.at(n), aux.mva_max.at(n));
+        const Range range(aux.mva_min.at(n), aux.mva_max.at(n));
+        auto iter = mva_ranges.find(sel);
+        if(iter == mva_ranges.end())
+            mva_ranges[sel] = range;
+        else
+            iter->second = iter->second.Extend(range.min()).Extend(range.max());
+    }
+}
+
+AnaTupleBackend AnaTupleReader::DetectBackend(const std::vector<std::string>& file_names, const std::string& name)
+{
+    boost::optional<AnaTupleBackend> backend;
+    for(const auto& file_name : file_names) {
+        auto file = root_ext::OpenRootFile(file_name);
+        TKey* key = file->GetKey(name.c_str());
+        if(!key)
+            throw exception("AnaTuple '%1%' not found in '%2%'.") % name % file_name;
+        const std::string class_name = key->GetClassName();
+        const auto file_backend = class_name.find("RNTuple") != std::string::npos ? AnaTupleBackend::RNTuple
+                                                                                  : AnaTupleBackend::TTree;
+        if(backend && *backend != file_backend)
+            throw exception("AnaTuple files have inconsistent backends: %1% and %2%.") % *backend % file_backend;
+        backend = file_backend;
+    }
+    if(!backend)
+        throw exception("No AnaTuple files to read.");
+    return *backend;
+}
+
+size_t AnaTupleReader::CountEntries(const std::vector<std::string>& file_names, const std::string& name,
+                                    AnaTupleBackend backend)
+{
+    size_t n_entries = 0;
+    for(const auto& file_name : file_names) {
+        if(backend == AnaTupleBackend::TTree) {
+            auto file = root_ext::OpenRootFile(file_name);
+            std::unique_ptr<TTree> tree(root_ext::ReadObject<TTree>(*file, name));
+            n_entries += static_cast<size_t>(tree->GetEntries());
+            continue;
+        }
+#ifdef ANA_TUPLE_HAS_RNTUPLE
+        n_entries += static_cast<size_t>(rntuple::RNTupleReader::Open(name, file_name)->GetNEntries());
+#else
+        throw exception("RNTuple input '%1%' is not supported by ROOT %2%.") % file_name % ROOT_RELEASE;
+#endif
     }
+    return n_entries;
 }
 
 float AnaTupleReader::GetNormalizedMvaScore(const DataId& dataId, float raw_score) const
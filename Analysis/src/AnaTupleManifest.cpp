@@ -0,0 +1,147 @@
+/*! Definition of AnaTupleManifest class, the description of the sharded AnaTuple output.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/AnaTupleManifest.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iomanip>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+namespace bbtautau {
+
+bool AnaTupleManifest::Shard::operator==(const Shard& other) const
+{
+    return file_name == other.file_name && config_hash == other.config_hash && inputs == other.inputs;
+}
+
+const std::string& AnaTupleManifest::FileName()
+{
+    static const std::string name = "manifest.json";
+    return name;
+}
+
+bool AnaTupleManifest::IsShardedOutput(const std::string& path)
+{
+    return boost::filesystem::is_directory(path)
+        && boost::filesystem::exists(boost::filesystem::path(path) / FileName());
+}
+
+std::vector<std::string> AnaTupleManifest::GetInputFiles(const std::string& path)
+{
+    if(!IsShardedOutput(path))
+        return { path };
+    const AnaTupleManifest manifest(path);
+    if(manifest.shards.empty())
+        throw exception("Sharded AnaTuple output '%1%' has no shards.") % path;
+    std::vector<std::string> files;
+    for(const auto& shard : manifest.shards)
+        files.push_back((boost::filesystem::path(path) / shard.second.file_name).string());
+    return files;
+}
+
+std::string AnaTupleManifest::GetShardFileName(const std::string& sample_name)
+{
+    std::string name = sample_name;
+    std::replace_if(name.begin(), name.end(), [](char c) { return c == '/' || std::isspace(static_cast<unsigned char>(c)); }, '_');
+    return name + ".root";
+}
+
+std::string AnaTupleManifest::GetFileFingerprint(const std::string& file_path)
+{
+    if(!boost::filesystem::exists(file_path))
+        throw exception("Input file '%1%' not found.") % file_path;
+    std::ostringstream ss;
+    ss << boost::filesystem::file_size(file_path) << ":" << boost::filesystem::last_write_time(file_path);
+    return ss.str();
+}
+
+std::string AnaTupleManifest::GetContentHash(const std::string& content)
+{
+    std::ostringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << std::hash<std::string>{}(content);
+    return ss.str();
+}
+
+AnaTupleManifest::AnaTupleManifest(const std::string& _directory) :
+    directory(_directory)
+{
+    namespace pt = boost::property_tree;
+    const auto file_name = (boost::filesystem::path(directory) / FileName()).string();
+    if(!boost::filesystem::exists(file_name)) return;
+    pt::ptree manifest;
+    pt::read_json(file_name, manifest);
+    for(const auto& shard_entry : manifest.get_child("shards")) {
+        const auto& shard_tree = shard_entry.second;
+        Shard shard;
+        shard.file_name = shard_tree.get<std::string>("file");
+        shard.config_hash = shard_tree.get<std::string>("config_hash");
+        for(const auto& input : shard_tree.get_child("inputs"))
+            shard.inputs[input.second.get<std::string>("path")] = input.second.get<std::string>("fingerprint");
+        shards[shard_tree.get<std::string>("sample")] = shard;
+    }
+}
+
+std::string AnaTupleManifest::GetShardPath(const std::string& sample_name) const
+{
+    return (boost::filesystem::path(directory) / GetShardFileName(sample_name)).string();
+}
+
+bool AnaTupleManifest::IsValid(const std::string& sample_name, const Shard& shard) const
+{
+    const auto iter = shards.find(sample_name);
+    return iter != shards.end() && iter->second == shard
+        && boost::filesystem::exists(boost::filesystem::path(directory) / shard.file_name);
+}
+
+void AnaTupleManifest::SetShard(const std::string& sample_name, const Shard& shard)
+{
+    shards[sample_name] = shard;
+}
+
+void AnaTupleManifest::KeepShards(const std::set<std::string>& sample_names)
+{
+    for(auto iter = shards.begin(); iter != shards.end();) {
+        if(sample_names.count(iter->first))
+            ++iter;
+        else
+            iter = shards.erase(iter);
+    }
+}
+
+void AnaTupleManifest::Save() const
+{
+    // Keys of the property tree are paths separated by '.', therefore the names of the samples and of the input
+    // files, which may contain dots, are stored as values.
+    namespace pt = boost::property_tree;
+    pt::ptree shard_list;
+    for(const auto& [sample_name, shard] : shards) {
+        pt::ptree shard_tree, input_list;
+        shard_tree.put("sample", sample_name);
+        shard_tree.put("file", shard.file_name);
+        shard_tree.put("config_hash", shard.config_hash);
+        for(const auto& [path, fingerprint] : shard.inputs) {
+            pt::ptree input;
+            input.put("path", path);
+            input.put("fingerprint", fingerprint);
+            input_list.push_back(std::make_pair("", input));
+        }
+        shard_tree.add_child("inputs", input_list);
+        shard_list.push_back(std::make_pair("", shard_tree));
+    }
+    pt::ptree manifest;
+    manifest.add_child("shards", shard_list);
+
+    const auto file_name = (boost::filesystem::path(directory) / FileName()).string();
+    const std::string tmp_file_name = file_name + ".tmp";
+    pt::write_json(tmp_file_name, manifest);
+    boost::filesystem::rename(tmp_file_name, file_name);
+}
+
+} // namespace bbtautau
+} // namespace analysis
@@ -0,0 +1,38 @@
+/*! Definition of AsyncFitter class, the pool of worker threads which compute SVfit and KinFit results.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/AsyncFitter.h"
+
+namespace analysis {
+
+AsyncFitter::AsyncFitter(size_t n_threads, size_t max_queue_size) :
+    queue(max_queue_size)
+{
+    queue.SetAllDone(false);
+    for(size_t n = 0; n < std::max<size_t>(n_threads, 1); ++n)
+        workers.emplace_back(&AsyncFitter::WorkerThread, this);
+}
+
+AsyncFitter::~AsyncFitter()
+{
+    queue.SetAllDone(true);
+    for(auto& worker : workers)
+        worker.join();
+}
+
+std::future<AsyncFitter::Record> AsyncFitter::Submit(std::function<Record()> fit)
+{
+    auto task = std::make_shared<Task>(std::move(fit));
+    auto future = task->get_future();
+    queue.Push(task);
+    return future;
+}
+
+void AsyncFitter::WorkerThread()
+{
+    std::shared_ptr<Task> task;
+    while(queue.Pop(task))
+        (*task)();
+}
+
+} // namespace analysis
@@ -6,30 +6,54 @@ This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 #include "h-tautau/Core/include/AnalysisTypes.h"
 #include "AnalysisTools/Run/include/MultiThread.h"
 #include "h-tautau/McCorrections/include/JetPuIdWeights.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <boost/filesystem.hpp>
 
 namespace analysis {
 
-SyncDescriptor::SyncDescriptor(const std::string& desc_str, std::shared_ptr<TFile> outputFile_sync)
+SyncDescriptor::SyncDescriptor(const std::string& desc_str, std::shared_ptr<TFile> outputFile_sync,
+                               const DataIdUniverse& universe)
 {
     auto tree_regexes = SplitValueList(desc_str, false, ":");
     if(tree_regexes.size() != 2)
         throw exception("The Number of parameters is %1%, only 2 are allowed") %  tree_regexes.size();
     sync_tree = std::make_shared<htt_sync::SyncTuple>(tree_regexes.at(0),outputFile_sync.get(),false);
-    regex_pattern = std::make_shared<boost::regex>(tree_regexes.at(1));
+    matcher = std::make_shared<SyncDataIdMatcher>(tree_regexes.at(1), universe);
+}
+
+BaseEventAnalyzer::EventTools::EventTools(SignalMode mode, Period period, BTaggerKind jet_ordering) :
+    signalObjectSelector(mode), bTagger(std::make_unique<BTagger>(period, jet_ordering)),
+    eventWeights_HH(std::make_unique<mc_corrections::EventWeights_HH>(period, *bTagger))
+{
 }
 
 BaseEventAnalyzer::BaseEventAnalyzer(const AnalyzerArguments& _args, Channel channel) :
-    EventAnalyzerCore(_args, channel), args(_args), anaTupleWriter(args.output(), channel, ana_setup.use_kinFit,
-                      ana_setup.use_svFit,ana_setup.allow_calc_svFit), trigger_patterns(ana_setup.trigger.at(channel))
+    EventAnalyzerCore(_args, channel), args(_args),
+    trigger_patterns(ana_setup.trigger.at(channel)),
+    eventTools([this]() {
+        return std::make_unique<EventTools>(ana_setup.mode, ana_setup.period, ana_setup.jet_ordering);
+    }),
+    profiler(!args.profile().empty())
 
 {
+    if(args.output_shards()) {
+        boost::filesystem::create_directories(args.output());
+        anaTupleManifest = std::make_unique<bbtautau::AnaTupleManifest>(args.output());
+    } else {
+        anaTupleWriter = std::make_unique<bbtautau::AnaTupleWriter>(args.output(), channel, ana_setup.use_kinFit,
+                ana_setup.use_svFit, ana_setup.allow_calc_svFit, CreateAnaTupleOptions(args));
+    }
     EventCandidate::InitializeUncertainties(ana_setup.period, false, args.working_path(),
                                             signalObjectSelector.GetTauVSjetDiscriminator().first);
     InitializeMvaReader();
     if(ana_setup.syncDataIds.size()){
         outputFile_sync = root_ext::CreateRootFile(args.output_sync());
+        const auto universe = CreateDataIdUniverse();
         for(unsigned n = 0; n < ana_setup.syncDataIds.size(); ++n){
-            sync_descriptors.emplace_back(ana_setup.syncDataIds.at(n),outputFile_sync);
+            sync_descriptors.emplace_back(ana_setup.syncDataIds.at(n),outputFile_sync, universe);
         }
 
     }
@@ -42,23 +66,59 @@ BaseEventAnalyzer::BaseEventAnalyzer(const AnalyzerArguments& _args, Channel cha
                 dymod[sample.name] = std::make_shared<DYModel>(sample, args.working_path());
         }
     }
-    eventWeights_HH = std::make_shared<mc_corrections::EventWeights_HH>(ana_setup.period, *bTagger);
+    // Without allow_calc_svFit the fit results are read from the input tuples, so there is nothing to cache or to
+    // offload. All consumers of the fit results (selection, MVA variables, sync and output tuples) take them from
+    // EventFitResults.
+    if((!args.fit_cache().empty() || args.n_fit_threads() > 0) && ana_setup.allow_calc_svFit) {
+        if(!args.fit_cache().empty()) {
+            std::ostringstream fitter_config;
+            fitter_config << ana_setup.period << ' ' << channelId;
+            fitResultsCache = std::make_shared<FitResultsCache>(args.fit_cache(), fitter_config.str());
+        }
+        // Each event has at most one pending task per uncertainty variation, so the queue is never the
+        // bottleneck as long as it can contain the tasks of a few events.
+        static constexpr size_t max_fit_queue_size = 1000;
+        if(args.n_fit_threads() > 0)
+            asyncFitter = std::make_shared<AsyncFitter>(args.n_fit_threads(), max_fit_queue_size);
+    }
 }
 
 void BaseEventAnalyzer::Run()
 {
     run::ThreadPull threads(args.n_threads());
-    ProcessSamples(ana_setup.signals, "signal");
-    ProcessSamples(ana_setup.data, "data");
-    ProcessSamples(ana_setup.backgrounds, "background");
+    // Samples from cmb_sample_descriptors are combinations of the samples listed below and have no input files
+    // on their own, therefore all processing units are defined by sample_descriptors.
+    std::vector<ProcessingUnit> units;
+    CollectProcessingUnits(ana_setup.signals, units);
+    CollectProcessingUnits(ana_setup.data, units);
+    CollectProcessingUnits(ana_setup.backgrounds, units);
+    if(anaTupleManifest)
+        PrepareOutputShards(units);
+    ProcessUnits(units);
     std::cout << "Saving output file..." << std::endl;
+    if(anaTupleWriter)
+        anaTupleWriter->Close();
+    for(auto& shard_writer : shardWriters)
+        shard_writer.second->Close();
+    if(anaTupleManifest)
+        anaTupleManifest->Save();
     for (size_t n = 0; n < sync_descriptors.size(); ++n) {
         auto sync_tree = sync_descriptors.at(n).sync_tree;
         sync_tree->Write();
     }
+    if(fitResultsCache) {
+        std::cout << "Saving " << fitResultsCache->GetNumberOfNewRecords() << " new fit results into '"
+                  << args.fit_cache() << "'..." << std::endl;
+        fitResultsCache->Save();
+    }
+    if(profiler.IsEnabled()) {
+        profiler.Print(std::cout);
+        profiler.WriteJson(args.profile());
+    }
 }
 
-EventCategorySet BaseEventAnalyzer::DetermineEventCategories(EventInfo& event, bool pass_vbf_trigger)
+EventCategorySet BaseEventAnalyzer::DetermineEventCategories(EventInfo& event, const BTagger& event_bTagger,
+                                                             bool pass_vbf_trigger)
 {
     static const std::map<DiscriminatorWP, size_t> btag_working_points = {{DiscriminatorWP::Loose, 0},
                                                                           {DiscriminatorWP::Medium, 0},
@@ -93,7 +153,7 @@ EventCategorySet BaseEventAnalyzer::DetermineEventCategories(EventInfo& event, b
         for(size_t bjet_index = 1; bjet_index <= 2; ++bjet_index) {
             const auto& jet = event.GetBJet(bjet_index);
             for(const auto& btag_wp : btag_working_points) {
-                if(bTagger->Pass(*jet, btag_wp.first))
+                if(event_bTagger.Pass(*jet, btag_wp.first))
                     ++bjet_counts[btag_wp.first];
             }
         }
@@ -124,21 +184,32 @@ void BaseEventAnalyzer::InitializeMvaReader()
             mva_reader.Add(key, FullPath(file), vars, legacy, legacy_lm);
         }
     }
+    for(const auto& mva_sel : mva_setup->selections) {
+        const auto& params = mva_sel.second;
+        const MvaKey key{params.name, static_cast<int>(params.mass), params.spin};
+        auto iter = std::find_if(mva_keys.begin(), mva_keys.end(), [&](const MvaKey& other) {
+            return !(key < other) && !(other < key);
+        });
+        mva_key_indices[mva_sel.first] = static_cast<size_t>(std::distance(mva_keys.begin(), iter));
+        if(iter == mva_keys.end())
+            mva_keys.push_back(key);
+    }
 }
 
-EventSubCategory BaseEventAnalyzer::DetermineEventSubCategory(EventInfo& event, const EventCategory& category,
+EventSubCategory BaseEventAnalyzer::DetermineEventSubCategory(EventInfo& event, EventFitResults& fit_results,
+                                                              const EventCategory& category,
                                                               std::map<SelectionCut, double>& mva_scores)
 {
     using namespace cuts::hh_bbtautau_Run2::hh_tag;
-    using MvaKey = mva_study::MvaReader::MvaKey;
 
     EventSubCategory sub_category;
     if(event.HasBjetPair()) {
+        const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::Fits);
         const double mbb = event.GetHiggsBB().GetMomentum().mass();
 
         if(category.HasBoostConstraint() && category.IsBoosted()) {
             if(ana_setup.use_svFit) {
-                const auto htt = event.GetHiggsTTMomentum(true, ana_setup.allow_calc_svFit);
+                const auto htt = fit_results.GetHiggsTTMomentum();
                 const bool isInsideBoostedCut = htt && IsInsideBoostedMassWindow(htt->mass(), mbb);
                 sub_category.SetCutResult(SelectionCut::mh, isInsideBoostedCut);
             }
@@ -147,9 +218,9 @@ EventSubCategory BaseEventAnalyzer::DetermineEventSubCategory(EventInfo& event,
                 throw exception("Category mh inconsistent with the false requirement of SVfit.");
             if(ana_setup.massWindowParams.count(SelectionCut::mh)) {
                 const bool cut_result = ana_setup.use_svFit
-                    && event.GetSVFitResults(ana_setup.allow_calc_svFit).has_valid_momentum
+                    && fit_results.GetSVFitResults().has_valid_momentum
                     && ana_setup.massWindowParams.at(SelectionCut::mh).IsInside(
-                            event.GetHiggsTTMomentum(true, ana_setup.allow_calc_svFit)->mass(), mbb);
+                            fit_results.GetHiggsTTMomentum()->mass(), mbb);
                 sub_category.SetCutResult(SelectionCut::mh, cut_result);
             }
             if(ana_setup.massWindowParams.count(SelectionCut::mhVis))
@@ -163,71 +234,246 @@ EventSubCategory BaseEventAnalyzer::DetermineEventSubCategory(EventInfo& event,
         }
         if(ana_setup.use_kinFit)
             sub_category.SetCutResult(SelectionCut::KinematicFitConverged,
-                                      event.GetKinFitResults(ana_setup.allow_calc_svFit).HasValidMass());
+                                      fit_results.GetKinFitResults().HasValidMass());
     }
     if(mva_setup.is_initialized()) {
-
-        std::map<MvaKey, std::future<double>> scores;
-        for(const auto& mva_sel : mva_setup->selections) {
-            const auto& params = mva_sel.second;
-            const MvaKey key{params.name, static_cast<int>(params.mass), params.spin};
-            if(!scores.count(key)) {
-                auto eval = std::bind(&mva_study::MvaReader::Evaluate, &mva_reader, key, &event);
-                scores[key] = run::async(eval);
-            }
+        // MVA scores do not depend on the category, so they are evaluated only once per event.
+        if(mva_scores.empty()) {
+            const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::Mva);
+            const auto scores = mva_reader.EvaluateAll(event, mva_keys, &fit_results);
+            for(const auto& [mva_cut, key_index] : mva_key_indices)
+                mva_scores[mva_cut] = scores.at(key_index);
         }
         for(const auto& mva_sel : mva_setup->selections) {
-            const auto& params = mva_sel.second;
-            const MvaKey key{params.name, static_cast<int>(params.mass),params.spin};
-            const double score = scores.at(key).get();
-            const bool pass = score > params.cut;
+            const bool pass = mva_scores.at(mva_sel.first) > mva_sel.second.cut;
             sub_category.SetCutResult(mva_sel.first, pass);
-            mva_scores[mva_sel.first] = score;
         }
     }
 
     return sub_category;
 }
 
-void BaseEventAnalyzer::ProcessSamples(const std::vector<std::string>& sample_names, const std::string& sample_set_name)
+void BaseEventAnalyzer::CollectProcessingUnits(const std::vector<std::string>& sample_names,
+                                               std::vector<ProcessingUnit>& units) const
 {
-    std::cout << "Processing " << sample_set_name << " samples... " << std::endl;
-    for(size_t sample_index = 0; sample_index < sample_names.size(); ++sample_index) {
-        const std::string& sample_name = sample_names.at(sample_index);
+    for(const std::string& sample_name : sample_names) {
         if(!sample_descriptors.count(sample_name))
             throw exception("Sample '%1%' not found while processing.") % sample_name;
-        SampleDescriptor& sample = sample_descriptors.at(sample_name);
+        const SampleDescriptor& sample = sample_descriptors.at(sample_name);
         if(sample.sampleType == SampleType::QCD || (sample.channels.size() && !sample.channels.count(channelId)))
             continue;
-        std::cout << '\t' << sample.name << std::endl;
-
         std::set<std::string> processed_files;
         for(const auto& sample_wp : sample.working_points) {
             if(!sample_wp.file_path.size() || processed_files.count(sample_wp.file_path)) continue;
-            auto file = root_ext::OpenRootFile(tools::FullPath({args.input(), sample_wp.file_path}));
-            auto tuple = ntuple::CreateEventTuple(ToString(channelId), file.get(), true,
-                                                  ntuple::TreeState::Skimmed);
-            auto summary_tuple = ntuple::CreateSummaryTuple("summary", file.get(), true,
-                                                            ntuple::TreeState::Skimmed);
-            const auto prod_summary = ntuple::MergeSummaryTuple(*summary_tuple);
-            if(sample.sampleType == SampleType::ggHH_NonRes) {
-                std::cout << "\t\tpreparing NonResModel... ";
-                std::cout.flush();
-                if(!crossSectionProvider)
-                    throw exception("path to the cross section config should be specified.");
-                nonResModel = std::make_shared<NonResModel>(ana_setup.period, sample, file, *crossSectionProvider);
-                std::cout << "done." << std::endl;
-            }
-            ProcessDataSource(sample, sample_wp, tuple, prod_summary);
-
+            units.push_back(ProcessingUnit{&sample, &sample_wp, sample_wp.file_path});
             processed_files.insert(sample_wp.file_path);
         }
     }
 }
 
+void BaseEventAnalyzer::PrepareOutputShards(std::vector<ProcessingUnit>& units)
+{
+    // Events of the skipped samples are also missing in the sync tuples, which are not sharded.
+    const std::string config_hash = GetOutputConfigHash();
+    std::map<std::string, bbtautau::AnaTupleManifest::Shard> shards;
+    for(const auto& unit : units) {
+        auto& shard = shards[unit.sample->name];
+        shard.file_name = bbtautau::AnaTupleManifest::GetShardFileName(unit.sample->name);
+        shard.config_hash = config_hash;
+        shard.inputs[unit.file_path] = bbtautau::AnaTupleManifest::GetFileFingerprint(
+                tools::FullPath({args.input(), unit.file_path}));
+    }
+    std::set<std::string> sample_names;
+    for(const auto& [sample_name, shard] : shards) {
+        sample_names.insert(sample_name);
+        if(anaTupleManifest->IsValid(sample_name, shard)) {
+            std::cout << '\t' << sample_name << ": output shard is up to date." << std::endl;
+            continue;
+        }
+        shardWriters[sample_name] = std::make_unique<bbtautau::AnaTupleWriter>(
+                anaTupleManifest->GetShardPath(sample_name), channelId, ana_setup.use_kinFit, ana_setup.use_svFit,
+                ana_setup.allow_calc_svFit, CreateAnaTupleOptions(args));
+        // The manifest is saved only after all shards are written, so an interrupted run leaves the rewritten
+        // shards invalid.
+        anaTupleManifest->SetShard(sample_name, shard);
+    }
+    anaTupleManifest->KeepShards(sample_names);
+    units.erase(std::remove_if(units.begin(), units.end(), [&](const ProcessingUnit& unit) {
+        return !shardWriters.count(unit.sample->name);
+    }), units.end());
+}
+
+std::string BaseEventAnalyzer::GetOutputConfigHash() const
+{
+    // The hash covers the configuration files and the arguments which define the content of the output.
+    std::ostringstream ss;
+    for(const std::string& file_name : { args.sources(), args.mva_sources() }) {
+        if(file_name.empty()) continue;
+        std::ifstream file(file_name);
+        if(!file.is_open())
+            throw exception("Unable to read the configuration file '%1%'.") % file_name;
+        ss << file.rdbuf() << '\n';
+    }
+    ss << args.setup() << '\n' << args.mva_setup() << '\n' << args.working_path() << '\n' << channelId << '\n'
+       << args.output_backend() << '\n' << args.output_compression() << '\n' << args.output_compression_level()
+       << '\n' << args.output_cluster_size() << '\n' << args.output_float_weights() << '\n'
+       << "version " << OutputVersion << '\n';
+
+    // The files read by the analyzer are identified by their fingerprints. Paths in the configuration are relative
+    // either to the current directory or to the working path.
+    const auto add_file = [&](const std::string& path) {
+        if(path.empty()) return;
+        const std::string file_path = boost::filesystem::exists(path) ? path : FullPath(path);
+        ss << path << ' ' << bbtautau::AnaTupleManifest::GetFileFingerprint(file_path) << '\n';
+    };
+    ss << "analyzer ";
+    add_file(boost::filesystem::read_symlink("/proc/self/exe").string());
+    add_file(ana_setup.trigger_path);
+    add_file(ana_setup.xs_cfg);
+    if(mva_setup.is_initialized()) {
+        for(const auto& training : mva_setup->trainings)
+            add_file(training.second);
+    }
+    // Scale factors and other corrections are read from the data directories of the packages.
+    for(const std::string& data_dir : { "h-tautau/McCorrections/data", "hh-bbtautau/McCorrections/data" }) {
+        const boost::filesystem::path data_path(FullPath(data_dir));
+        if(!boost::filesystem::is_directory(data_path)) continue;
+        std::set<std::string> data_files;
+        for(const auto& entry : boost::filesystem::recursive_directory_iterator(data_path)) {
+            if(boost::filesystem::is_regular_file(entry.path()))
+                data_files.insert(entry.path().string());
+        }
+        for(const auto& file_path : data_files)
+            add_file(file_path);
+    }
+    return bbtautau::AnaTupleManifest::GetContentHash(ss.str());
+}
+
+bbtautau::AnaTupleWriter& BaseEventAnalyzer::GetAnaTupleWriter(const SampleDescriptor& sample)
+{
+    if(anaTupleWriter)
+        return *anaTupleWriter;
+    return *shardWriters.at(sample.name);
+}
+
+void BaseEventAnalyzer::EstimateProcessingCosts(std::vector<ProcessingUnit>& units) const
+{
+    // The cost of a unit is the processing time measured in a previous run, if available,
+    // otherwise it is extrapolated from the input file size.
+    std::map<std::string, double> known_times;
+    if(!args.sample_cost_file().empty() && boost::filesystem::exists(args.sample_cost_file())) {
+        std::ifstream cost_file(args.sample_cost_file());
+        std::string file_path;
+        double time;
+        while(cost_file >> file_path >> time)
+            known_times[file_path] = time;
+    }
+    std::vector<double> file_sizes;
+    double known_size = 0, known_time = 0;
+    for(const auto& unit : units) {
+        const auto full_path = tools::FullPath({args.input(), unit.file_path});
+        const double size = boost::filesystem::exists(full_path) ? boost::filesystem::file_size(full_path) : 0.;
+        file_sizes.push_back(size);
+        if(known_times.count(unit.file_path)) {
+            known_size += size;
+            known_time += known_times.at(unit.file_path);
+        }
+    }
+    const double time_per_byte = known_size > 0 ? known_time / known_size : 1.;
+    for(size_t n = 0; n < units.size(); ++n) {
+        auto& unit = units.at(n);
+        unit.cost = known_times.count(unit.file_path) ? known_times.at(unit.file_path)
+                                                      : file_sizes.at(n) * time_per_byte;
+    }
+}
+
+void BaseEventAnalyzer::ProcessUnits(std::vector<ProcessingUnit>& units)
+{
+    const size_t n_workers = std::min<size_t>(std::max<unsigned>(args.n_sample_threads(), 1), units.size());
+    if(n_workers > 1) {
+        // The most expensive units are started first, so that the tail of the job is filled by the cheap ones.
+        EstimateProcessingCosts(units);
+        std::stable_sort(units.begin(), units.end(), [](const ProcessingUnit& a, const ProcessingUnit& b) {
+            return a.cost > b.cost;
+        });
+    }
+    std::cout << "Processing " << units.size() << " input files using " << std::max<size_t>(n_workers, 1)
+              << " worker(s)..." << std::endl;
+    // With several workers, the chunks of the concurrently processed units are written as soon as they are ready,
+    // therefore the order of the events in the output differs from run to run. Only the order of the events within
+    // each input file is preserved.
+
+    std::vector<double> times(units.size(), 0.);
+    std::atomic<size_t> next_unit(0);
+    std::atomic<bool> has_error(false);
+    std::vector<std::exception_ptr> errors(n_workers);
+    const auto worker = [&](size_t worker_id) {
+        try {
+            for(size_t n = next_unit++; n < units.size() && !has_error; n = next_unit++)
+                times.at(n) = ProcessUnit(units.at(n));
+        } catch(...) {
+            errors.at(worker_id) = std::current_exception();
+            has_error = true;
+        }
+    };
+
+    if(n_workers <= 1) {
+        for(size_t n = 0; n < units.size(); ++n)
+            times.at(n) = ProcessUnit(units.at(n));
+    } else {
+        std::vector<std::thread> workers;
+        for(size_t n = 0; n < n_workers; ++n)
+            workers.emplace_back(worker, n);
+        for(auto& worker_thread : workers)
+            worker_thread.join();
+        for(const auto& error : errors) {
+            if(error)
+                std::rethrow_exception(error);
+        }
+    }
+    SaveProcessingCosts(units, times);
+}
+
+double BaseEventAnalyzer::ProcessUnit(const ProcessingUnit& unit)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const SampleDescriptor& sample = *unit.sample;
+    {
+        std::ostringstream ss;
+        ss << '\t' << sample.name << ": " << unit.file_path << '\n';
+        std::cout << ss.str();
+        std::cout.flush();
+    }
+    auto file = root_ext::OpenRootFile(tools::FullPath({args.input(), unit.file_path}));
+    auto tuple = ntuple::CreateEventTuple(ToString(channelId), file.get(), true, ntuple::TreeState::Skimmed);
+    auto summary_tuple = ntuple::CreateSummaryTuple("summary", file.get(), true, ntuple::TreeState::Skimmed);
+    const auto prod_summary = ntuple::MergeSummaryTuple(*summary_tuple);
+    std::shared_ptr<NonResModel> nonResModel;
+    if(sample.sampleType == SampleType::ggHH_NonRes) {
+        if(!crossSectionProvider)
+            throw exception("path to the cross section config should be specified.");
+        nonResModel = std::make_shared<NonResModel>(ana_setup.period, sample, file, *crossSectionProvider);
+    }
+    ProcessDataSource(sample, *unit.sample_wp, tuple, prod_summary, nonResModel);
+    const auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(stop - start).count();
+}
+
+void BaseEventAnalyzer::SaveProcessingCosts(const std::vector<ProcessingUnit>& units,
+                                            const std::vector<double>& times) const
+{
+    if(args.sample_cost_file().empty()) return;
+    std::ofstream cost_file(args.sample_cost_file());
+    if(!cost_file.is_open())
+        throw exception("Unable to create sample cost file '%1%'.") % args.sample_cost_file();
+    for(size_t n = 0; n < units.size(); ++n)
+        cost_file << units.at(n).file_path << " " << times.at(n) << "\n";
+}
+
 void BaseEventAnalyzer::ProcessDataSource(const SampleDescriptor& sample, const SampleDescriptor::Point& sample_wp,
                                           std::shared_ptr<ntuple::EventTuple> tuple,
-                                          const ntuple::ProdSummary& prod_summary)
+                                          const ntuple::ProdSummary& prod_summary,
+                                          std::shared_ptr<NonResModel> nonResModel)
 {
     std::vector<std::string> vbf_triggers;
     if(ana_setup.trigger_vbf.count(channelId))
@@ -237,121 +483,303 @@ void BaseEventAnalyzer::ProcessDataSource(const SampleDescriptor& sample, const
     std::set<UncertaintySource> unc_sources = { UncertaintySource::None };
     if(sample.sampleType != SampleType::Data)
         unc_sources = ana_setup.unc_sources;
-    const auto unc_variations = EnumerateUncVariations(unc_sources);
-    const bool is_data = sample.sampleType == SampleType::Data;
-    for(const auto& tupleEvent : *tuple) {
-        if(!signalObjectSelector.PassMETfilters(tupleEvent,ana_setup.period,is_data)) continue;
-        if(!signalObjectSelector.PassLeptonVetoSelection(tupleEvent)) continue;
-
-        for(const auto& [unc_source, unc_scale] : unc_variations) {
-            auto event = EventInfo::Create(tupleEvent, signalObjectSelector, *bTagger, DiscriminatorWP::Medium,
-                                           summary, unc_source, unc_scale);
-
-            if(!event) continue;
-            const bool pass_normal_trigger = event->PassNormalTriggers();
-            const bool pass_vbf_trigger = event->PassVbfTriggers();
-            const bool pass_trigger = pass_normal_trigger || pass_vbf_trigger;
-            if(!pass_trigger) continue;
-
-            bbtautau::AnaTupleWriter::DataIdMap dataIds;
-            std::map<size_t, bool> sync_event_selected;
+    EventWeightBundle::Settings weight_settings;
+    weight_settings.channel = channelId;
+    weight_settings.period = ana_setup.period;
+    weight_settings.cross_section = (*summary)->cross_section > 0 ? (*summary)->cross_section : sample.cross_section;
+    weight_settings.total_shape_weight = (*summary)->totalShapeWeight;
+    weight_settings.int_lumi = ana_setup.int_lumi;
+    weight_settings.is_data = sample.sampleType == SampleType::Data;
+    auto event_summaries = std::make_shared<ObjectPool<SummaryInfo>>([this, prod_summary, vbf_triggers]() {
+        return std::make_unique<SummaryInfo>(prod_summary, channelId, ana_setup.trigger_path, trigger_patterns,
+                                             vbf_triggers);
+    });
+    const DataSourceContext context{sample, sample_wp, summary, EnumerateUncVariations(unc_sources), nonResModel,
+                                    weight_settings, event_summaries};
+
+    const size_t n_workers = std::max<size_t>(args.n_event_threads(), 1);
+    if(n_workers == 1 && args.n_sample_threads() <= 1) {
+        const EventWorker worker = AcquireEventWorker(context);
+        EventOutputVector outputs;
+        const Long64_t n_entries = tuple->GetEntries();
+        for(Long64_t current_entry = 0; current_entry < n_entries; ++current_entry) {
+            {
+                const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::TupleRead);
+                tuple->GetEntry(current_entry);
+            }
+            ProcessEventEntry(context, worker, tuple->data(), outputs);
+            WriteEventOutputs(context, outputs);
+        }
+        return;
+    }
 
-            double lepton_id_iso_weight = 1., trigger_weight = 1., prescale_weight = 1., l1_prefiring_weight = 1.,
-                   jet_pu_id_weight = 1;
+    // The chunked processing is also used when several units are processed concurrently: the outputs are then
+    // written once per chunk, which limits the contention on the shared writer.
+    const size_t chunk_size = std::max<size_t>(args.event_chunk_size(), n_workers);
+    const Long64_t n_entries = tuple->GetEntries();
+    std::vector<Event> chunk;
+    chunk.reserve(chunk_size);
+    for(Long64_t current_entry = 0; current_entry < n_entries; ++current_entry) {
+        {
+            const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::TupleRead);
+            tuple->GetEntry(current_entry);
+            chunk.push_back(tuple->data());
+        }
+        if(chunk.size() == chunk_size || current_entry + 1 == n_entries) {
+            ProcessEventChunk(context, chunk, n_workers);
+            chunk.clear();
+        }
+    }
+}
 
-            if(sample.sampleType != SampleType::Data) {
-                auto lepton_weight_provider = eventWeights_HH->GetProviderT<mc_corrections::LeptonWeights>(
-                        mc_corrections::WeightType::LeptonTrigIdIso);
-                lepton_id_iso_weight = lepton_weight_provider->GetIdIsoWeight(*event,
-                        signalObjectSelector.GetTauVSeDiscriminator(channelId).second,
-                        signalObjectSelector.GetTauVSmuDiscriminator(channelId).second,
-                        signalObjectSelector.GetTauVSjetDiscriminator().second,
-                        unc_source, unc_scale);
-                trigger_weight = lepton_weight_provider->GetTriggerWeight(*event,
-                        signalObjectSelector.GetTauVSjetDiscriminator().second, unc_source, unc_scale);
+void BaseEventAnalyzer::ProcessEventChunk(const DataSourceContext& context, const std::vector<Event>& events,
+                                          size_t n_workers)
+{
+    // Each worker processes a contiguous range of entries and stores the results in its own buffer. The buffers
+    // are written in the order of the ranges, so the order of the events of the input file is preserved.
+    n_workers = std::min(n_workers, events.size());
+    if(!n_workers) return;
+    if(n_workers == 1) {
+        const EventWorker worker = AcquireEventWorker(context);
+        EventOutputVector outputs;
+        for(const auto& tupleEvent : events)
+            ProcessEventEntry(context, worker, tupleEvent, outputs);
+        WriteEventOutputs(context, outputs);
+        return;
+    }
+    const size_t range_size = (events.size() + n_workers - 1) / n_workers;
+    std::vector<EventOutputVector> outputs(n_workers);
+    std::vector<std::exception_ptr> errors(n_workers);
+    std::vector<std::thread> workers;
+    for(size_t n = 0; n < n_workers; ++n) {
+        const size_t begin = std::min(n * range_size, events.size());
+        const size_t end = std::min(begin + range_size, events.size());
+        workers.emplace_back([&, n, begin, end]() {
+            try {
+                const EventWorker worker = AcquireEventWorker(context);
+                for(size_t entry = begin; entry < end; ++entry)
+                    ProcessEventEntry(context, worker, events.at(entry), outputs.at(n));
+            } catch(...) {
+                errors.at(n) = std::current_exception();
+            }
+        });
+    }
+    for(auto& worker : workers)
+        worker.join();
+    for(const auto& error : errors) {
+        if(error)
+            std::rethrow_exception(error);
+    }
+    for(auto& worker_outputs : outputs)
+        WriteEventOutputs(context, worker_outputs);
+}
 
-                prescale_weight = lepton_weight_provider->GetTriggerPrescaleWeight(*event);
+BaseEventAnalyzer::EventWorker BaseEventAnalyzer::AcquireEventWorker(const DataSourceContext& context)
+{
+    return EventWorker{eventTools.Acquire(), context.event_summaries->Acquire()};
+}
 
-                if(ana_setup.period == Period::Run2016 || ana_setup.period == Period::Run2017)
-                    l1_prefiring_weight = (*event)->l1_prefiring_weight;
+void BaseEventAnalyzer::ProcessEventEntry(const DataSourceContext& context, const EventWorker& worker,
+                                          const Event& tupleEvent, EventOutputVector& outputs)
+{
+    const SampleDescriptor& sample = context.sample;
+    const SampleDescriptor::Point& sample_wp = context.sample_wp;
+    const auto& summary = worker.summary;
+    EventTools& tools = *worker.tools;
+    const bool is_data = sample.sampleType == SampleType::Data;
+    const auto event_start = profiler.Now();
+    const bool pass_met_filters = tools.signalObjectSelector.PassMETfilters(tupleEvent, ana_setup.period, is_data);
+    profiler.AddSelection(SelectionStep::MetFilters, pass_met_filters, profiler.Now() - event_start);
+    if(!pass_met_filters) return;
+    const bool pass_lepton_veto = tools.signalObjectSelector.PassLeptonVetoSelection(tupleEvent);
+    profiler.AddSelection(SelectionStep::LeptonVeto, pass_lepton_veto, profiler.Now() - event_start);
+    if(!pass_lepton_veto) return;
+
+    // All variations of the event pass the selection of EventInfo and triggers first, so that, if the fitter offload
+    // is enabled, their fits are computed by the fitter pool while the variations are categorised.
+    struct SelectedVariation {
+        UncertaintySource unc_source;
+        UncertaintyScale unc_scale;
+        EventAnalyzerProfiler::Clock::time_point start;
+        std::unique_ptr<EventInfo> event;
+        std::unique_ptr<EventFitResults> fit_results;
+        bool pass_vbf_trigger;
+    };
+    std::vector<SelectedVariation> selected_variations;
+    std::shared_ptr<const Event> fit_tuple_event;
+    for(const auto& [unc_source, unc_scale] : context.unc_variations) {
+        // The cost of a rejection at the later steps is counted from the start of the uncertainty variation.
+        const auto variation_start = profiler.Now();
+        std::unique_ptr<EventInfo> event;
+        {
+            const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::EventInfoCreate);
+            event = EventInfo::Create(tupleEvent, tools.signalObjectSelector, *tools.bTagger,
+                                      DiscriminatorWP::Medium, summary, unc_source, unc_scale);
+        }
+        profiler.AddSelection(SelectionStep::EventInfo, event != nullptr, profiler.Now() - variation_start);
+        if(!event) continue;
 
-                auto jet_pu_id_weight_provided = eventWeights_HH->GetProviderT<mc_corrections::JetPuIdWeights>(
-                        mc_corrections::WeightType::JetPuIdWeights);
-                jet_pu_id_weight = jet_pu_id_weight_provided->Get(*event);
+        bool pass_vbf_trigger, pass_trigger;
+        {
+            const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::Trigger);
+            const bool pass_normal_trigger = event->PassNormalTriggers();
+            pass_vbf_trigger = event->PassVbfTriggers();
+            pass_trigger = pass_normal_trigger || pass_vbf_trigger;
+        }
+        profiler.AddSelection(SelectionStep::Trigger, pass_trigger, profiler.Now() - variation_start);
+        if(!pass_trigger) continue;
+
+        auto fit_results = std::make_unique<EventFitResults>(*event, ana_setup.allow_calc_svFit,
+                                                             fitResultsCache.get(), unc_source, unc_scale);
+        if(asyncFitter) {
+            // EventInfo and its helpers are not thread-safe, therefore the fits are computed on a separate
+            // EventInfo, which the fitter thread creates from a copy of the tuple event using its own helpers.
+            if(!fit_tuple_event)
+                fit_tuple_event = std::make_shared<const Event>(tupleEvent);
+            const auto make_fit_event = [this, tuple_event = fit_tuple_event, summaries = context.event_summaries,
+                                         source = unc_source, scale = unc_scale]() {
+                auto fit_worker = std::make_shared<EventWorker>(EventWorker{eventTools.Acquire(),
+                                                                            summaries->Acquire()});
+                EventFitResults::FitEvent fit_event;
+                fit_event.event = EventInfo::Create(*tuple_event, fit_worker->tools->signalObjectSelector,
+                                                    *fit_worker->tools->bTagger, DiscriminatorWP::Medium,
+                                                    fit_worker->summary, source, scale);
+                fit_event.resources = fit_worker;
+                return fit_event;
+            };
+            fit_results->Prefetch(*asyncFitter, make_fit_event, ana_setup.use_svFit, ana_setup.use_kinFit);
+        }
+        selected_variations.push_back(SelectedVariation{unc_source, unc_scale, variation_start, std::move(event),
+                                                        std::move(fit_results), pass_vbf_trigger});
+    }
 
+    std::unique_ptr<EventWeightBundle> previous_weights;
+    for(auto& variation : selected_variations) {
+        const UncertaintySource unc_source = variation.unc_source;
+        const UncertaintyScale unc_scale = variation.unc_scale;
+        const auto variation_start = variation.start;
+        const bool pass_vbf_trigger = variation.pass_vbf_trigger;
+        auto& event = variation.event;
+        auto& fit_results = variation.fit_results;
+
+        bbtautau::AnaTupleWriter::DataIdMap dataIds;
+        std::vector<SyncFillRequest> sync_requests;
+        std::map<size_t, bool> sync_event_selected;
+
+        // Weight factors are evaluated on demand once per (event, variation); the factors which do not depend on
+        // the uncertainty variation are taken from the previous variation of the same event.
+        auto weights = std::make_unique<EventWeightBundle>(*event, *tools.eventWeights_HH,
+                                                           tools.signalObjectSelector, context.weight_settings,
+                                                           unc_source, unc_scale);
+        if(previous_weights)
+            weights->ReuseEventFactors(*previous_weights);
+
+        std::map<SelectionCut, double> mva_scores;
+        EventCategorySet eventCategories;
+        {
+            const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::Categorisation);
+            eventCategories = DetermineEventCategories(*event, *tools.bTagger, pass_vbf_trigger);
+        }
+        profiler.AddSelection(SelectionStep::Category, !eventCategories.empty(), profiler.Now() - variation_start);
+        bool pass_region = false, pass_sub_category = false;
+        for(auto eventCategory : eventCategories) {
+            EventRegion eventRegion;
+            {
+                const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::Categorisation);
+                eventRegion = DetermineEventRegion(*event, eventCategory);
             }
-            const auto eventCategories = DetermineEventCategories(*event, pass_vbf_trigger);
-            for(auto eventCategory : eventCategories) {
-                const EventRegion eventRegion = DetermineEventRegion(*event, eventCategory);
-                for(const auto& region : ana_setup.regions){
-                    if(!eventRegion.Implies(region)) continue;
-                    std::map<SelectionCut, double> mva_scores;
-                    const auto eventSubCategory = DetermineEventSubCategory(*event, eventCategory, mva_scores);
-                    for(const auto& subCategory : sub_categories_to_process) {
-                        if(!eventSubCategory.Implies(subCategory)) continue;
-                        SelectionCut mva_cut;
-                        double mva_score = 0;
-                        if(subCategory.TryGetLastMvaCut(mva_cut))
-                            mva_score = mva_scores.at(mva_cut);
-                        event->SetMvaScore(mva_score);
-                        const EventAnalyzerDataId anaDataId(eventCategory, subCategory, region,
-                                                            unc_source, unc_scale, sample_wp.full_name);
-                        double btag_weight = 1., shape_weight = 1.;
-                        if(sample.sampleType == SampleType::Data) {
-                            dataIds[anaDataId] = std::make_tuple(1., mva_score);
+            const bool apply_btag = eventCategory.HasBtagConstraint();
+            // None of the selection cuts depends on the region, so the sub-category is determined once per
+            // category, and only if the event belongs to at least one of the regions to process.
+            boost::optional<EventSubCategory> eventSubCategory;
+            for(const auto& region : ana_setup.regions){
+                if(!eventRegion.Implies(region)) continue;
+                pass_region = true;
+                if(!eventSubCategory) {
+                    const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::Categorisation);
+                    eventSubCategory = DetermineEventSubCategory(*event, *fit_results, eventCategory, mva_scores);
+                }
+                for(const auto& subCategory : sub_categories_to_process) {
+                    if(!eventSubCategory->Implies(subCategory)) continue;
+                    pass_sub_category = true;
+                    SelectionCut mva_cut;
+                    double mva_score = 0;
+                    if(subCategory.TryGetLastMvaCut(mva_cut))
+                        mva_score = mva_scores.at(mva_cut);
+                    event->SetMvaScore(mva_score);
+                    const EventAnalyzerDataId anaDataId(eventCategory, subCategory, region,
+                                                        unc_source, unc_scale, sample_wp.full_name);
+                    if(sample.sampleType == SampleType::Data) {
+                        dataIds[anaDataId] = std::make_tuple(1., mva_score);
+                    } else {
+                        double weight;
+                        {
+                            const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::Weights);
+                            weight = weights->GetEventWeight(apply_btag);
+                        }
+                        if(sample.sampleType == SampleType::MC) {
+                            dataIds[anaDataId] = std::make_tuple(weight, mva_score);
                         } else {
-
-                            if(eventCategory.HasBtagConstraint()) {
-                                auto btag_weight_provider = eventWeights_HH->GetProviderT<mc_corrections::BTagWeight>(
-                                        mc_corrections::WeightType::BTag);
-                                btag_weight = btag_weight_provider->Get(*event);
-                            }
-
-                            double cross_section = (*summary)->cross_section > 0 ? (*summary)->cross_section :
-                                                                                    sample.cross_section;
-
-                            auto gen_weight_provider = eventWeights_HH->GetProviderT<mc_corrections::GenEventWeight>(
-                                    mc_corrections::WeightType::GenEventWeight);
-                            shape_weight = cross_section * gen_weight_provider->Get(*event);
-                            const double weight = (*event)->weight_total * cross_section *  ana_setup.int_lumi
-                                                   * lepton_id_iso_weight * trigger_weight * prescale_weight
-                                                   * l1_prefiring_weight * btag_weight * jet_pu_id_weight
-                                                   / (*summary)->totalShapeWeight;
-                            if(sample.sampleType == SampleType::MC) {
-                                dataIds[anaDataId] = std::make_tuple(weight, mva_score);
-                            } else
-                                ProcessSpecialEvent(sample, sample_wp, anaDataId, *event, weight,
-                                                    (*summary)->totalShapeWeight, dataIds, cross_section);
+                            std::lock_guard<std::mutex> lock(special_event_mutex);
+                            ProcessSpecialEvent(context, anaDataId, *event, weight,
+                                                (*context.summary)->totalShapeWeight, dataIds,
+                                                weights->GetCrossSection());
                         }
+                    }
 
-                        for(size_t n = 0; n < sync_descriptors.size(); ++n) {
-                            if(sync_event_selected[n]) continue;
-                            const auto& regex_pattern = sync_descriptors.at(n).regex_pattern;
-                            for(auto& dataId : dataIds) {
-                                if(!boost::regex_match(dataId.first.GetName(), *regex_pattern)) continue;
-                                htt_sync::FillSyncTuple(*event, *sync_descriptors.at(n).sync_tree, ana_setup.period,
-                                                        ana_setup.use_svFit, std::get<0>(dataId.second),
-                                                        lepton_id_iso_weight, trigger_weight, btag_weight,
-                                                        shape_weight, jet_pu_id_weight);
-                                sync_event_selected[n] = true;
-                                break;
-                            }
+                    for(size_t n = 0; n < sync_descriptors.size(); ++n) {
+                        if(sync_event_selected[n]) continue;
+                        const auto& matcher = *sync_descriptors.at(n).matcher;
+                        for(auto& dataId : dataIds) {
+                            if(!matcher.Match(dataId.first)) continue;
+                            const double btag_weight = apply_btag ? weights->Get(WeightFactor::BTag) : 1.;
+                            sync_requests.push_back(SyncFillRequest{n, mva_score, std::get<0>(dataId.second),
+                                    weights->Get(WeightFactor::LeptonIdIso), weights->Get(WeightFactor::Trigger),
+                                    btag_weight, weights->GetShapeWeight(), weights->Get(WeightFactor::JetPuId)});
+                            sync_event_selected[n] = true;
+                            break;
                         }
                     }
                 }
             }
-            //dataId
-            anaTupleWriter.AddEvent(*event, dataIds, pass_vbf_trigger);
         }
+        if(!eventCategories.empty()) {
+            const auto variation_cost = profiler.Now() - variation_start;
+            profiler.AddSelection(SelectionStep::Region, pass_region, variation_cost);
+            if(pass_region)
+                profiler.AddSelection(SelectionStep::SubCategory, pass_sub_category, variation_cost);
+        }
+        previous_weights = std::move(weights);
+        outputs.push_back(EventOutput{worker, std::move(event), std::move(fit_results), std::move(dataIds),
+                                      pass_vbf_trigger, std::move(sync_requests)});
     }
 }
 
-void BaseEventAnalyzer::ProcessSpecialEvent(const SampleDescriptor& sample,
-                                            const SampleDescriptor::Point& /*sample_wp*/,
-                                            const EventAnalyzerDataId& anaDataId, EventInfo& event, double weight,
-                                            double shape_weight, bbtautau::AnaTupleWriter::DataIdMap& dataIds,
-                                            double cross_section)
+void BaseEventAnalyzer::WriteEventOutputs(const DataSourceContext& context, EventOutputVector& outputs)
 {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    auto& writer = GetAnaTupleWriter(context.sample);
+    for(auto& output : outputs) {
+        const double mva_score = output.event->GetMvaScore();
+        for(const auto& request : output.sync_requests) {
+            output.event->SetMvaScore(request.mva_score);
+            htt_sync::FillSyncTuple(*output.event, *sync_descriptors.at(request.descriptor_index).sync_tree,
+                                    ana_setup.period, ana_setup.use_svFit, request.weight,
+                                    request.lepton_id_iso_weight, request.trigger_weight, request.btag_weight,
+                                    request.shape_weight, request.jet_pu_id_weight, output.fit_results.get());
+        }
+        output.event->SetMvaScore(mva_score);
+        const EventAnalyzerProfiler::StageTimer timer(profiler, AnalyzerStage::AddEvent);
+        writer.AddEvent(*output.event, output.dataIds, output.pass_vbf_trigger, output.fit_results.get());
+    }
+    outputs.clear();
+}
+
+void BaseEventAnalyzer::ProcessSpecialEvent(const DataSourceContext& context, const EventAnalyzerDataId& anaDataId,
+                                            EventInfo& event, double weight, double shape_weight,
+                                            bbtautau::AnaTupleWriter::DataIdMap& dataIds, double cross_section)
+{
+    const SampleDescriptor& sample = context.sample;
     if(sample.sampleType == SampleType::DY){
         dymod.at(sample.name)->ProcessEvent(anaDataId,event,weight,dataIds);
     } else if(sample.sampleType == SampleType::TT) {
@@ -367,11 +795,46 @@ void BaseEventAnalyzer::ProcessSpecialEvent(const SampleDescriptor& sample,
                     std::make_tuple(weight * event->weight_top_pt, event.GetMvaScore());
         }
     } else if(sample.sampleType == SampleType::ggHH_NonRes) {
-        nonResModel->ProcessEvent(anaDataId, event, weight, shape_weight, dataIds, cross_section);
+        context.nonResModel->ProcessEvent(anaDataId, event, weight, shape_weight, dataIds, cross_section);
     } else
         throw exception("Unsupported special event type '%1%'.") % sample.sampleType;
 }
 
+bbtautau::AnaTupleWriter::Options BaseEventAnalyzer::CreateAnaTupleOptions(const AnalyzerArguments& args)
+{
+    bbtautau::AnaTupleWriter::Options options;
+    options.backend = args.output_backend();
+    options.compression = args.output_compression();
+    options.compression_level = args.output_compression_level();
+    options.cluster_size = args.output_cluster_size();
+    // Codes of the data ids are positions in the aux dictionary of a single file, therefore the shards, which have
+    // their own dictionaries, store the hashes. The 16-bit codes are opt-in, because the writer can not switch to
+    // the hashes once the number of data ids exceeds their capacity.
+    if(args.output_index_data_ids() && args.output_shards())
+        std::cout << "Warning: data ids of the output shards are stored as hashes." << std::endl;
+    options.index_data_ids = args.output_index_data_ids() && !args.output_shards();
+    options.float_weights = args.output_float_weights();
+    options.write_buffer_size = args.output_buffer_size();
+    return options;
+}
+
+DataIdUniverse BaseEventAnalyzer::CreateDataIdUniverse() const
+{
+    DataIdUniverse universe;
+    universe.categories = ana_setup.categories;
+    universe.sub_categories = sub_categories_to_process;
+    universe.regions = ana_setup.regions;
+    universe.unc_sources = ana_setup.unc_sources;
+    universe.unc_sources.insert(UncertaintySource::None);
+    universe.unc_sources.insert(UncertaintySource::TopPt);
+    universe.unc_scales = { UncertaintyScale::Central, UncertaintyScale::Up, UncertaintyScale::Down };
+    for(const auto& sample : sample_descriptors) {
+        for(const auto& sample_wp : sample.second.working_points)
+            universe.datasets.insert(sample_wp.full_name);
+    }
+    return universe;
+}
+
 bool BaseEventAnalyzer::SetRegionIsoRange(const LepCandidate& cand, EventRegion& region) const
 {
     if(cand->leg_type() == LegType::tau) {
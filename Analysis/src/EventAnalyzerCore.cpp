@@ -145,7 +145,7 @@ void EventAnalyzerCore::AddSampleToCombined(AnaDataCollection& anaDataCollection
             const auto subDataId = metaDataId.Set(sub_sample_wp.full_name).Set(subCategory);
             auto& subAnaData = anaDataCollection.Get(subDataId);
             for(const auto& sub_entry : subAnaData.GetEntriesEx<TH1D>()) {
-                auto& entry = anaData.GetEntryEx<TH1D>(sub_entry.first);
+                auto& entry = anaData.GetHistogram(sub_entry.first);
                 for(const auto& hist : sub_entry.second->GetHistograms()) {
                     entry(hist.first).AddHistogram(*hist.second);
                 }
@@ -10,6 +10,15 @@ EventAnalyzerDataCollection::EventAnalyzerDataCollection(std::shared_ptr<TFile>
                                                          const NameSet& _histNames,
                                                          const DescSet& _histDescs, bool _readMode,
                                                          const NameSet& _backgrounds, MucPtr _unc_collection) :
+    EventAnalyzerDataCollection(_file, _channel, _histNames, std::make_shared<HistDescResolver>(_histDescs),
+                                _readMode, _backgrounds, _unc_collection)
+{
+}
+
+EventAnalyzerDataCollection::EventAnalyzerDataCollection(std::shared_ptr<TFile> _file, Channel _channel,
+                                                         const NameSet& _histNames,
+                                                         DescResolverPtr _histDescs, bool _readMode,
+                                                         const NameSet& _backgrounds, MucPtr _unc_collection) :
     file(_file), channel(_channel), histNames(_histNames), histDescs(_histDescs), readMode(_readMode),
     backgrounds(_backgrounds), unc_collection(_unc_collection)
 {
@@ -17,13 +26,71 @@ EventAnalyzerDataCollection::EventAnalyzerDataCollection(std::shared_ptr<TFile>
 
 EventAnalyzerDataCollection::Data& EventAnalyzerDataCollection::Get(const DataId& id)
 {
-    std::lock_guard<Mutex> lock(mutex);
-    auto& anaData = anaDataMap[id];
-    if(!anaData)
-        anaData = Make(id);
+    return Get(PackedDataId(id));
+}
+
+EventAnalyzerDataCollection::Data& EventAnalyzerDataCollection::Get(const PackedDataId& id)
+{
+    const DataPtr anaData = packedDataMap.GetOrCreate(id, [&]() {
+        std::lock_guard<Mutex> lock(mutex);
+        const DataId full_id = id.Unpack();
+        auto& data = anaDataMap[full_id];
+        if(!data) {
+            data = Make(full_id);
+            if(store)
+                store->Extract(id, *data);
+        }
+        return data;
+    });
     return *anaData;
 }
 
+void EventAnalyzerDataCollection::SetUncertaintyScaleHistograms(UncertaintyScale scale, const NameSet& names)
+{
+    std::lock_guard<Mutex> lock(mutex);
+    for(const auto& name : names) {
+        if(!histNames.count(name))
+            throw exception("Histogram '%1%' requested for the uncertainty scale %2% is not enabled.") % name % scale;
+    }
+    uncScaleHistNames[scale] = names;
+}
+
+void EventAnalyzerDataCollection::SetHistogramStore(StorePtr _store)
+{
+    std::lock_guard<Mutex> lock(mutex);
+    store = _store;
+}
+
+void EventAnalyzerDataCollection::LoadStoredHistograms(const EventSubCategorySet& subCategories)
+{
+    StorePtr stored;
+    {
+        std::lock_guard<Mutex> lock(mutex);
+        stored = store;
+    }
+    if(!stored) return;
+    // The histograms are extracted by Get, if the data is created, otherwise they are added to the existing data.
+    for(const auto& id : stored->GetIds(subCategories))
+        stored->Extract(id, Get(id));
+}
+
+void EventAnalyzerDataCollection::WriteStoredHistograms(const EventSubCategorySet& subCategories)
+{
+    std::lock_guard<Mutex> lock(mutex);
+    if(!store) return;
+    for(const auto& id : store->GetIds(subCategories)) {
+        const DataId full_id = id.Unpack();
+        auto iter = anaDataMap.find(full_id);
+        if(iter != anaDataMap.end()) {
+            store->Extract(id, *iter->second);
+            continue;
+        }
+        // The data is written when it is destroyed.
+        auto anaData = Make(full_id);
+        store->Extract(id, *anaData);
+    }
+}
+
 const EventAnalyzerDataCollection::DataMap& EventAnalyzerDataCollection::GetAll() const { return anaDataMap; }
 Channel EventAnalyzerDataCollection::ChannelId() const { return channel; }
 bool EventAnalyzerDataCollection::ReadMode() const { return readMode; }
@@ -34,6 +101,10 @@ EventAnalyzerDataCollection::DataPtr EventAnalyzerDataCollection::Make(const Dat
         throw exception("EventAnalyzerDataId '%1%' is not complete.") % id;
     const std::string dir_name = id.GetName();
     const auto& sample_unc = GetModellingUncertainty(id);
+    const auto unc_iter = uncScaleHistNames.find(id.Get<UncertaintyScale>());
+    if(unc_iter != uncScaleHistNames.end())
+        return std::make_shared<Data>(file, dir_name, channel, id, unc_iter->second, histDescs, sample_unc, readMode,
+                                      true);
     return std::make_shared<Data>(file, dir_name, channel, id, histNames, histDescs, sample_unc, readMode);
 }
 
@@ -0,0 +1,109 @@
+/*! Definition of EventAnalyzerProfiler class, the per-stage timing and cut-flow profiler for event analyzers.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/EventAnalyzerProfiler.h"
+
+#include <iomanip>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+namespace analysis {
+
+namespace {
+// Innermost active timer of the current thread.
+thread_local EventAnalyzerProfiler::StageTimer* active_timer = nullptr;
+} // anonymous namespace
+
+EventAnalyzerProfiler::StageTimer::StageTimer(EventAnalyzerProfiler& _profiler, AnalyzerStage _stage) :
+    profiler(_profiler.IsEnabled() ? &_profiler : nullptr), stage(_stage)
+{
+    if(!profiler) return;
+    parent = active_timer;
+    active_timer = this;
+    start = Clock::now();
+}
+
+EventAnalyzerProfiler::StageTimer::~StageTimer()
+{
+    if(!profiler) return;
+    const Clock::duration time = Clock::now() - start;
+    profiler->AddStageTime(stage, time - nested_time);
+    if(parent)
+        parent->nested_time += time;
+    active_timer = parent;
+}
+
+void EventAnalyzerProfiler::AddStageTime(AnalyzerStage stage, Clock::duration time)
+{
+    if(!enabled) return;
+    const size_t index = static_cast<size_t>(stage);
+    stage_time.at(index) += ToNanoseconds(time);
+    ++stage_calls.at(index);
+}
+
+void EventAnalyzerProfiler::AddSelection(SelectionStep step, bool passed, Clock::duration cost)
+{
+    if(!enabled) return;
+    const size_t index = static_cast<size_t>(step);
+    ++step_processed.at(index);
+    if(!passed) {
+        ++step_rejected.at(index);
+        step_rejected_cost.at(index) += ToNanoseconds(cost);
+    }
+}
+
+void EventAnalyzerProfiler::Print(std::ostream& os) const
+{
+    static constexpr double ns_to_s = 1e-9;
+    const auto flags = os.flags();
+    const auto precision = os.precision();
+    os << "Analyzer profile:\n"
+       << std::setw(20) << std::left << "stage" << std::right << std::setw(15) << "time [s]"
+       << std::setw(15) << "calls" << std::setw(15) << "time/call [us]" << "\n";
+    for(size_t n = 0; n < NumberOfStages; ++n) {
+        const double time = stage_time.at(n) * ns_to_s;
+        const unsigned long long calls = stage_calls.at(n);
+        os << std::setw(20) << std::left << static_cast<AnalyzerStage>(n) << std::right << std::fixed
+           << std::setprecision(3) << std::setw(15) << time << std::setw(15) << calls << std::setw(15)
+           << (calls ? time / calls * 1e6 : 0.) << "\n";
+    }
+    os << std::setw(20) << std::left << "selection step" << std::right << std::setw(15) << "processed"
+       << std::setw(15) << "rejected" << std::setw(15) << "rej. cost [s]" << "\n";
+    for(size_t n = 0; n < NumberOfSteps; ++n) {
+        os << std::setw(20) << std::left << static_cast<SelectionStep>(n) << std::right << std::setw(15)
+           << step_processed.at(n) << std::setw(15) << step_rejected.at(n) << std::setw(15) << std::fixed
+           << std::setprecision(3) << step_rejected_cost.at(n) * ns_to_s << "\n";
+    }
+    os.flush();
+    os.flags(flags);
+    os.precision(precision);
+}
+
+void EventAnalyzerProfiler::WriteJson(const std::string& file_name) const
+{
+    namespace pt = boost::property_tree;
+    pt::ptree stages, steps, report;
+    for(size_t n = 0; n < NumberOfStages; ++n) {
+        pt::ptree stage;
+        stage.put("time_ns", stage_time.at(n).load());
+        stage.put("calls", stage_calls.at(n).load());
+        stages.add_child(ToString(static_cast<AnalyzerStage>(n)), stage);
+    }
+    for(size_t n = 0; n < NumberOfSteps; ++n) {
+        pt::ptree step;
+        step.put("processed", step_processed.at(n).load());
+        step.put("rejected", step_rejected.at(n).load());
+        step.put("rejected_cost_ns", step_rejected_cost.at(n).load());
+        steps.add_child(ToString(static_cast<SelectionStep>(n)), step);
+    }
+    report.add_child("stages", stages);
+    report.add_child("selection", steps);
+    pt::write_json(file_name, report);
+}
+
+unsigned long long EventAnalyzerProfiler::ToNanoseconds(Clock::duration time)
+{
+    return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count());
+}
+
+} // namespace analysis
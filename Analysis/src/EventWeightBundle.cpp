@@ -0,0 +1,103 @@
+/*! Definition of EventWeightBundle class, the cache of the event weight factors used by event analyzers.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/EventWeightBundle.h"
+
+#include "h-tautau/McCorrections/include/LeptonWeights.h"
+#include "h-tautau/McCorrections/include/BTagWeight.h"
+#include "h-tautau/McCorrections/include/GenEventWeight.h"
+#include "h-tautau/McCorrections/include/JetPuIdWeights.h"
+
+namespace analysis {
+
+bool EventWeightBundle::DependsOnUncVariation(WeightFactor factor)
+{
+    static const std::map<WeightFactor, bool> depends_on_unc_variation = {
+        { WeightFactor::LeptonIdIso, true }, { WeightFactor::Trigger, true }, { WeightFactor::Prescale, true },
+        { WeightFactor::L1Prefiring, false }, { WeightFactor::JetPuId, true }, { WeightFactor::BTag, true },
+        { WeightFactor::Gen, false },
+    };
+    return depends_on_unc_variation.at(factor);
+}
+
+EventWeightBundle::EventWeightBundle(EventInfo& _event, mc_corrections::EventWeights_HH& _weights,
+                                     const SignalObjectSelector& _signalObjectSelector, const Settings& _settings,
+                                     UncertaintySource _unc_source, UncertaintyScale _unc_scale) :
+    event(&_event), weights(&_weights), signalObjectSelector(&_signalObjectSelector), settings(_settings),
+    unc_source(_unc_source), unc_scale(_unc_scale)
+{
+    factors.fill(1.);
+}
+
+void EventWeightBundle::ReuseEventFactors(const EventWeightBundle& other)
+{
+    for(size_t n = 0; n < NumberOfFactors; ++n) {
+        const WeightFactor factor = static_cast<WeightFactor>(n);
+        if(!other.has_factor[n] || DependsOnUncVariation(factor)) continue;
+        factors[n] = other.factors[n];
+        has_factor[n] = true;
+    }
+}
+
+double EventWeightBundle::Get(WeightFactor factor)
+{
+    const size_t index = static_cast<size_t>(factor);
+    if(!has_factor[index]) {
+        factors[index] = settings.is_data ? 1. : Evaluate(factor);
+        has_factor[index] = true;
+    }
+    return factors[index];
+}
+
+double EventWeightBundle::GetEventWeight(bool apply_btag)
+{
+    if(settings.is_data) return 1.;
+    if(!common_weight) {
+        common_weight = (*event)->weight_total * settings.cross_section * settings.int_lumi
+                        * Get(WeightFactor::LeptonIdIso) * Get(WeightFactor::Trigger) * Get(WeightFactor::Prescale)
+                        * Get(WeightFactor::L1Prefiring);
+    }
+    const double btag_weight = apply_btag ? Get(WeightFactor::BTag) : 1.;
+    return *common_weight * btag_weight * Get(WeightFactor::JetPuId) / settings.total_shape_weight;
+}
+
+double EventWeightBundle::GetShapeWeight()
+{
+    if(settings.is_data) return 1.;
+    if(!shape_weight)
+        shape_weight = settings.cross_section * Get(WeightFactor::Gen);
+    return *shape_weight;
+}
+
+double EventWeightBundle::Evaluate(WeightFactor factor)
+{
+    using namespace mc_corrections;
+    const Channel channel = settings.channel;
+    switch(factor) {
+        case WeightFactor::LeptonIdIso:
+            return weights->GetProviderT<LeptonWeights>(WeightType::LeptonTrigIdIso)->GetIdIsoWeight(*event,
+                    signalObjectSelector->GetTauVSeDiscriminator(channel).second,
+                    signalObjectSelector->GetTauVSmuDiscriminator(channel).second,
+                    signalObjectSelector->GetTauVSjetDiscriminator().second,
+                    unc_source, unc_scale);
+        case WeightFactor::Trigger:
+            return weights->GetProviderT<LeptonWeights>(WeightType::LeptonTrigIdIso)->GetTriggerWeight(*event,
+                    signalObjectSelector->GetTauVSjetDiscriminator().second, unc_source, unc_scale);
+        case WeightFactor::Prescale:
+            return weights->GetProviderT<LeptonWeights>(WeightType::LeptonTrigIdIso)
+                    ->GetTriggerPrescaleWeight(*event);
+        case WeightFactor::L1Prefiring:
+            if(settings.period == Period::Run2016 || settings.period == Period::Run2017)
+                return (*event)->l1_prefiring_weight;
+            return 1.;
+        case WeightFactor::JetPuId:
+            return weights->GetProviderT<JetPuIdWeights>(WeightType::JetPuIdWeights)->Get(*event);
+        case WeightFactor::BTag:
+            return weights->GetProviderT<BTagWeight>(WeightType::BTag)->Get(*event);
+        case WeightFactor::Gen:
+            return weights->GetProviderT<GenEventWeight>(WeightType::GenEventWeight)->Get(*event);
+    }
+    throw exception("EventWeightBundle: unsupported weight factor '%1%'.") % factor;
+}
+
+} // namespace analysis
@@ -0,0 +1,404 @@
+/*! Definition of FitResultsCache class, the persistent cache of SVfit and KinFit results.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/FitResultsCache.h"
+#include "hh-bbtautau/Analysis/include/AsyncFitter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
+
+namespace analysis {
+
+namespace {
+struct FitResultsCacheHeader {
+    static constexpr char Magic[8] = { 'H', 'H', 'F', 'I', 'T', 'C', 'H', '2' };
+
+    char magic[8];
+    uint64_t record_size, n_records;
+};
+constexpr char FitResultsCacheHeader::Magic[8];
+
+static_assert(std::is_trivially_copyable<FitResultsCache::Record>::value,
+              "FitResultsCache::Record should be trivially copyable to be stored in the memory-mapped file.");
+}
+
+bool FitResultsCache::Key::operator<(const Key& other) const
+{
+    return std::tie(run, lumi, evt, unc_source, unc_scale, input_hash, config_hash)
+            < std::tie(other.run, other.lumi, other.evt, other.unc_source, other.unc_scale, other.input_hash,
+                       other.config_hash);
+}
+
+bool FitResultsCache::Key::operator==(const Key& other) const
+{
+    return std::tie(run, lumi, evt, unc_source, unc_scale, input_hash, config_hash)
+            == std::tie(other.run, other.lumi, other.evt, other.unc_source, other.unc_scale, other.input_hash,
+                        other.config_hash);
+}
+
+void FitResultsCache::Record::SetSVFitResults(const sv_fit_ana::FitResults& results)
+{
+    flags |= HasSVfit;
+    SVfit_valid = results.has_valid_momentum;
+    SVfit_pt = results.momentum.pt();
+    SVfit_eta = results.momentum.eta();
+    SVfit_phi = results.momentum.phi();
+    SVfit_m = results.momentum.mass();
+    SVfit_pt_error = results.momentum_error.pt();
+    SVfit_eta_error = results.momentum_error.eta();
+    SVfit_phi_error = results.momentum_error.phi();
+    SVfit_m_error = results.momentum_error.mass();
+    SVfit_mt = results.transverseMass;
+    SVfit_mt_error = results.transverseMass_error;
+}
+
+void FitResultsCache::Record::SetKinFitResults(const kin_fit::FitResults& results)
+{
+    flags |= HasKinFit;
+    kinFit_convergence = results.convergence;
+    kinFit_m = results.mass;
+    kinFit_chi2 = results.chi2;
+    kinFit_probability = results.probability;
+}
+
+sv_fit_ana::FitResults FitResultsCache::Record::GetSVFitResults() const
+{
+    if(!(flags & HasSVfit))
+        throw exception("SVfit results are not stored in the fit cache record.");
+    sv_fit_ana::FitResults results;
+    results.has_valid_momentum = SVfit_valid > 0;
+    results.momentum = LorentzVectorM(SVfit_pt, SVfit_eta, SVfit_phi, SVfit_m);
+    results.momentum_error = LorentzVectorM(SVfit_pt_error, SVfit_eta_error, SVfit_phi_error, SVfit_m_error);
+    results.transverseMass = SVfit_mt;
+    results.transverseMass_error = SVfit_mt_error;
+    return results;
+}
+
+kin_fit::FitResults FitResultsCache::Record::GetKinFitResults() const
+{
+    if(!(flags & HasKinFit))
+        throw exception("KinFit results are not stored in the fit cache record.");
+    kin_fit::FitResults results;
+    results.convergence = kinFit_convergence;
+    results.mass = kinFit_m;
+    results.chi2 = kinFit_chi2;
+    results.probability = kinFit_probability;
+    return results;
+}
+
+void FitResultsCache::Record::Merge(const Record& other)
+{
+    if(other.flags & HasSVfit)
+        SetSVFitResults(other.GetSVFitResults());
+    if(other.flags & HasKinFit)
+        SetKinFitResults(other.GetKinFitResults());
+}
+
+FitResultsCache::Key FitResultsCache::MakeKey(EventInfo& event, UncertaintySource unc_source,
+                                              UncertaintyScale unc_scale) const
+{
+    size_t input_hash = 0;
+    const auto add_momentum = [&](const auto& p4) {
+        boost::hash_combine(input_hash, p4.pt());
+        boost::hash_combine(input_hash, p4.eta());
+        boost::hash_combine(input_hash, p4.phi());
+        boost::hash_combine(input_hash, p4.mass());
+    };
+    // The same accessors are used by the fitters to build their inputs. The leg types are defined by the channel,
+    // which is included in the config hash.
+    for(size_t leg_id = 1; leg_id <= 2; ++leg_id) {
+        add_momentum(event.GetLeg(leg_id).GetMomentum());
+        boost::hash_combine(input_hash, event.GetLeg(leg_id)->decayMode());
+    }
+    boost::hash_combine(input_hash, event.HasBjetPair());
+    if(event.HasBjetPair()) {
+        for(size_t jet_id = 1; jet_id <= 2; ++jet_id) {
+            add_momentum(event.GetBJet(jet_id).GetMomentum());
+            boost::hash_combine(input_hash, event.GetBJet(jet_id)->resolution());
+        }
+    }
+    const auto& met = event.GetMET();
+    add_momentum(met.GetMomentum());
+    const auto& met_cov = met.GetCovMatrix();
+    for(unsigned i = 0; i < 2; ++i) {
+        for(unsigned j = 0; j < 2; ++j)
+            boost::hash_combine(input_hash, met_cov(i, j));
+    }
+
+    Key key;
+    key.run = event->run;
+    key.lumi = event->lumi;
+    key.evt = event->evt;
+    key.unc_source = static_cast<int32_t>(unc_source);
+    key.unc_scale = static_cast<int32_t>(unc_scale);
+    key.input_hash = input_hash;
+    key.config_hash = config_hash;
+    return key;
+}
+
+FitResultsCache::FitResultsCache(const std::string& _file_name, const std::string& fitter_config) :
+    file_name(_file_name), config_hash(0)
+{
+    boost::hash_combine(config_hash, FitterVersion);
+    boost::hash_combine(config_hash, fitter_config);
+    Map();
+}
+
+FitResultsCache::~FitResultsCache()
+{
+    Unmap();
+}
+
+boost::optional<FitResultsCache::Record> FitResultsCache::Find(const Key& key) const
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = new_records.find(key);
+        if(iter != new_records.end())
+            return iter->second;
+    }
+    const Record* record = FindMapped(key);
+    if(record)
+        return *record;
+    return boost::none;
+}
+
+void FitResultsCache::Update(const Record& record)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = new_records.find(record.key);
+    if(iter == new_records.end()) {
+        const Record* stored = FindMapped(record.key);
+        iter = new_records.emplace(record.key, stored ? *stored : record).first;
+    }
+    iter->second.Merge(record);
+}
+
+size_t FitResultsCache::GetNumberOfNewRecords() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return new_records.size();
+}
+
+void FitResultsCache::Save()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(new_records.empty()) return;
+
+    // Both sequences are sorted by key, so they are merged in a single pass. The new records already include the
+    // results stored for the same key.
+    std::vector<Record> records;
+    records.reserve(n_mapped_records + new_records.size());
+    const Record* mapped_end = mapped_records + n_mapped_records;
+    const Record* mapped_iter = mapped_records;
+    auto new_iter = new_records.begin();
+    while(mapped_iter != mapped_end || new_iter != new_records.end()) {
+        if(new_iter == new_records.end() || (mapped_iter != mapped_end && mapped_iter->key < new_iter->first)) {
+            records.push_back(*mapped_iter++);
+        } else {
+            if(mapped_iter != mapped_end && mapped_iter->key == new_iter->first)
+                ++mapped_iter;
+            records.push_back(new_iter->second);
+            ++new_iter;
+        }
+    }
+
+    const std::string tmp_file_name = file_name + ".tmp";
+    {
+        std::ofstream file(tmp_file_name, std::ios::binary | std::ios::trunc);
+        if(!file.is_open())
+            throw exception("Unable to create the fit cache file '%1%'.") % tmp_file_name;
+        FitResultsCacheHeader header;
+        std::memcpy(header.magic, FitResultsCacheHeader::Magic, sizeof(header.magic));
+        header.record_size = sizeof(Record);
+        header.n_records = records.size();
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(records.data()),
+                   static_cast<std::streamsize>(records.size() * sizeof(Record)));
+        if(!file.good())
+            throw exception("Unable to write the fit cache file '%1%'.") % tmp_file_name;
+    }
+    Unmap();
+    boost::filesystem::rename(tmp_file_name, file_name);
+    new_records.clear();
+    Map();
+}
+
+void FitResultsCache::Map()
+{
+    if(!boost::filesystem::exists(file_name)) return;
+    file_descriptor = open(file_name.c_str(), O_RDONLY);
+    if(file_descriptor < 0)
+        throw exception("Unable to open the fit cache file '%1%'.") % file_name;
+    struct stat file_stat;
+    if(fstat(file_descriptor, &file_stat) != 0) {
+        Unmap();
+        throw exception("Unable to read the size of the fit cache file '%1%'.") % file_name;
+    }
+    mapped_size = static_cast<size_t>(file_stat.st_size);
+    if(mapped_size < sizeof(FitResultsCacheHeader)) {
+        Unmap();
+        throw exception("Fit cache file '%1%' is corrupted.") % file_name;
+    }
+    mapped_data = mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+    if(mapped_data == MAP_FAILED) {
+        mapped_data = nullptr;
+        Unmap();
+        throw exception("Unable to map the fit cache file '%1%'.") % file_name;
+    }
+    const auto header = static_cast<const FitResultsCacheHeader*>(mapped_data);
+    if(std::memcmp(header->magic, FitResultsCacheHeader::Magic, sizeof(header->magic)) != 0
+            || header->record_size != sizeof(Record)
+            || mapped_size != sizeof(FitResultsCacheHeader) + header->n_records * sizeof(Record)) {
+        Unmap();
+        throw exception("Fit cache file '%1%' has an incompatible format.") % file_name;
+    }
+    n_mapped_records = header->n_records;
+    mapped_records = reinterpret_cast<const Record*>(static_cast<const char*>(mapped_data)
+                                                     + sizeof(FitResultsCacheHeader));
+}
+
+void FitResultsCache::Unmap()
+{
+    if(mapped_data)
+        munmap(mapped_data, mapped_size);
+    if(file_descriptor >= 0)
+        close(file_descriptor);
+    file_descriptor = -1;
+    mapped_data = nullptr;
+    mapped_size = 0;
+    n_mapped_records = 0;
+    mapped_records = nullptr;
+}
+
+const FitResultsCache::Record* FitResultsCache::FindMapped(const Key& key) const
+{
+    const Record* end = mapped_records + n_mapped_records;
+    const Record* iter = std::lower_bound(mapped_records, end, key, [](const Record& record, const Key& k) {
+        return record.key < k;
+    });
+    if(iter != end && iter->key == key)
+        return iter;
+    return nullptr;
+}
+
+EventFitResults::EventFitResults(EventInfo& _event, bool _allow_calc, FitResultsCache* _cache,
+                                 UncertaintySource unc_source, UncertaintyScale unc_scale) :
+    event(&_event), allow_calc(_allow_calc), cache(_cache)
+{
+    if(UseCache()) {
+        key = cache->MakeKey(*event, unc_source, unc_scale);
+        record = cache->Find(*key);
+    }
+}
+
+EventFitResults& EventFitResults::Resolve(EventFitResults* fit_results, EventInfo& event, bool allow_calc,
+                                          std::unique_ptr<EventFitResults>& holder)
+{
+    if(fit_results)
+        return *fit_results;
+    holder = std::make_unique<EventFitResults>(event, allow_calc, nullptr, UncertaintySource::None,
+                                               UncertaintyScale::Central);
+    return *holder;
+}
+
+EventFitResults::~EventFitResults()
+{
+    // The task may refer to the objects owned by the caller, so it should be completed before they are released.
+    if(prefetched_record.valid())
+        prefetched_record.wait();
+}
+
+void EventFitResults::Prefetch(AsyncFitter& fitter, EventFactory make_event, bool run_svFit, bool run_kinFit)
+{
+    using Record = FitResultsCache::Record;
+    if(!allow_calc || prefetched) return;
+    const bool need_svFit = run_svFit && !(record && (record->flags & Record::HasSVfit));
+    const bool need_kinFit = run_kinFit && event->HasBjetPair() && !(record && (record->flags & Record::HasKinFit));
+    if(!need_svFit && !need_kinFit) return;
+    const FitResultsCache::Key task_key = key ? *key : FitResultsCache::Key();
+    prefetched_record = fitter.Submit([make_event, need_svFit, need_kinFit, task_key]() {
+        const auto fit_event = make_event();
+        if(!fit_event.event)
+            throw exception("Unable to create the event for the asynchronous fit.");
+        Record result;
+        result.key = task_key;
+        if(need_svFit)
+            result.SetSVFitResults(fit_event.event->GetSVFitResults(true));
+        if(need_kinFit)
+            result.SetKinFitResults(fit_event.event->GetKinFitResults(true));
+        return result;
+    });
+    prefetched = true;
+}
+
+const sv_fit_ana::FitResults& EventFitResults::GetSVFitResults()
+{
+    if(!UseRecord())
+        return event->GetSVFitResults(allow_calc);
+    if(!svFit_results) {
+        ResolvePrefetched();
+        if(!record || !(record->flags & FitResultsCache::Record::HasSVfit)) {
+            FitResultsCache::Record new_record;
+            new_record.SetSVFitResults(event->GetSVFitResults(allow_calc));
+            Store(new_record);
+        }
+        svFit_results = record->GetSVFitResults();
+    }
+    return *svFit_results;
+}
+
+const kin_fit::FitResults& EventFitResults::GetKinFitResults()
+{
+    if(!UseRecord())
+        return event->GetKinFitResults(allow_calc);
+    if(!kinFit_results) {
+        ResolvePrefetched();
+        if(!record || !(record->flags & FitResultsCache::Record::HasKinFit)) {
+            FitResultsCache::Record new_record;
+            new_record.SetKinFitResults(event->GetKinFitResults(allow_calc));
+            Store(new_record);
+        }
+        kinFit_results = record->GetKinFitResults();
+    }
+    return *kinFit_results;
+}
+
+boost::optional<LorentzVectorM> EventFitResults::GetHiggsTTMomentum()
+{
+    const auto& results = GetSVFitResults();
+    if(!results.has_valid_momentum)
+        return boost::none;
+    return LorentzVectorM(results.momentum);
+}
+
+void EventFitResults::ResolvePrefetched()
+{
+    if(!prefetched_record.valid()) return;
+    Store(prefetched_record.get());
+}
+
+void EventFitResults::Store(const FitResultsCache::Record& new_record)
+{
+    if(!record) {
+        record = FitResultsCache::Record();
+        if(key)
+            record->key = *key;
+    }
+    record->Merge(new_record);
+    if(UseCache()) {
+        FitResultsCache::Record cache_record = new_record;
+        cache_record.key = *key;
+        cache->Update(cache_record);
+    }
+}
+
+} // namespace analysis
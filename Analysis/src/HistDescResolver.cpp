@@ -0,0 +1,115 @@
+/*! Definition of HistDescResolver, the lookup of histogram descriptors for the event analyzer data.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/HistDescResolver.h"
+
+#include <algorithm>
+
+namespace analysis {
+
+HistDescResolver::HistDescResolver(const HistDescCollection& _descriptors) :
+    descriptors(_descriptors)
+{
+    static const std::string any = "*";
+    for(const auto& [desc_name, desc] : descriptors) {
+        const auto parts = SplitValueList(desc_name, true, "/", false);
+        Pattern pattern;
+        pattern.desc = &desc;
+        if(parts.size() == 1) {
+            pattern.kind = PatternKind::Default;
+        } else if(parts.size() == 2) {
+            pattern.kind = PatternKind::Channel;
+            pattern.channel = parts.at(1);
+        } else if(parts.size() == 3) {
+            pattern.kind = parts.at(1) == any ? PatternKind::Category : PatternKind::ChannelCategory;
+            pattern.channel = parts.at(1);
+            pattern.category = parts.at(2);
+        } else if(parts.size() == 4 && parts.at(2) == any) {
+            pattern.kind = parts.at(1) == any ? PatternKind::SubCategory : PatternKind::ChannelSubCategory;
+            pattern.channel = parts.at(1);
+            pattern.sub_category = parts.at(3);
+        } else if(parts.size() == 4 && parts.at(1) != any) {
+            pattern.kind = PatternKind::ChannelCategorySubCategory;
+            pattern.channel = parts.at(1);
+            pattern.category = parts.at(2);
+            pattern.sub_category = parts.at(3);
+        } else {
+            // Such descriptors can not be selected by any data id.
+            continue;
+        }
+        names[parts.at(0)].patterns.push_back(pattern);
+    }
+    for(auto& name_entry : names) {
+        auto& patterns = name_entry.second.patterns;
+        std::stable_sort(patterns.begin(), patterns.end(),
+                         [](const Pattern& a, const Pattern& b) { return a.kind < b.kind; });
+    }
+}
+
+const HistDescResolver::HistDesc& HistDescResolver::Find(const std::string& h_name, Channel channel,
+                                                         const EventAnalyzerDataId& dataId) const
+{
+    const auto name_iter = names.find(h_name);
+    if(name_iter == names.end())
+        throw exception("Descriptor for histogram '%1%' not found.") % h_name;
+    const NameEntry& entry = name_iter->second;
+
+    // Channel is stored in the bits of the packed id that are not used by the category and the sub-category.
+    static constexpr size_t channel_offset = 32;
+    const PackedDataId packed_id = PackedDataId().Set(dataId.Get<EventCategory>())
+                                                 .Set(dataId.Get<EventSubCategory>());
+    const PackedDataId::Code key = packed_id.GetCode()
+                                   | (static_cast<PackedDataId::Code>(channel) << channel_offset);
+    {
+        std::shared_lock<Mutex> lock(mutex);
+        auto iter = entry.resolved.find(key);
+        if(iter != entry.resolved.end())
+            return *iter->second;
+    }
+    const HistDesc* desc = Match(entry, channel, dataId);
+    if(!desc)
+        throw exception("Descriptor for histogram '%1%' not found.") % h_name;
+    std::unique_lock<Mutex> lock(mutex);
+    entry.resolved[key] = desc;
+    return *desc;
+}
+
+const HistDescResolver::HistDesc* HistDescResolver::Match(const NameEntry& entry, Channel channel,
+                                                          const EventAnalyzerDataId& dataId)
+{
+    const std::string channel_str = ToString(channel);
+    const std::string category_str = ToString(dataId.Get<EventCategory>());
+    const std::string sub_category_str = ToString(dataId.Get<EventSubCategory>());
+    for(const Pattern& pattern : entry.patterns) {
+        bool match = false;
+        switch(pattern.kind) {
+            case PatternKind::ChannelCategorySubCategory:
+                match = pattern.channel == channel_str && pattern.category == category_str
+                        && pattern.sub_category == sub_category_str;
+                break;
+            case PatternKind::ChannelSubCategory:
+                match = pattern.channel == channel_str && pattern.sub_category == sub_category_str;
+                break;
+            case PatternKind::SubCategory:
+                match = pattern.sub_category == sub_category_str;
+                break;
+            case PatternKind::ChannelCategory:
+                match = pattern.channel == channel_str && pattern.category == category_str;
+                break;
+            case PatternKind::Category:
+                match = pattern.category == category_str;
+                break;
+            case PatternKind::Channel:
+                match = pattern.channel == channel_str;
+                break;
+            case PatternKind::Default:
+                match = true;
+                break;
+        }
+        if(match)
+            return pattern.desc;
+    }
+    return nullptr;
+}
+
+} // namespace analysis
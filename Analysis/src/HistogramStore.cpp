@@ -0,0 +1,195 @@
+/*! Definition of HistogramStore, the compact storage of the histograms filled by the event loop.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/HistogramStore.h"
+
+#include <algorithm>
+
+namespace analysis {
+
+HistogramStore::Binning::Binning(const TAxis& axis) :
+    n_bins(static_cast<size_t>(axis.GetNbins())), x_min(axis.GetXmin()), x_max(axis.GetXmax())
+{
+    const TArrayD* bins = axis.GetXbins();
+    if(bins->GetSize())
+        edges.assign(bins->GetArray(), bins->GetArray() + bins->GetSize());
+}
+
+size_t HistogramStore::Binning::FindBin(double x) const
+{
+    if(x < x_min) return 0;
+    if(!(x < x_max)) return n_bins + 1;
+    // The same expression as in TAxis::FindBin, so that the values close to the bin edges are assigned to the
+    // same bins as in the ROOT histograms.
+    if(edges.empty())
+        return static_cast<size_t>(1 + int(n_bins * (x - x_min) / (x_max - x_min)));
+    return static_cast<size_t>(std::upper_bound(edges.begin(), edges.end(), x) - edges.begin());
+}
+
+HistogramStore::Arena::Arena(const Binning& _binning) :
+    binning(&_binning), record_size(GetRecordSize(_binning.GetNumberOfBins())), n_records(0), block_capacity(0),
+    block_used(0), n_allocated(0)
+{
+}
+
+double* HistogramStore::Arena::Allocate()
+{
+    if(block_used == block_capacity) {
+        // Blocks grow with the number of records, up to MaxBlockValues, to keep small arenas small.
+        const size_t max_block_records = std::max(MinBlockRecords, MaxBlockValues / record_size);
+        block_capacity = std::clamp(n_records, MinBlockRecords, max_block_records);
+        blocks.push_back(std::make_unique<double[]>(block_capacity * record_size));
+        n_allocated += block_capacity * record_size;
+        block_used = 0;
+    }
+    double* record = blocks.back().get() + block_used * record_size;
+    ++block_used;
+    ++n_records;
+    return record;
+}
+
+HistogramStore::Histogram::Histogram(const Binning& _binning, double* _data) :
+    binning(&_binning), n_values(_binning.GetNumberOfBins() + 2), data(_data)
+{
+}
+
+void HistogramStore::Histogram::Add(const Histogram& other)
+{
+    if(other.binning != binning)
+        throw exception("HistogramStore: histograms with different binnings can not be added.");
+    for(size_t n = 0; n <= 2 * n_values; ++n)
+        data[n] += other.data[n];
+}
+
+void HistogramStore::Histogram::AddTo(TH1D& hist) const
+{
+    if(static_cast<size_t>(hist.GetNbinsX()) != binning->GetNumberOfBins())
+        throw exception("HistogramStore: inconsistent binning for the histogram '%1%'.") % hist.GetName();
+    if(!hist.GetSumw2N())
+        hist.Sumw2();
+    const double n_entries = hist.GetEntries();
+    for(size_t bin = 0; bin < n_values; ++bin) {
+        const Int_t n = static_cast<Int_t>(bin);
+        hist.SetBinContent(n, hist.GetBinContent(n) + data[bin]);
+        (*hist.GetSumw2())[n] += data[n_values + bin];
+    }
+    hist.SetEntries(n_entries + data[2 * n_values]);
+}
+
+HistogramStore::Replica::Replica(HistogramStore& _store) :
+    store(&_store)
+{
+}
+
+HistogramStore::Histogram& HistogramStore::Replica::Get(const PackedDataId& id, const std::string& hist_name)
+{
+    Histogram& target = store->Get(id, hist_name);
+    auto& arena = arenas[&target.GetBinning()];
+    if(!arena)
+        arena = std::make_unique<Arena>(target.GetBinning());
+    histograms.emplace_back(&target, Histogram(target.GetBinning(), arena->Allocate()));
+    return histograms.back().second;
+}
+
+HistogramStore::BinIndexCache& HistogramStore::Replica::GetBinIndexCache(const Binning& binning)
+{
+    auto iter = bin_index_caches.find(&binning);
+    if(iter == bin_index_caches.end())
+        iter = bin_index_caches.emplace(&binning, BinIndexCache(binning)).first;
+    return iter->second;
+}
+
+void HistogramStore::Replica::Merge()
+{
+    std::lock_guard<Mutex> lock(store->mutex);
+    for(const auto& [target, hist] : histograms)
+        target->Add(hist);
+    histograms.clear();
+    arenas.clear();
+}
+
+HistogramStore::HistogramStore(Channel _channel, HistDescResolverPtr _descriptors) :
+    channel(_channel), descriptors(_descriptors),
+    prototype_file(std::make_shared<TMemFile>("HistogramStore_prototypes", "RECREATE")),
+    prototype_data(prototype_file)
+{
+}
+
+HistogramStore::Histogram& HistogramStore::Get(const PackedDataId& id, const std::string& hist_name)
+{
+    std::lock_guard<Mutex> lock(mutex);
+    auto& id_histograms = histograms[id];
+    auto iter = id_histograms.find(hist_name);
+    if(iter == id_histograms.end()) {
+        const Binning& binning = GetBinning(hist_name, id.Unpack());
+        auto& arena_entry = arenas[ArenaKey(&binning, id.GetElementCode<EventSubCategory>())];
+        if(!arena_entry.arena)
+            arena_entry.arena = std::make_unique<Arena>(binning);
+        ++arena_entry.n_histograms;
+        iter = id_histograms.emplace(hist_name, Histogram(binning, arena_entry.arena->Allocate())).first;
+    }
+    return iter->second;
+}
+
+size_t HistogramStore::GetNumberOfBins(const std::string& hist_name, const DataId& id)
+{
+    std::lock_guard<Mutex> lock(mutex);
+    return GetBinning(hist_name, id).GetNumberOfBins();
+}
+
+std::vector<PackedDataId> HistogramStore::GetIds(const EventSubCategorySet& subCategories) const
+{
+    std::vector<std::pair<DataId, PackedDataId>> selected;
+    {
+        std::lock_guard<Mutex> lock(mutex);
+        for(const auto& entry : histograms) {
+            if(subCategories.count(entry.first.Get<EventSubCategory>()))
+                selected.emplace_back(entry.first.Unpack(), entry.first);
+        }
+    }
+    std::sort(selected.begin(), selected.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+    std::vector<PackedDataId> ids;
+    ids.reserve(selected.size());
+    for(const auto& entry : selected)
+        ids.push_back(entry.second);
+    return ids;
+}
+
+void HistogramStore::Extract(const PackedDataId& id, EventAnalyzerData& anaData)
+{
+    std::lock_guard<Mutex> lock(mutex);
+    auto iter = histograms.find(id);
+    if(iter == histograms.end()) return;
+    for(const auto& [hist_name, hist] : iter->second) {
+        hist.AddTo(anaData.GetHistogram(hist_name)());
+        auto arena_iter = arenas.find(ArenaKey(&hist.GetBinning(), id.GetElementCode<EventSubCategory>()));
+        if(--arena_iter->second.n_histograms == 0)
+            arenas.erase(arena_iter);
+    }
+    histograms.erase(iter);
+}
+
+size_t HistogramStore::GetMemorySize() const
+{
+    std::lock_guard<Mutex> lock(mutex);
+    size_t memory = 0;
+    for(const auto& entry : arenas)
+        memory += entry.second.arena->GetMemorySize();
+    return memory;
+}
+
+const HistogramStore::Binning& HistogramStore::GetBinning(const std::string& hist_name, const DataId& id)
+{
+    const HistDesc& desc = descriptors->Find(hist_name, channel, id);
+    auto& binning = binnings[&desc];
+    if(!binning) {
+        const std::string prototype_name = hist_name + "_" + ToString(prototypes.size());
+        auto prototype = std::make_shared<EventAnalyzerData::Entry>(prototype_name, &prototype_data, desc);
+        binning = std::make_unique<Binning>(*(*prototype)().GetXaxis());
+        prototypes.push_back(prototype);
+    }
+    return *binning;
+}
+
+} // namespace analysis
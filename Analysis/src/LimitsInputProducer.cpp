@@ -73,8 +73,8 @@ void LimitsInputProducer::Produce(const std::string& outputFileNamePrefix, const
         TDirectory* directory = root_ext::GetDirectory(*outputFile, directoryName, true);
         const SampleWP& sampleWP = sampleWorkingPoints.at(metaId.Get<std::string>());
         const auto anaDataId = metaId.Set(eventSubCategory);
-        const auto& anaData = anaDataCollection->Get(anaDataId);
-        auto& hist_entry = anaData.GetEntryEx<TH1D>(eventCategories.at(anaDataId.Get<EventCategory>()));
+        auto& anaData = anaDataCollection->Get(anaDataId);
+        auto& hist_entry = anaData.GetHistogram(eventCategories.at(anaDataId.Get<EventCategory>()));
         std::shared_ptr<TH1D> hist;
         if(hist_entry.GetHistograms().count(""))
             hist = std::make_shared<TH1D>(hist_entry());
@@ -2,6 +2,7 @@
 This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
 #include "hh-bbtautau/Analysis/include/MvaReader.h"
+#include "hh-bbtautau/Analysis/include/FitResultsCache.h"
 
 namespace analysis {
 namespace mva_study{
@@ -34,6 +35,34 @@ double MvaVariablesEvaluation::Evaluate()
 
 std::shared_ptr<TMVA::Reader> MvaVariablesEvaluation::GetReader() { return reader; }
 
+void MvaVariablesEvaluation::SetValueByIndex(size_t index, double value)
+{
+    variable_float.at(index) = static_cast<float>(value);
+}
+
+MvaVariablesRecorder::MvaVariablesRecorder(const VarNameSet& _enabled_vars) :
+    MvaVariables(1, 0, _enabled_vars), position(0)
+{
+}
+
+void MvaVariablesRecorder::SetValue(const std::string& name, double value, char /*type*/)
+{
+    if(position == names.size()) {
+        names.push_back(name);
+        values.push_back(value);
+    } else
+        values.at(position) = value;
+    ++position;
+}
+
+void MvaVariablesRecorder::Record(EventInfo& event, EventFitResults* fit_results)
+{
+    position = 0;
+    AddEvent(event, SampleId(SampleType::Sgn_Res, 0), 0, 1., -1, fit_results);
+    if(position != names.size())
+        throw exception("Inconsistent number of MVA input variables: %1% instead of %2%.") % position % names.size();
+}
+
 LegacyMvaVariables::LegacyMvaVariables(const std::string& _method_name, const std::string& bdt_weights, bool _isLow)
     : method_name(_method_name), isLow(_isLow), reader(new TMVA::Reader)
 {
@@ -56,10 +85,12 @@ LegacyMvaVariables::LegacyMvaVariables(const std::string& _method_name, const st
 }
 
 void LegacyMvaVariables::AddEvent(analysis::EventInfo& eventbase, const SampleId& /*mass*/ , int /* spin*/,
-                                  double /*sample_weight*/, int /*which_test*/)
+                                  double /*sample_weight*/, int /*which_test*/, EventFitResults* fit_results)
 {
+    std::unique_ptr<EventFitResults> event_fit_results;
+    EventFitResults& fits = EventFitResults::Resolve(fit_results, eventbase, false, event_fit_results);
     const auto Htt = eventbase.GetHiggsTTMomentum(false);
-    const auto Htt_sv = eventbase.GetHiggsTTMomentum(true);
+    const auto Htt_sv = fits.GetHiggsTTMomentum();
     const auto& t1 = eventbase.GetLeg(1);
     const auto& t2 = eventbase.GetLeg(2);
 
@@ -86,6 +117,55 @@ double LegacyMvaVariables::Evaluate() { return reader->EvaluateMVA(method_name);
 std::shared_ptr<TMVA::Reader> LegacyMvaVariables::GetReader() { return reader; }
 
 
+struct MvaReader::ReaderSet {
+    enum class InputKind { Regular, Mass, Spin };
+
+    struct Method {
+        VarsPtr vars;
+        MvaVariablesEvaluation* evaluation{nullptr};
+        std::vector<size_t> positions;
+        std::vector<InputKind> kinds;
+        bool has_positions{false};
+    };
+
+    std::unique_ptr<MvaVariablesRecorder> recorder;
+    std::map<MvaKey, Method> methods;
+
+    void SetInputs(Method& method, const MvaKey& key)
+    {
+        const auto& names = recorder->GetNames();
+        const auto& values = recorder->GetValues();
+        if(!method.has_positions) {
+            for(size_t pos = 0; pos < names.size(); ++pos) {
+                if(!method.evaluation->IsEnabled(names.at(pos))) continue;
+                method.positions.push_back(pos);
+                InputKind kind = InputKind::Regular;
+                if(names.at(pos) == "mass")
+                    kind = InputKind::Mass;
+                else if(names.at(pos) == "spin" || names.at(pos) == "kl")
+                    kind = InputKind::Spin;
+                method.kinds.push_back(kind);
+            }
+            method.has_positions = true;
+        }
+        for(size_t n = 0; n < method.positions.size(); ++n) {
+            const size_t pos = method.positions.at(n);
+            double value = values.at(pos);
+            if(method.kinds.at(n) == InputKind::Mass)
+                value = key.mass;
+            else if(method.kinds.at(n) == InputKind::Spin)
+                value = key.spin;
+            if(n < method.evaluation->GetNumberOfVariables())
+                method.evaluation->SetValueByIndex(n, value);
+            else
+                method.evaluation->SetValue(names.at(pos), value, 'F');
+        }
+    }
+};
+
+MvaReader::MvaReader() {}
+MvaReader::~MvaReader() {}
+
 bool MvaReader::MvaKey::operator<(const MvaKey& other) const
 {
     if(method_name != other.method_name) return method_name < other.method_name;
@@ -100,15 +180,106 @@ MvaReader::VarsPtr MvaReader::Add(const MvaKey& key, const std::string& bdt_weig
         throw exception("MVA method with (name, mass, spin) = '%1%, %2%, %3%' already exists.")
             % key.method_name % key.mass % key.spin;
 
+    std::lock_guard<std::mutex> lock(mutex);
+    descriptors[key] = MethodDescriptor{bdt_weights, enabled_vars, is_legacy, is_Low};
+    free_reader_sets.clear();
     return methods[key] = CreateMvaVariables(key.method_name, bdt_weights, enabled_vars, is_legacy, is_Low);
 }
 
-double MvaReader::Evaluate(const MvaKey& key, EventInfo* event)
+double MvaReader::Evaluate(const MvaKey& key, EventInfo* event, EventFitResults* fit_results)
 {
     auto iter = methods.find(key);
     if(iter == methods.end())
         throw exception("Method '%1%' not found.") % key.method_name;
-    return iter->second->AddAndEvaluate(*event, SampleId(SampleType::Sgn_Res, key.mass), key.spin);
+    return iter->second->AddAndEvaluate(*event, SampleId(SampleType::Sgn_Res, key.mass), key.spin, 1., -1,
+                                        fit_results);
+}
+
+MvaReader::ScoreMatrix MvaReader::EvaluateBlock(const std::vector<EventInfo*>& events,
+                                                const std::vector<MvaKey>& keys,
+                                                const std::vector<EventFitResults*>& fit_results)
+{
+    if(!fit_results.empty() && fit_results.size() != events.size())
+        throw exception("Inconsistent number of events and fit results.");
+    auto reader_set = AcquireReaderSet();
+    std::vector<ReaderSet::Method*> key_methods;
+    bool record_inputs = false;
+    for(const auto& key : keys) {
+        auto iter = reader_set->methods.find(key);
+        if(iter == reader_set->methods.end())
+            throw exception("Method '%1%' not found.") % key.method_name;
+        key_methods.push_back(&iter->second);
+        record_inputs = record_inputs || iter->second.evaluation;
+    }
+
+    ScoreMatrix scores(events.size(), std::vector<double>(keys.size()));
+    for(size_t n = 0; n < events.size(); ++n) {
+        EventInfo& event = *events.at(n);
+        EventFitResults* event_fit_results = fit_results.empty() ? nullptr : fit_results.at(n);
+        if(record_inputs)
+            reader_set->recorder->Record(event, event_fit_results);
+        for(size_t k = 0; k < keys.size(); ++k) {
+            const MvaKey& key = keys.at(k);
+            auto& method = *key_methods.at(k);
+            if(method.evaluation) {
+                reader_set->SetInputs(method, key);
+                scores.at(n).at(k) = method.evaluation->Evaluate();
+            } else {
+                method.vars->AddEvent(event, SampleId(SampleType::Sgn_Res, key.mass), key.spin, 1., -1,
+                                      event_fit_results);
+                scores.at(n).at(k) = method.vars->Evaluate();
+            }
+        }
+    }
+    ReleaseReaderSet(std::move(reader_set));
+    return scores;
+}
+
+std::vector<double> MvaReader::EvaluateAll(EventInfo& event, const std::vector<MvaKey>& keys,
+                                           EventFitResults* fit_results)
+{
+    return EvaluateBlock({ &event }, keys, { fit_results }).at(0);
+}
+
+std::vector<MvaReader::MvaKey> MvaReader::GetKeys() const
+{
+    std::vector<MvaKey> keys;
+    for(const auto& method : methods)
+        keys.push_back(method.first);
+    return keys;
+}
+
+MvaReader::ReaderSetPtr MvaReader::AcquireReaderSet()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!free_reader_sets.empty()) {
+        auto reader_set = std::move(free_reader_sets.back());
+        free_reader_sets.pop_back();
+        return reader_set;
+    }
+
+    auto reader_set = std::make_unique<ReaderSet>();
+    std::unordered_set<std::string> recorded_vars;
+    bool record_all = false;
+    for(const auto& [key, desc] : descriptors) {
+        auto& method = reader_set->methods[key];
+        method.vars = CreateMvaVariables(key.method_name, desc.bdt_weights, desc.enabled_vars, desc.is_legacy,
+                                         desc.is_Low);
+        if(desc.is_legacy) continue;
+        method.evaluation = dynamic_cast<MvaVariablesEvaluation*>(method.vars.get());
+        record_all = record_all || desc.enabled_vars.empty();
+        recorded_vars.insert(desc.enabled_vars.begin(), desc.enabled_vars.end());
+    }
+    if(record_all)
+        recorded_vars.clear();
+    reader_set->recorder = std::make_unique<MvaVariablesRecorder>(recorded_vars);
+    return reader_set;
+}
+
+void MvaReader::ReleaseReaderSet(ReaderSetPtr&& reader_set)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    free_reader_sets.push_back(std::move(reader_set));
 }
 
 MvaReader::VarsPtr MvaReader::CreateMvaVariables(const std::string& method_name, const std::string&  bdt_weights,
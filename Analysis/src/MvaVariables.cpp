@@ -2,6 +2,7 @@
 This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
 
 #include "hh-bbtautau/Analysis/include/MvaVariables.h"
+#include "hh-bbtautau/Analysis/include/FitResultsCache.h"
 
 namespace analysis {
 namespace mva_study{
@@ -81,10 +82,10 @@ std::istream& operator>>(std::istream& is, SampleId& id)
 
 double MvaVariablesBase::Evaluate() { throw exception("Not supported."); }
 double MvaVariablesBase::AddAndEvaluate(EventInfo& eventbase, const SampleId& mass, int spin,
-                                        double sample_weight, int which_test)
+                                        double sample_weight, int which_test, EventFitResults* fit_results)
 {
     Lock lock(mutex);
-    AddEvent(eventbase, mass, spin, sample_weight, which_test);
+    AddEvent(eventbase, mass, spin, sample_weight, which_test, fit_results);
     return Evaluate();
 }
 
@@ -109,13 +110,15 @@ bool MvaVariables::IsEnabled(const std::string& name) const
 }
 
 void MvaVariables::AddEvent(analysis::EventInfo& eventbase, const SampleId& mass, int spin, double sample_weight,
-                            int which_test)
+                            int which_test, EventFitResults* fit_results)
 {
     using namespace ROOT::Math::VectorUtil;
     static constexpr double default_value = -999.;
 
     const auto Htt = *eventbase.GetHiggsTTMomentum(false);
-    const auto Htt_sv = eventbase.GetHiggsTTMomentum(true);
+    std::unique_ptr<EventFitResults> event_fit_results;
+    EventFitResults& fits = EventFitResults::Resolve(fit_results, eventbase, false, event_fit_results);
+    const auto Htt_sv = fits.GetHiggsTTMomentum();
     const auto& t1 = eventbase.GetLeg(1).GetMomentum();
     const auto& t2 = eventbase.GetLeg(2).GetMomentum();
 
@@ -124,8 +127,10 @@ void MvaVariables::AddEvent(analysis::EventInfo& eventbase, const SampleId& mass
     const auto& b2 = eventbase.GetHiggsBB().GetSecondDaughter().GetMomentum();
 
     const auto& met = eventbase.GetMET().GetMomentum();
-    const bool SVfit_is_valid = eventbase.GetSVFitResults().has_valid_momentum;
-    const auto& kinfit_results = eventbase.GetKinFitResults();
+    const bool SVfit_is_valid = fits.GetSVFitResults().has_valid_momentum;
+    const auto& kinfit_results = fits.GetKinFitResults();
+    // The resonance momentum with SVfit is built from the same SVfit results as the other variables.
+    const LorentzVectorM resonance_sv = SVfit_is_valid ? LorentzVectorM(Hbb + *Htt_sv) : LorentzVectorM();
     const bool kinfit_is_valid = kinfit_results.HasValidMass();
 
     VAR_INT("decayMode_1", eventbase.GetLeg(1)->decayMode());
@@ -254,7 +259,7 @@ void MvaVariables::AddEvent(analysis::EventInfo& eventbase, const SampleId& mass
     VAR("costheta_hbbhh",
             four_bodies::Calculate_cosTheta_2bodies(Hbb, *eventbase.GetResonanceMomentum(false,false)));
     VAR("costheta_hbbhh_sv", SVfit_is_valid
-            ? four_bodies::Calculate_cosTheta_2bodies(Hbb, *eventbase.GetResonanceMomentum(true,false))
+            ? four_bodies::Calculate_cosTheta_2bodies(Hbb, resonance_sv)
             : default_value);
     VAR("costheta_hbbhhMET",
             four_bodies::Calculate_cosTheta_2bodies(Hbb, *eventbase.GetResonanceMomentum(false,true)));
@@ -262,7 +267,7 @@ void MvaVariables::AddEvent(analysis::EventInfo& eventbase, const SampleId& mass
     VAR("costheta_htautauhh",
             four_bodies::Calculate_cosTheta_2bodies(Htt+met, *eventbase.GetResonanceMomentum(false,false)));
     VAR("costheta_htautauhh_sv", SVfit_is_valid
-            ? four_bodies::Calculate_cosTheta_2bodies(Htt+met, *eventbase.GetResonanceMomentum(true,false))
+            ? four_bodies::Calculate_cosTheta_2bodies(Htt+met, resonance_sv)
             : default_value);
     VAR("costheta_htautauhhMET",
             four_bodies::Calculate_cosTheta_2bodies(Htt+met, *eventbase.GetResonanceMomentum(false,true)));
@@ -270,7 +275,7 @@ void MvaVariables::AddEvent(analysis::EventInfo& eventbase, const SampleId& mass
             ? four_bodies::Calculate_cosTheta_2bodies(*Htt_sv, *eventbase.GetResonanceMomentum(false,false))
             : default_value);
     VAR("costheta_htautau_svhh_sv", SVfit_is_valid
-            ? four_bodies::Calculate_cosTheta_2bodies(*Htt_sv, *eventbase.GetResonanceMomentum(true,false))
+            ? four_bodies::Calculate_cosTheta_2bodies(*Htt_sv, resonance_sv)
             : default_value);
     VAR("costheta_htautau_svhhMET", SVfit_is_valid
             ? four_bodies::Calculate_cosTheta_2bodies(*Htt_sv, *eventbase.GetResonanceMomentum(false,true))
@@ -279,7 +284,7 @@ void MvaVariables::AddEvent(analysis::EventInfo& eventbase, const SampleId& mass
     VAR("costheta_l1l2METhh",
             four_bodies::Calculate_cosTheta_2bodies(t1+t2+met, *eventbase.GetResonanceMomentum(false,false)));
     VAR("costheta_l1l2METhh_sv", SVfit_is_valid
-            ? four_bodies::Calculate_cosTheta_2bodies(t1+t2+met, *eventbase.GetResonanceMomentum(true,false))
+            ? four_bodies::Calculate_cosTheta_2bodies(t1+t2+met, resonance_sv)
             : default_value);
     VAR("costheta_l1l2METhhMET",
             four_bodies::Calculate_cosTheta_2bodies(t1+t2+met, *eventbase.GetResonanceMomentum(false,true)));
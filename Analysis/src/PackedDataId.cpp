@@ -0,0 +1,43 @@
+/*! Definition of PackedDataId, the packed 64-bit representation of EventAnalyzerDataId.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/PackedDataId.h"
+
+namespace analysis {
+
+PackedDataId::PackedDataId(const EventAnalyzerDataId& id) : code(0)
+{
+    PackElement<EventCategory>(id);
+    PackElement<EventSubCategory>(id);
+    PackElement<EventRegion>(id);
+    PackElement<UncertaintySource>(id);
+    PackElement<UncertaintyScale>(id);
+    PackElement<Dataset>(id);
+}
+
+PackedDataId PackedDataId::FromCode(Code code)
+{
+    PackedDataId id;
+    id.code = code;
+    return id;
+}
+
+EventAnalyzerDataId PackedDataId::Unpack() const
+{
+    EventAnalyzerDataId id;
+    UnpackElement<EventCategory>(id);
+    UnpackElement<EventSubCategory>(id);
+    UnpackElement<EventRegion>(id);
+    UnpackElement<UncertaintySource>(id);
+    UnpackElement<UncertaintyScale>(id);
+    UnpackElement<Dataset>(id);
+    return id;
+}
+
+std::ostream& operator<<(std::ostream& s, const PackedDataId& id)
+{
+    s << id.Unpack();
+    return s;
+}
+
+} // namespace analysis
@@ -29,6 +29,16 @@ void AnalyzerSetup::CreateLimitSetups()
     }
 }
 
+void AnalyzerSetup::CreateUncVariables()
+{
+    for(const auto& item : unc_variables_raw) {
+        const UncertaintyScale scale = ::analysis::Parse<UncertaintyScale>(item.first);
+        if(scale == UncertaintyScale::Central)
+            throw exception("Variables of the central uncertainty scale can not be restricted by unc_variables.");
+        unc_variables[scale].insert(item.second.begin(), item.second.end());
+    }
+}
+
 void AnalyzerSetup::ConvertToEventRegion()
 {
     qcd_shape = analysis::Parse<analysis::EventRegion>(qcd_shape_str);
@@ -39,9 +39,11 @@ void AnalyzerConfigEntryReader::EndEntry()
     CheckReadParamCounts("unc_cfg", 1, Condition::less_equal);
     CheckReadParamCounts("jet_ordering", 1, Condition::less_equal);
     CheckReadParamCounts("limit_setup", 0, Condition::greater_equal);
+    CheckReadParamCounts("unc_variables", 0, Condition::greater_equal);
     CheckReadParamCounts("qcd_ss_os_sf",1,Condition::less_equal);
     CheckReadParamCounts("qcd_ss_os_err",1, Condition::less_equal);
     current.CreateLimitSetups();
+    current.CreateUncVariables();
     ConfigEntryReaderT<AnalyzerSetup>::EndEntry();
 }
 
@@ -81,6 +83,7 @@ void AnalyzerConfigEntryReader::ReadParameter(const std::string& /*param_name*/,
     ParseEntry("unc_cfg", current.unc_cfg);
     ParseEntry("jet_ordering", current.jet_ordering);
     ParseMappedEntryList("limit_setup", current.limit_setup_raw,false);
+    ParseMappedEntryList("unc_variables", current.unc_variables_raw, false);
     ParseEntry("qcd_ss_os_sf",current.qcd_ss_os_sf);
     ParseEntry("qcd_ss_os_err",current.qcd_ss_os_err);
 }
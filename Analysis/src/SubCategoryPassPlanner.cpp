@@ -0,0 +1,109 @@
+/*! Definition of SubCategoryPassPlanner, the grouping of sub-categories into the processing passes.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/SubCategoryPassPlanner.h"
+
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+
+namespace analysis {
+
+SubCategoryPassPlanner::SubCategoryPassPlanner(size_t _n_parallel, size_t _memory_budget) :
+    n_parallel(_n_parallel), memory_budget(_memory_budget)
+{
+    if(!n_parallel && !memory_budget)
+        throw exception("SubCategoryPassPlanner: either the number of sub-categories per pass or the memory budget"
+                        " should be set.");
+}
+
+size_t SubCategoryPassPlanner::GetHistogramMemorySize(size_t n_bins)
+{
+    return HistogramOverhead + 2 * (n_bins + 2) * sizeof(double);
+}
+
+void SubCategoryPassPlanner::AddSubCategory(const EventSubCategory& subCategory, size_t memory_estimate)
+{
+    subCategories.push_back(subCategory);
+    memory_estimates.push_back(memory_estimate);
+}
+
+std::vector<SubCategoryPassPlanner::Pass> SubCategoryPassPlanner::Plan() const
+{
+    std::vector<Pass> passes;
+    if(!HasMemoryBudget()) {
+        for(size_t n = 0; n < subCategories.size(); ++n) {
+            if(n % n_parallel == 0)
+                passes.emplace_back();
+            passes.back().subCategories.push_back(subCategories.at(n));
+            passes.back().memory_estimate += memory_estimates.at(n);
+        }
+        return passes;
+    }
+
+    std::vector<size_t> order(subCategories.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) { return memory_estimates.at(a) > memory_estimates.at(b); });
+
+    std::vector<std::vector<size_t>> pass_indices;
+    for(size_t index : order) {
+        const size_t memory = memory_estimates.at(index);
+        size_t pass_id = 0;
+        while(pass_id < passes.size() && passes.at(pass_id).memory_estimate + memory > memory_budget)
+            ++pass_id;
+        if(pass_id == passes.size()) {
+            passes.emplace_back();
+            pass_indices.emplace_back();
+        }
+        passes.at(pass_id).memory_estimate += memory;
+        pass_indices.at(pass_id).push_back(index);
+    }
+
+    // The original order of the sub-categories is restored within each pass and between the passes.
+    for(size_t pass_id = 0; pass_id < passes.size(); ++pass_id) {
+        auto& indices = pass_indices.at(pass_id);
+        std::sort(indices.begin(), indices.end());
+        for(size_t index : indices)
+            passes.at(pass_id).subCategories.push_back(subCategories.at(index));
+    }
+    std::vector<size_t> pass_order(passes.size());
+    std::iota(pass_order.begin(), pass_order.end(), 0);
+    std::sort(pass_order.begin(), pass_order.end(),
+              [&](size_t a, size_t b) { return pass_indices.at(a).front() < pass_indices.at(b).front(); });
+    std::vector<Pass> ordered_passes;
+    for(size_t pass_id : pass_order)
+        ordered_passes.push_back(passes.at(pass_id));
+    return ordered_passes;
+}
+
+namespace {
+size_t ReadProcessStatus(const std::string& field)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    const std::string prefix = field + ":";
+    while(std::getline(status, line)) {
+        if(line.compare(0, prefix.size(), prefix) != 0) continue;
+        std::istringstream ss(line.substr(prefix.size()));
+        size_t value_kb = 0;
+        ss >> value_kb;
+        return value_kb * 1024;
+    }
+    return 0;
+}
+} // anonymous namespace
+
+size_t ProcessMemoryUsage::GetRss() { return ReadProcessStatus("VmRSS"); }
+size_t ProcessMemoryUsage::GetPeakRss() { return ReadProcessStatus("VmHWM"); }
+
+bool ProcessMemoryUsage::ResetPeakRss()
+{
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if(!clear_refs.is_open()) return false;
+    clear_refs << "5";
+    return static_cast<bool>(clear_refs.flush());
+}
+
+} // namespace analysis
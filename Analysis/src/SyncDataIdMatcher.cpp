@@ -0,0 +1,100 @@
+/*! Definition of SyncDataIdMatcher class, the matcher of data ids against the patterns of the sync descriptors.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include "hh-bbtautau/Analysis/include/SyncDataIdMatcher.h"
+
+namespace analysis {
+
+namespace {
+// Checks that each separator of the pattern is a mandatory literal character outside of any group, character class
+// or repetition, and that no element pattern can look beyond its own element (backreferences, lookarounds and
+// anchors in the middle of the pattern). The check is conservative: ambiguous constructs are rejected.
+bool IsSeparablePattern(const std::string& pattern)
+{
+    static const std::string escapes_beyond_element = "/0123456789AzZGgk";
+    static const std::string quantifiers = "?*+{";
+    static const std::string lookarounds = "=!<";
+    size_t depth = 0;
+    bool in_class = false;
+    for(size_t n = 0; n < pattern.size(); ++n) {
+        const char c = pattern.at(n);
+        const char next = n + 1 < pattern.size() ? pattern.at(n + 1) : '\0';
+        if(c == '\\') {
+            if(!next || escapes_beyond_element.find(next) != std::string::npos) return false;
+            ++n;
+        } else if(in_class) {
+            if(c == '/' || c == '[') return false;
+            if(c == ']') in_class = false;
+        } else if(c == '[') {
+            in_class = true;
+            if(next == '^') ++n;
+            if(n + 1 < pattern.size() && pattern.at(n + 1) == ']') ++n;
+        } else if(c == '(') {
+            if(next == '?' && n + 2 < pattern.size() && lookarounds.find(pattern.at(n + 2)) != std::string::npos)
+                return false;
+            ++depth;
+        } else if(c == ')') {
+            if(!depth) return false;
+            --depth;
+        } else if(c == '|') {
+            if(!depth) return false;
+        } else if(c == '^') {
+            if(n != 0) return false;
+        } else if(c == '$') {
+            if(n + 1 != pattern.size()) return false;
+        } else if(c == '/') {
+            if(depth || quantifiers.find(next) != std::string::npos) return false;
+        }
+    }
+    return !depth && !in_class;
+}
+} // anonymous namespace
+
+SyncDataIdMatcher::SyncDataIdMatcher(const std::string& _pattern, const DataIdUniverse& universe) :
+    pattern(_pattern), is_precompiled(false), is_expanded(false)
+{
+    // The full name of a data id has exactly TupleSize - 1 separators and none of its elements contains the
+    // separator. Therefore, a separable pattern (see IsSeparablePattern) that has the same number of separators
+    // matches the full name if and only if each sub-pattern matches the corresponding element: the separators of
+    // the pattern consume all separators of the name, and no sub-pattern can match across an element boundary.
+    const auto element_patterns = IsSeparablePattern(pattern) ? SplitValueList(pattern, true, "/", false)
+                                                              : std::vector<std::string>();
+    if(element_patterns.size() == EventAnalyzerDataId::TupleSize) {
+        try {
+            std::vector<PackedDataId> ids = { PackedDataId() };
+            is_expanded = true;
+            AddElement<EventCategory>(Expand(element_patterns.at(0), universe.categories), ids);
+            AddElement<EventSubCategory>(Expand(element_patterns.at(1), universe.sub_categories), ids);
+            AddElement<EventRegion>(Expand(element_patterns.at(2), universe.regions), ids);
+            AddElement<UncertaintySource>(Expand(element_patterns.at(3), universe.unc_sources), ids);
+            AddElement<UncertaintyScale>(Expand(element_patterns.at(4), universe.unc_scales), ids);
+            AddElement<Dataset>(Expand(element_patterns.at(5), universe.datasets), ids);
+            is_precompiled = true;
+            if(is_expanded)
+                allowed_ids.insert(ids.begin(), ids.end());
+        } catch(boost::regex_error&) {
+            is_expanded = false;
+            allowed_codes.clear();
+        }
+    }
+    if(!is_precompiled)
+        regex = std::make_shared<boost::regex>(pattern);
+}
+
+bool SyncDataIdMatcher::Match(const PackedDataId& id) const
+{
+    if(is_expanded)
+        return allowed_ids.count(id);
+    if(is_precompiled) {
+        return IsAllowed<EventCategory>(id, 0) && IsAllowed<EventSubCategory>(id, 1)
+            && IsAllowed<EventRegion>(id, 2) && IsAllowed<UncertaintySource>(id, 3)
+            && IsAllowed<UncertaintyScale>(id, 4) && IsAllowed<Dataset>(id, 5);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = match_cache.find(id);
+    if(iter == match_cache.end())
+        iter = match_cache.emplace(id, boost::regex_match(id.Unpack().GetName(), *regex)).first;
+    return iter->second;
+}
+
+} // namespace analysis
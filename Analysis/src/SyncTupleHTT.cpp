@@ -11,6 +11,7 @@ namespace htt_sync {
 void FillSyncTuple(analysis::EventInfo& event, htt_sync::SyncTuple& sync, analysis::Period run_period,
                    bool apply_svFit, double weight, double lepton_id, double lepton_trigger,
                    double btag_weight, double shape_weight, double jet_pu_id_weight,
+                   analysis::EventFitResults* fit_results,
                    analysis::mva_study::MvaReader* mva_reader,
                    analysis::EventInfo* event_tau_up,
                    analysis::EventInfo* event_tau_down,
@@ -24,6 +25,10 @@ void FillSyncTuple(analysis::EventInfo& event, htt_sync::SyncTuple& sync, analys
     using DiscriminatorWP = analysis::DiscriminatorWP;
     using LegType = analysis::LegType;
 
+    std::unique_ptr<analysis::EventFitResults> event_fit_results;
+    analysis::EventFitResults& fits = analysis::EventFitResults::Resolve(fit_results, event, true,
+                                                                         event_fit_results);
+
     std::vector<const analysis::JetCandidate*> jets_pt20, jets_pt30;
    size_t index_leg_1 = 0;
    size_t index_leg_2 = 0;
@@ -107,12 +112,12 @@ void FillSyncTuple(analysis::EventInfo& event, htt_sync::SyncTuple& sync, analys
 
     sync().pt_tt = static_cast<float>((event.GetLeg(1).GetMomentum() + event.GetLeg(2).GetMomentum() + event.GetMET().GetMomentum()).Pt());
     sync().m_vis = static_cast<float>((event.GetLeg(1).GetMomentum() + event.GetLeg(2).GetMomentum()).M());
-    sync().m_sv = COND_VAL(apply_svFit, event.GetSVFitResults(true).momentum.M());
+    sync().m_sv = COND_VAL(apply_svFit, fits.GetSVFitResults().momentum.M());
     sync().m_sv_tau_ES_up = COND_VAL(event_tau_up && apply_svFit, event_tau_up->GetSVFitResults().momentum.M());
     sync().m_sv_tau_ES_down = COND_VAL(event_tau_down && apply_svFit, event_tau_down->GetSVFitResults().momentum.M());
     sync().m_sv_jet_ES_up = COND_VAL(event_jet_up && apply_svFit, event_jet_up->GetSVFitResults().momentum.M());
     sync().m_sv_jet_ES_down = COND_VAL(event_jet_down && apply_svFit, event_jet_down->GetSVFitResults().momentum.M());
-    sync().mt_sv = COND_VAL(apply_svFit, event.GetSVFitResults().transverseMass);
+    sync().mt_sv = COND_VAL(apply_svFit, fits.GetSVFitResults().transverseMass);
 
     sync().met = static_cast<float>(event.GetMET().GetMomentum().Pt());
     sync().met_tau_ES_up = COND_VAL(event_tau_up, event_tau_up->GetMET().GetMomentum().Pt());
@@ -202,9 +207,9 @@ void FillSyncTuple(analysis::EventInfo& event, htt_sync::SyncTuple& sync, analys
     sync().bjet_hh_btag_1 = COND_VAL(event.HasBjetPair(), event.GetBJet(1)->hh_btag());
     sync().bjet_hh_btag_2 = COND_VAL(event.HasBjetPair(), event.GetBJet(2)->hh_btag());
 
-    sync().kinfit_convergence = COND_VAL_INT(event.HasBjetPair() , event.GetKinFitResults(true).convergence);
-    sync().m_kinfit = COND_VAL(event.HasBjetPair() && event.GetKinFitResults(true).HasValidMass(),
-                               event.GetKinFitResults(true).mass);
+    sync().kinfit_convergence = COND_VAL_INT(event.HasBjetPair() , fits.GetKinFitResults().convergence);
+    sync().m_kinfit = COND_VAL(event.HasBjetPair() && fits.GetKinFitResults().HasValidMass(),
+                               fits.GetKinFitResults().mass);
     sync().m_kinfit_tau_ES_up = COND_VAL(event_tau_up && event_tau_up->HasBjetPair() &&
                                          event_tau_up->GetKinFitResults(true).HasValidMass(),
                                          event_tau_up->GetKinFitResults(true).mass);
@@ -219,10 +224,10 @@ void FillSyncTuple(analysis::EventInfo& event, htt_sync::SyncTuple& sync, analys
                                            event_jet_down->GetKinFitResults(true).mass);
 
 
-    sync().mva_score_nonRes_kl1 = COND_VAL(mva_reader, mva_reader->Evaluate(analysis::mva_study::MvaReader::MvaKey{"mva_smANkin_BSMklscan", 125, 1}, &event));
-    sync().mva_score_lm_320 = COND_VAL(mva_reader, mva_reader->Evaluate(analysis::mva_study::MvaReader::MvaKey{"mva_lmANkin", 320, 0}, &event));
-    sync().mva_score_mm_400 = COND_VAL(mva_reader, mva_reader->Evaluate(analysis::mva_study::MvaReader::MvaKey{"mva_mmANkin", 400, 0}, &event));
-    sync().mva_score_hm_650 = COND_VAL(mva_reader, mva_reader->Evaluate(analysis::mva_study::MvaReader::MvaKey{"mva_hmANkin", 650, 0}, &event));
+    sync().mva_score_nonRes_kl1 = COND_VAL(mva_reader, mva_reader->Evaluate(analysis::mva_study::MvaReader::MvaKey{"mva_smANkin_BSMklscan", 125, 1}, &event, &fits));
+    sync().mva_score_lm_320 = COND_VAL(mva_reader, mva_reader->Evaluate(analysis::mva_study::MvaReader::MvaKey{"mva_lmANkin", 320, 0}, &event, &fits));
+    sync().mva_score_mm_400 = COND_VAL(mva_reader, mva_reader->Evaluate(analysis::mva_study::MvaReader::MvaKey{"mva_mmANkin", 400, 0}, &event, &fits));
+    sync().mva_score_hm_650 = COND_VAL(mva_reader, mva_reader->Evaluate(analysis::mva_study::MvaReader::MvaKey{"mva_hmANkin", 650, 0}, &event, &fits));
 
     sync().deltaR_ll = static_cast<float>(ROOT::Math::VectorUtil::DeltaR(event.GetLeg(1).GetMomentum(), event.GetLeg(2).GetMomentum()));
 
@@ -291,23 +296,24 @@ void FillSyncTuple(analysis::EventInfo& event, htt_sync::SyncTuple& sync, analys
         const auto& b2 = event.GetHiggsBB().GetSecondDaughter().GetMomentum();
 
         const auto& met = event.GetMET().GetMomentum();
-        const bool fill_sv = apply_svFit && event.GetSVFitResults().has_valid_momentum;
+        const bool fill_sv = apply_svFit && fits.GetSVFitResults().has_valid_momentum;
+        const auto Htt_sv = fill_sv ? fits.GetHiggsTTMomentum() : boost::optional<analysis::LorentzVectorM>();
 
         sync().pt_hbb = Hbb.Pt();
         //sync().pt_l1l2 = (t1+t2).Pt();
         sync().pt_l1l2 = Htt.Pt();
         sync().pt_htautau = (Htt+met).Pt();
-        sync().pt_htautau_sv = COND_VAL(fill_sv, event.GetHiggsTTMomentum(true)->Pt());
+        sync().pt_htautau_sv = COND_VAL(fill_sv, Htt_sv->Pt());
         sync().p_zeta = analysis::Calculate_Pzeta(t1, t2,  met);
         sync().p_zetavisible = analysis::Calculate_visiblePzeta(t1, t2);
         sync().dphi_l1l2 = ROOT::Math::VectorUtil::DeltaPhi(t1, t2);
         sync().abs_dphi_b1b2 = std::abs(ROOT::Math::VectorUtil::DeltaPhi(b1, b2));
         sync().dphi_b1b2 = ROOT::Math::VectorUtil::DeltaPhi(b1, b2);
         sync().dphi_l1MET = ROOT::Math::VectorUtil::DeltaPhi(t1, met);
-        sync().abs_dphi_METhtautau_sv = COND_VAL(fill_sv, std::abs(ROOT::Math::VectorUtil::DeltaPhi(*event.GetHiggsTTMomentum(true), met)));
-        sync().dphi_METhtautau_sv = COND_VAL(fill_sv, ROOT::Math::VectorUtil::DeltaPhi(*event.GetHiggsTTMomentum(true), met));
+        sync().abs_dphi_METhtautau_sv = COND_VAL(fill_sv, std::abs(ROOT::Math::VectorUtil::DeltaPhi(*Htt_sv, met)));
+        sync().dphi_METhtautau_sv = COND_VAL(fill_sv, ROOT::Math::VectorUtil::DeltaPhi(*Htt_sv, met));
         sync().dphi_hbbMET = ROOT::Math::VectorUtil::DeltaPhi(Hbb, met);
-        sync().abs_dphi_hbbhatutau_sv = COND_VAL(fill_sv, std::abs(ROOT::Math::VectorUtil::DeltaPhi(Hbb, *event.GetHiggsTTMomentum(true))));
+        sync().abs_dphi_hbbhatutau_sv = COND_VAL(fill_sv, std::abs(ROOT::Math::VectorUtil::DeltaPhi(Hbb, *Htt_sv)));
         sync().abs_deta_b1b2 = std::abs(b1.eta() - b2.eta());
         sync().abs_deta_l2MET = std::abs(t2.eta()-met.eta());
         sync().abs_deta_hbbMET = std::abs(Hbb.eta()-met.eta());
@@ -315,25 +321,25 @@ void FillSyncTuple(analysis::EventInfo& event, htt_sync::SyncTuple& sync, analys
         sync().dR_hbbMET = ROOT::Math::VectorUtil::DeltaR(Hbb, met);
         sync().dR_hbbhtautau = ROOT::Math::VectorUtil::DeltaR(Hbb, Htt+met);
         sync().dR_l1l2Pt_htautau = ROOT::Math::VectorUtil::DeltaR(t1, t2)*(Htt+met).Pt();
-        sync().dR_l1l2Pt_htautau_sv = COND_VAL(fill_sv, ROOT::Math::VectorUtil::DeltaR(t1, t2)*event.GetHiggsTTMomentum(true)->Pt());
+        sync().dR_l1l2Pt_htautau_sv = COND_VAL(fill_sv, ROOT::Math::VectorUtil::DeltaR(t1, t2)*Htt_sv->Pt());
         sync().MT_l1 = analysis::Calculate_MT(t1,met);
         sync().MT_htautau = analysis::Calculate_MT(Htt+met, met);
-        sync().MT_htautau_sv = COND_VAL(fill_sv, analysis::Calculate_MT(*event.GetHiggsTTMomentum(true), met));
+        sync().MT_htautau_sv = COND_VAL(fill_sv, analysis::Calculate_MT(*Htt_sv, met));
         sync().MT_tot = analysis::Calculate_TotalMT(t1, t2,met);
         sync().MT2 = event.GetMT2();
         sync().mass_top1 = analysis::four_bodies::Calculate_topPairMasses(t1, t2, b1, b2, met).first;
         sync().mass_X = analysis::four_bodies::Calculate_MX(t1, t2, b1, b2, met);
         sync().mass_H = InvariantMass(Hbb, Htt+met);
-        sync().mass_H_sv = COND_VAL(fill_sv, InvariantMass(Hbb, *event.GetHiggsTTMomentum(true)));
+        sync().mass_H_sv = COND_VAL(fill_sv, InvariantMass(Hbb, *Htt_sv));
         sync().mass_H_vis = InvariantMass(Hbb, t1+t2);
-        sync().mass_H_kinfit_chi2 = event.GetKinFitResults(true).chi2;
-        sync().phi_sv = COND_VAL(fill_sv, analysis::four_bodies::Calculate_phi(t1, t2, b1, b2, *event.GetHiggsTTMomentum(true), Hbb));
-        sync().phi_1_sv = COND_VAL(fill_sv, analysis::four_bodies::Calculate_phi1(t1, t2, *event.GetHiggsTTMomentum(true), Hbb));
-        sync().phi_2_sv = COND_VAL(fill_sv, analysis::four_bodies::Calculate_phi1(b1, b2, *event.GetHiggsTTMomentum(true), Hbb));
-        sync().costheta_METhtautau_sv = COND_VAL(fill_sv, analysis::four_bodies::Calculate_cosTheta_2bodies(met, *event.GetHiggsTTMomentum(true)));
+        sync().mass_H_kinfit_chi2 = fits.GetKinFitResults().chi2;
+        sync().phi_sv = COND_VAL(fill_sv, analysis::four_bodies::Calculate_phi(t1, t2, b1, b2, *Htt_sv, Hbb));
+        sync().phi_1_sv = COND_VAL(fill_sv, analysis::four_bodies::Calculate_phi1(t1, t2, *Htt_sv, Hbb));
+        sync().phi_2_sv = COND_VAL(fill_sv, analysis::four_bodies::Calculate_phi1(b1, b2, *Htt_sv, Hbb));
+        sync().costheta_METhtautau_sv = COND_VAL(fill_sv, analysis::four_bodies::Calculate_cosTheta_2bodies(met, *Htt_sv));
         sync().costheta_METhbb = analysis::four_bodies::Calculate_cosTheta_2bodies(met, Hbb);
         sync().costheta_b1hbb = analysis::four_bodies::Calculate_cosTheta_2bodies(b1, Hbb);
-        sync().costheta_htautau_svhhMET = COND_VAL(fill_sv, analysis::four_bodies::Calculate_cosTheta_2bodies(*event.GetHiggsTTMomentum(true),
+        sync().costheta_htautau_svhhMET = COND_VAL(fill_sv, analysis::four_bodies::Calculate_cosTheta_2bodies(*Htt_sv,
                                          *event.GetResonanceMomentum(false,true)));
     }
 
@@ -0,0 +1,57 @@
+/*! Test ObjectPool class.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <thread>
+#include "hh-bbtautau/Analysis/include/ObjectPool.h"
+
+#define BOOST_TEST_MODULE ObjectPool_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+using namespace analysis;
+
+BOOST_AUTO_TEST_CASE(object_pool_reuse)
+{
+    ObjectPool<int> pool([]() { return std::make_unique<int>(0); });
+    const int *first_address, *second_address;
+    {
+        auto first = pool.Acquire();
+        auto second = pool.Acquire();
+        BOOST_TEST(first.get() != second.get());
+        first_address = first.get();
+        second_address = second.get();
+        BOOST_TEST(pool.GetNumberOfCreatedObjects() == 2U);
+    }
+    auto reused = pool.Acquire();
+    BOOST_TEST(pool.GetNumberOfCreatedObjects() == 2U);
+    BOOST_TEST((reused.get() == first_address || reused.get() == second_address));
+}
+
+BOOST_AUTO_TEST_CASE(object_pool_outlives_pool)
+{
+    std::shared_ptr<int> object;
+    {
+        ObjectPool<int> pool([]() { return std::make_unique<int>(42); });
+        object = pool.Acquire();
+    }
+    BOOST_TEST(*object == 42);
+    object.reset();
+}
+
+BOOST_AUTO_TEST_CASE(object_pool_exclusive_use)
+{
+    static constexpr int n_threads = 8, n_iterations = 1000;
+    ObjectPool<int> pool([]() { return std::make_unique<int>(0); });
+    std::vector<std::thread> threads;
+    for(int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&]() {
+            for(int n = 0; n < n_iterations; ++n) {
+                auto object = pool.Acquire();
+                ++*object;
+            }
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+    BOOST_TEST(pool.GetNumberOfCreatedObjects() <= static_cast<size_t>(n_threads));
+}
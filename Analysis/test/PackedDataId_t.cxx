@@ -0,0 +1,58 @@
+/*! Test PackedDataId class.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <iostream>
+#include "hh-bbtautau/Analysis/include/PackedDataId.h"
+
+#define BOOST_TEST_MODULE PackedDataId_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+using namespace analysis;
+
+BOOST_AUTO_TEST_CASE(packed_data_id_round_trip)
+{
+    const auto id = EventAnalyzerDataId::Parse("2j2b+R_noVBF/NoCuts/OS_Isolated/None/Central/TTToHadronic");
+    const PackedDataId packed(id);
+    BOOST_TEST(packed.Has<EventCategory>());
+    BOOST_TEST(packed.Has<Dataset>());
+    BOOST_TEST(packed.Unpack().GetName() == id.GetName());
+    BOOST_TEST(PackedDataId(id) == packed);
+    BOOST_TEST(PackedDataId::FromCode(packed.GetCode()) == packed);
+}
+
+BOOST_AUTO_TEST_CASE(packed_data_id_partial)
+{
+    const auto id = EventAnalyzerDataId::Parse("2j2b+R_noVBF/*/OS_Isolated/*/*/Data_Tau");
+    const PackedDataId packed(id);
+    BOOST_TEST(!packed.Has<EventSubCategory>());
+    BOOST_TEST(!packed.Has<UncertaintySource>());
+    BOOST_TEST(packed.Unpack().GetName() == id.GetName());
+
+    const auto full_id = id.Set(UncertaintySource::None);
+    BOOST_TEST(packed.Set(UncertaintySource::None) == PackedDataId(full_id));
+    BOOST_TEST(packed.Set(UncertaintySource::None) != packed);
+}
+
+BOOST_AUTO_TEST_CASE(packed_data_id_hash)
+{
+    const auto id_a = EventAnalyzerDataId::Parse("2j2b+R_noVBF/NoCuts/OS_Isolated/None/Central/DY");
+    const auto id_b = id_a.Set(std::string("TTToHadronic"));
+    std::unordered_set<PackedDataId> ids = { PackedDataId(id_a), PackedDataId(id_b), PackedDataId(id_a) };
+    BOOST_TEST(ids.size() == 2);
+    BOOST_TEST(ids.count(PackedDataId(id_b)));
+}
+
+BOOST_AUTO_TEST_CASE(packed_data_id_order)
+{
+    // The codes of the datasets are assigned in the order of the first use, and the packed ids are ordered by the
+    // codes, independently of the order of the unpacked ids.
+    const auto id_a = EventAnalyzerDataId::Parse("2j2b+R_noVBF/NoCuts/OS_Isolated/None/Central/Order_B");
+    const auto id_b = id_a.Set(std::string("Order_A"));
+    const PackedDataId packed_a(id_a), packed_b(id_b);
+    BOOST_TEST(packed_a.GetCode() < packed_b.GetCode());
+    BOOST_TEST(packed_a < packed_b);
+    BOOST_TEST(!(packed_b < packed_a));
+    BOOST_TEST(!(packed_a < packed_a));
+    BOOST_TEST(id_b < id_a);
+}
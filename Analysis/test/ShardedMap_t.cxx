@@ -0,0 +1,53 @@
+/*! Test ShardedMap class.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "hh-bbtautau/Analysis/include/ShardedMap.h"
+
+#define BOOST_TEST_MODULE ShardedMap_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+using namespace analysis;
+
+BOOST_AUTO_TEST_CASE(sharded_map_get_or_create)
+{
+    ShardedMap<int, std::shared_ptr<int>> map;
+    std::shared_ptr<int> value;
+    BOOST_TEST(!map.Find(1, value));
+
+    const auto created = map.GetOrCreate(1, []() { return std::make_shared<int>(10); });
+    BOOST_TEST(*created == 10);
+    const auto existing = map.GetOrCreate(1, []() { return std::make_shared<int>(20); });
+    BOOST_TEST(existing == created);
+    BOOST_TEST(map.Find(1, value));
+    BOOST_TEST(value == created);
+    BOOST_TEST(map.size() == 1U);
+}
+
+BOOST_AUTO_TEST_CASE(sharded_map_concurrent_insert)
+{
+    static constexpr int n_threads = 8, n_keys = 1000;
+    ShardedMap<int, std::shared_ptr<int>> map;
+    std::atomic<int> n_created(0), n_wrong(0);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&]() {
+            for(int key = 0; key < n_keys; ++key) {
+                const auto value = map.GetOrCreate(key, [&]() {
+                    ++n_created;
+                    return std::make_shared<int>(key);
+                });
+                if(*value != key)
+                    ++n_wrong;
+            }
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+    BOOST_TEST(n_created == n_keys);
+    BOOST_TEST(n_wrong == 0);
+    BOOST_TEST(map.size() == static_cast<size_t>(n_keys));
+}
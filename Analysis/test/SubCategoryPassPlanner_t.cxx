@@ -0,0 +1,52 @@
+/*! Test SubCategoryPassPlanner class.
+This file is part of https://github.com/hh-italian-group/hh-bbtautau. */
+
+#include <iostream>
+#include "hh-bbtautau/Analysis/include/SubCategoryPassPlanner.h"
+
+#define BOOST_TEST_MODULE SubCategoryPassPlanner_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+using namespace analysis;
+
+namespace {
+std::vector<EventSubCategory> CreateSubCategories()
+{
+    const std::vector<SelectionCut> cuts = { SelectionCut::mh, SelectionCut::mhVis, SelectionCut::mhMET,
+                                             SelectionCut::KinematicFitConverged, SelectionCut::lowMET };
+    std::vector<EventSubCategory> subCategories;
+    for(const auto cut : cuts)
+        subCategories.push_back(EventSubCategory().SetCutResult(cut, true));
+    return subCategories;
+}
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(pass_planner_n_parallel)
+{
+    const auto subCategories = CreateSubCategories();
+    SubCategoryPassPlanner planner(2, 0);
+    for(const auto& subCategory : subCategories)
+        planner.AddSubCategory(subCategory);
+    const auto passes = planner.Plan();
+    BOOST_TEST(passes.size() == 3U);
+    BOOST_TEST(passes.at(0).subCategories.size() == 2U);
+    BOOST_TEST(passes.at(2).subCategories.size() == 1U);
+    BOOST_TEST(passes.at(2).subCategories.front() == subCategories.back());
+}
+
+BOOST_AUTO_TEST_CASE(pass_planner_memory_budget)
+{
+    const auto subCategories = CreateSubCategories();
+    const std::vector<size_t> memory = { 60, 50, 40, 30, 150 };
+    SubCategoryPassPlanner planner(1, 100);
+    for(size_t n = 0; n < subCategories.size(); ++n)
+        planner.AddSubCategory(subCategories.at(n), memory.at(n));
+    const auto passes = planner.Plan();
+    BOOST_TEST(passes.size() == 3U);
+    for(const auto& pass : passes)
+        BOOST_TEST((pass.memory_estimate <= 100 || pass.subCategories.size() == 1));
+    BOOST_TEST(passes.at(0).subCategories.front() == subCategories.at(0));
+    BOOST_TEST(passes.at(0).memory_estimate == 100U);
+    BOOST_TEST(passes.at(2).subCategories.front() == subCategories.at(4));
+}